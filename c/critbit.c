@@ -1,10 +1,22 @@
 #include <tcl.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "regex.h"
 
 typedef enum TreeType {
-  T_MAP, T_SET
+  T_MAP, T_SET, T_BAG
 } TreeType;
 
+/*
+ * The low two bits of refCount are flags: NODE_INTERNAL marks an
+ * IntNode and NODE_COUNTED a BagNode leaf. The reference count
+ * proper is kept in the remaining bits.
+ */
+#define NODE_INTERNAL 1
+#define NODE_COUNTED  2
+#define NODE_REF      4
+
 typedef struct Node {
     int refCount;
 } Node;
@@ -23,6 +35,13 @@ typedef struct ExtNode {
     Tcl_Obj *value;
 } ExtNode;
 
+/* Leaf of a treebag; laid out like ExtNode up to the key. */
+typedef struct BagNode {
+    int refCount;
+    Tcl_Obj *key;
+    long count;
+} BagNode;
+
 typedef struct ForState {
     TreeType type;
     Tcl_Obj *keyVar;
@@ -33,9 +52,32 @@ typedef struct ForState {
     int stackCapacity;
 } ForState;
 
+#ifdef TCL_THREADS
+/* Shared state of a parallel bulk build, see bulkBuild. */
+typedef struct BulkJob {
+    TreeType type;
+    ExtNode **leaves;
+    int *start;
+    Node **roots;
+    int nextBucket;
+    Tcl_Mutex mutex;
+    int wanted;                 /* workers still to join, see bulkBuild */
+    int working;                /* workers in bulkWork */
+} BulkJob;
+#endif
+
+/*
+ * Lookup cache kept in the intrep of a key by tree getcache. The
+ * root of the tree last searched is retained, which freezes every
+ * node on the recorded path (nothing reachable from a shared root is
+ * updated in place), so the path itself needs no references.
+ */
 typedef struct TreeKeyRep {
     Node *tree;
-    Tcl_Obj *value;
+    Node **path;  /* root first; path[depth-1] is the closest leaf */
+    int depth;
+    int capacity;
+    int found;    /* whether the leaf's key equals the cached key */
 } TreeKeyRep;
 
 static void freeTreeInternalRep(Tcl_Obj *);
@@ -47,6 +89,10 @@ static void dupTreesetInternalRep(Tcl_Obj *, Tcl_Obj *);
 static void updateStringOfTreeset(Tcl_Obj *);
 static int setTreesetFromAny(Tcl_Interp *, Tcl_Obj *);
 
+static void dupBagInternalRep(Tcl_Obj *, Tcl_Obj *);
+static void updateStringOfBag(Tcl_Obj *);
+static int setBagFromAny(Tcl_Interp *, Tcl_Obj *);
+
 static void freeTreeKeyInternalRep(Tcl_Obj *);
 static void dupTreeKeyInternalRep(Tcl_Obj *, Tcl_Obj *);
 
@@ -66,6 +112,14 @@ const Tcl_ObjType treesetType = {
     setTreesetFromAny
 };
 
+const Tcl_ObjType treebagType = {
+    "treebag",
+    freeTreeInternalRep, /* shared */
+    dupBagInternalRep,
+    updateStringOfBag,
+    setBagFromAny
+};
+
 const Tcl_ObjType treeKeyType = {
   "treekey",
   freeTreeKeyInternalRep,
@@ -82,6 +136,20 @@ static void nodeSet(TreeType, Node **, Tcl_Obj *, Tcl_Obj *);
 static Node *nodeRemove(Node *, Tcl_Obj *);
 static Tcl_Obj *treeKeys(Node *);
 static Tcl_Obj *nodeGetCache(Node *, Tcl_Obj *);
+static Node *newIntNode(Node *, Node *, int, unsigned char);
+static Node *newExtNode(Tcl_Obj *, Tcl_Obj *);
+static Node *newBagNode(Tcl_Obj *, long);
+static int nodeAddCount(Tcl_Interp *, Node **, Tcl_Obj *, long, long *);
+static Tcl_Obj *bagToList(Node *);
+static int globPrefix(const char *, unsigned char **, int *);
+static Node *nodePrefixRoot(Node *, const unsigned char *, int);
+static int treeSelect(Tcl_Interp *, Node *, Tcl_Obj *, Tcl_Obj *, Tcl_Obj **, Node **);
+static int nodeEqual(Node *, Node *, int);
+static int treeEqualCmd(TreeType, Tcl_Interp *, int, Tcl_Obj *const[]);
+
+static int useParallel(int);
+static Node *bulkBuild(TreeType, ExtNode **, int);
+static ExtNode **nodeCollectLeaves(Node *, ExtNode **);
 
 static int forNext(Tcl_Interp *, ForState *);
 static void forPushNode(ForState *, Node *);
@@ -91,25 +159,25 @@ static void forCleanup(ForState *);
 static int
 isInternal(Node *n)
 {
-    return (n->refCount & 1);
+    return (n->refCount & NODE_INTERNAL);
 }
 
 static void
 retainNode(Node *n)
 {
-    n->refCount += 2;
+    n->refCount += NODE_REF;
 }
 
 static int
 nodeShared(Node *n)
 {
-    return n->refCount > 3;
+    return n->refCount >= 2*NODE_REF;
 }
 
 static void
 releaseNode(Node *n)
 {
-    if (n->refCount <= 3) {
+    if (n->refCount < 2*NODE_REF) {
 	if (isInternal(n)) {
 	    IntNode *i = (IntNode *)n;
 	    releaseNode(i->child[0]);
@@ -117,11 +185,11 @@ releaseNode(Node *n)
 	} else {
 	    ExtNode *e = (ExtNode *)n;
 	    Tcl_DecrRefCount(e->key);
-	    Tcl_DecrRefCount(e->value);
+	    if (!(n->refCount & NODE_COUNTED)) Tcl_DecrRefCount(e->value);
 	}
 	ckfree(n);
     } else {
-	n->refCount -= 2;
+	n->refCount -= NODE_REF;
     }
 }
 
@@ -220,9 +288,10 @@ updateStringOfTreeset(Tcl_Obj *obj)
 static void
 freeTreeKeyInternalRep(Tcl_Obj *obj)
 {
-    TreeKeyRep *rep = (TreeKeyRep *)&obj->internalRep;
-    Tcl_DecrRefCount(rep->value);
+    TreeKeyRep *rep = (TreeKeyRep *)obj->internalRep.otherValuePtr;
     releaseNode(rep->tree);
+    ckfree(rep->path);
+    ckfree(rep);
     obj->typePtr = NULL;
 }
 
@@ -231,12 +300,13 @@ dupTreeKeyInternalRep(Tcl_Obj *src, Tcl_Obj *dst)
 {
     TreeKeyRep *srcRep, *dstRep;
 
-    srcRep = (TreeKeyRep *)&src->internalRep;
-    dstRep = (TreeKeyRep *)&dst->internalRep;
-    dstRep->tree = srcRep->tree;
+    srcRep = (TreeKeyRep *)src->internalRep.otherValuePtr;
+    dstRep = ckalloc(sizeof(TreeKeyRep));
+    *dstRep = *srcRep;
     retainNode(dstRep->tree);
-    dstRep->value = srcRep->value;
-    Tcl_IncrRefCount(dstRep->value);
+    dstRep->path = ckalloc(sizeof(Node *) * dstRep->capacity);
+    memcpy(dstRep->path, srcRep->path, sizeof(Node *) * dstRep->depth);
+    dst->internalRep.otherValuePtr = dstRep;
     dst->typePtr = &treeKeyType;
 }
 
@@ -256,12 +326,87 @@ setTreesetFromAny(Tcl_Interp *interp, Tcl_Obj *obj)
     return TCL_OK;
 }
 
+/*
+ * A treebag keeps its root in internalRep.ptrAndLongRep.ptr (which
+ * aliases otherValuePtr, so the tree functions work unchanged) and
+ * the total of all counts in internalRep.ptrAndLongRep.value.
+ */
+static void
+dupBagInternalRep(Tcl_Obj *src, Tcl_Obj *dst)
+{
+    Node *root = src->internalRep.ptrAndLongRep.ptr;
+    if (root) retainNode(root);
+    dst->internalRep.ptrAndLongRep.ptr = root;
+    dst->internalRep.ptrAndLongRep.value = src->internalRep.ptrAndLongRep.value;
+    dst->typePtr = &treebagType;
+}
+
+static void
+updateStringOfBag(Tcl_Obj *obj)
+{
+    Node *n;
+    Tcl_Obj *ls;
+
+    n = obj->internalRep.ptrAndLongRep.ptr;
+    ls = bagToList(n);
+    Tcl_GetString(ls);
+    obj->bytes = ls->bytes;
+    obj->length = ls->length;
+    ls->bytes = NULL;
+    Tcl_DecrRefCount(ls);
+}
+
+/* The string rep is a list of value count pairs, like tree tolist. */
+static int
+setBagFromAny(Tcl_Interp *interp, Tcl_Obj *obj)
+{
+    int objc, i;
+    Tcl_Obj **objv;
+    Node *root = NULL;
+    long count, total = 0;
+
+    if (obj->typePtr == &treebagType) return TCL_OK;
+    if (Tcl_ListObjGetElements(interp, obj, &objc, &objv) != TCL_OK) return TCL_ERROR;
+    if ((objc & 1) == 1) {
+	Tcl_SetObjResult(interp, Tcl_NewStringObj("missing count to go with value", -1));
+	return TCL_ERROR;
+    }
+    for (i = 0; i < objc; i += 2) {
+        if (Tcl_GetLongFromObj(interp, objv[i+1], &count) != TCL_OK) goto error;
+        if (count <= 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad count \"%ld\"", count));
+            goto error;
+        }
+        if (nodeAddCount(interp, &root, objv[i], count, &total) != TCL_OK) goto error;
+    }
+    if (obj->typePtr && obj->typePtr->freeIntRepProc) obj->typePtr->freeIntRepProc(obj);
+    obj->internalRep.ptrAndLongRep.ptr = root;
+    obj->internalRep.ptrAndLongRep.value = total;
+    obj->typePtr = &treebagType;
+    return TCL_OK;
+
+error:
+    if (root) releaseNode(root);
+    return TCL_ERROR;
+}
+
 static Node *
 treeCreate(int objc, Tcl_Obj *const objv[])
 {
     Node *root = NULL;
+    ExtNode **leaves;
     int i;
 
+    if (useParallel(objc/2)) {
+        leaves = ckalloc(sizeof(ExtNode *) * (objc/2));
+        for (i = 0; i < objc; i += 2) {
+            leaves[i/2] = (ExtNode *)newExtNode(objv[i], objv[i+1]);
+        }
+        root = bulkBuild(T_MAP, leaves, objc/2);
+        ckfree(leaves);
+        return root;
+    }
+
     for (i = 0; i < objc; i += 2) nodeSet(T_MAP, &root, objv[i], objv[i+1]);
 
     /* root will already be referenced if non-null (due to nodeAssign) */
@@ -272,9 +417,20 @@ static Node *
 treesetCreate(int objc, Tcl_Obj *const objv[])
 {
     Node *root = NULL;
+    ExtNode **leaves;
     int i;
 
-    for (i = 0; i < objc; i++) nodeSet(T_SET, &root, objv[i], Tcl_NewObj());
+    if (useParallel(objc)) {
+        leaves = ckalloc(sizeof(ExtNode *) * objc);
+        for (i = 0; i < objc; i++) {
+            leaves[i] = (ExtNode *)newExtNode(objv[i], Tcl_NewObj());
+        }
+        root = bulkBuild(T_SET, leaves, objc);
+        ckfree(leaves);
+        return root;
+    }
+
+    for (i = 0; i < objc; i++) nodeSet(T_SET, &root, objv[i], NULL);
 
     /* root will already be referenced if non-null (due to nodeAssign) */
     return root;
@@ -308,6 +464,28 @@ nodeToList(Node *n, Tcl_Obj **objv)
     }
 }
 
+static Tcl_Obj *
+bagToList(Node *n)
+{
+    Tcl_Obj **objv, *ls;
+    ExtNode **leaves;
+    int i, size;
+
+    if (!n) return Tcl_NewObj();
+    size = nodeSize(n);
+    leaves = ckalloc(sizeof(ExtNode *) * size);
+    objv = ckalloc(sizeof(Tcl_Obj *) * size * 2);
+    nodeCollectLeaves(n, leaves);
+    for (i = 0; i < size; i++) {
+        objv[2*i] = leaves[i]->key;
+        objv[2*i+1] = Tcl_NewLongObj(((BagNode *)leaves[i])->count);
+    }
+    ls = Tcl_NewListObj(size*2, objv);
+    ckfree(objv);
+    ckfree(leaves);
+    return ls;
+}
+
 static void
 nodeCollectKeys(Node *n, Tcl_Obj *ls)
 {
@@ -321,6 +499,19 @@ nodeCollectKeys(Node *n, Tcl_Obj *ls)
     }
 }
 
+static ExtNode **
+nodeCollectLeaves(Node *n, ExtNode **leaves)
+{
+    if (isInternal(n)) {
+	IntNode *i = (IntNode *)n;
+	leaves = nodeCollectLeaves(i->child[0], leaves);
+	return nodeCollectLeaves(i->child[1], leaves);
+    } else {
+	*leaves = (ExtNode *)n;
+	return leaves+1;
+    }
+}
+
 static Tcl_Obj *
 treeKeys(Node *tree)
 {
@@ -329,6 +520,245 @@ treeKeys(Node *tree)
     return res;
 }
 
+/*
+ * Split a glob pattern into its literal prefix (with backslash
+ * escapes removed) and the remainder. Returns the offset in pattern
+ * where the remainder starts. *prefixPtr must be freed with ckfree.
+ */
+static int
+globPrefix(const char *pattern, unsigned char **prefixPtr, int *prefixLen)
+{
+    const char *p = pattern;
+    unsigned char *prefix;
+    int n = 0, len;
+
+    prefix = ckalloc(strlen(pattern) + 1);
+    for (;;) {
+        switch (*p) {
+        case '*': case '?': case '[': case '\0':
+            goto done;
+        case '\\':
+            if (p[1] == '\0') goto done;
+            p++;
+            /* fall through */
+        default:
+            len = Tcl_UtfNext(p) - p;
+            memcpy(prefix+n, p, len);
+            n += len;
+            p += len;
+        }
+    }
+done:
+    *prefixPtr = prefix;
+    *prefixLen = n;
+    return p - pattern;
+}
+
+/*
+ * Return the largest subtree whose keys all start with prefix, or
+ * NULL if no key does.
+ */
+static Node *
+nodePrefixRoot(Node *n, const unsigned char *prefix, int prefixLen)
+{
+    Node *top = n;
+    unsigned char *k;
+    int l;
+
+    if (!n) return NULL;
+    while (isInternal(n)) {
+        IntNode *i = (IntNode *)n;
+        int dir, c = 0;
+        if (i->byte < prefixLen) c = prefix[i->byte];
+        dir = (1 + (i->otherBits | c)) >> 8;
+        n = i->child[dir];
+        if (i->byte < prefixLen) top = n;
+    }
+
+    k = (unsigned char *)Tcl_GetStringFromObj(((ExtNode *)n)->key, &l);
+    if (l < prefixLen || memcmp(k, prefix, prefixLen) != 0) return NULL;
+    return top;
+}
+
+/*
+ * Keys reaching here already share the literal prefix of the glob, so
+ * only the remainder of the pattern is tested.
+ */
+static void
+nodeCollectGlob(Node *n, int skip, const char *pattern, Tcl_Obj *ls)
+{
+    if (isInternal(n)) {
+        IntNode *i = (IntNode *)n;
+        nodeCollectGlob(i->child[0], skip, pattern, ls);
+        nodeCollectGlob(i->child[1], skip, pattern, ls);
+    } else {
+        ExtNode *e = (ExtNode *)n;
+        if (Tcl_StringMatch(Tcl_GetString(e->key) + skip, pattern))
+            Tcl_ListObjAppendElement(NULL, ls, e->key);
+    }
+}
+
+/*
+ * Returns n itself if every key below it matches, so that unfiltered
+ * subtrees are shared with the original tree. Like nodeRemove, the
+ * result has not been retained.
+ */
+static Node *
+nodeFilterGlob(Node *n, int skip, const char *pattern)
+{
+    if (isInternal(n)) {
+        IntNode *i = (IntNode *)n;
+        Node *left, *right;
+
+        left = nodeFilterGlob(i->child[0], skip, pattern);
+        right = nodeFilterGlob(i->child[1], skip, pattern);
+        if (left == i->child[0] && right == i->child[1]) return n;
+        if (!left) return right;
+        if (!right) return left;
+        return newIntNode(left, right, i->byte, i->otherBits);
+    } else {
+        ExtNode *e = (ExtNode *)n;
+        return Tcl_StringMatch(Tcl_GetString(e->key) + skip, pattern) ? n : NULL;
+    }
+}
+
+/*
+ * Parse "-glob pattern" or "-prefix pattern" and select matching keys
+ * from tree. If keysPtr is non-NULL the keys are returned as a list,
+ * otherwise *resultPtr is set to the (unretained) filtered tree.
+ */
+static int
+treeSelect(Tcl_Interp *interp, Node *tree, Tcl_Obj *modeObj, Tcl_Obj *patternObj,
+           Tcl_Obj **keysPtr, Node **resultPtr)
+{
+    static const char *const modes[] = {"-glob", "-prefix", NULL};
+    enum mode {MODE_GLOB, MODE_PREFIX};
+    int mode, prefixLen, rest;
+    unsigned char *prefix;
+    const char *pattern;
+    Node *top;
+
+    if (Tcl_GetIndexFromObj(interp, modeObj, modes, "mode", 0, &mode) != TCL_OK)
+        return TCL_ERROR;
+
+    pattern = Tcl_GetString(patternObj);
+    if (mode == MODE_PREFIX) {
+        prefix = (unsigned char *)pattern;
+        prefixLen = patternObj->length;
+        rest = -1;
+    } else {
+        rest = globPrefix(pattern, &prefix, &prefixLen);
+    }
+
+    top = nodePrefixRoot(tree, prefix, prefixLen);
+    if (keysPtr) {
+        *keysPtr = Tcl_NewListObj(0, NULL);
+        if (top) {
+            if (rest == -1) nodeCollectKeys(top, *keysPtr);
+            else nodeCollectGlob(top, prefixLen, pattern + rest, *keysPtr);
+        }
+    } else {
+        if (top && rest != -1) top = nodeFilterGlob(top, prefixLen, pattern + rest);
+        *resultPtr = top;
+    }
+
+    if (rest != -1) ckfree(prefix);
+    return TCL_OK;
+}
+
+/*
+ * Like nodeFilterGlob, for the keys a regex matches. All keys below n
+ * start with the first pos bytes of key (that of a leaf below n), and
+ * state is the walk's after those. Each internal node steps it on up
+ * to the char holding its crit byte, which its keys all share, so a
+ * subtree is dropped or kept whole as soon as that settles all of its
+ * keys, and the bytes keys share are only stepped over once.
+ */
+static Node *
+nodeFilterRegex(RegexWalk *walk, Node *n, const void *state, int pos,
+                const char *key)
+{
+    Node *left, *right, *leaf;
+    int len;
+
+    if (isInternal(n)) {
+        IntNode *i = (IntNode *)n;
+        int r, b = i->byte;
+
+        while (b > pos && (key[b] & 0xC0) == 0x80) b--;
+        r = regexWalkStep(walk, &state, key + pos, key + b);
+        if (r == REGEX_WALK_MATCH) return n;
+        if (r == REGEX_WALK_DEAD) return NULL;
+
+        left = nodeFilterRegex(walk, i->child[0], state, b, key);
+        leaf = i->child[1];
+        while (isInternal(leaf)) leaf = ((IntNode *)leaf)->child[0];
+        right = nodeFilterRegex(walk, i->child[1], state, b,
+                                Tcl_GetString(((ExtNode *)leaf)->key));
+        if (left == i->child[0] && right == i->child[1]) return n;
+        if (!left) return right;
+        if (!right) return left;
+        return newIntNode(left, right, i->byte, i->otherBits);
+    } else {
+        key = Tcl_GetStringFromObj(((ExtNode *)n)->key, &len);
+        return regexWalkFinish(walk, state, key, key + pos, key + len) ? n : NULL;
+    }
+}
+
+static int
+objStringEqual(Tcl_Obj *a, Tcl_Obj *b)
+{
+    const char *as, *bs;
+    int al, bl;
+
+    if (a == b) return 1;
+    as = Tcl_GetStringFromObj(a, &al);
+    bs = Tcl_GetStringFromObj(b, &bl);
+    return al == bl && memcmp(as, bs, al) == 0;
+}
+
+/*
+ * Values compared by nodeEqual: not at all (sets), by string or by
+ * Tcl_Obj identity.
+ */
+enum { VALUECMP_NONE, VALUECMP_STRING, VALUECMP_IDENTITY };
+
+/*
+ * Structural equality. Since critbit trees are canonical, equal key
+ * sets have identical shapes, so the walk fails at the first internal
+ * node whose crit position or size differs and skips pointer-equal
+ * (shared) subtrees entirely.
+ */
+static int
+nodeEqual(Node *a, Node *b, int valueCmp)
+{
+    ExtNode *ea, *eb;
+
+    for (;;) {
+        if (a == b) return 1;
+        if (!a || !b || isInternal(a) != isInternal(b)) return 0;
+        if (!isInternal(a)) break;
+        {
+            IntNode *ia = (IntNode *)a, *ib = (IntNode *)b;
+            if (ia->byte != ib->byte || ia->otherBits != ib->otherBits ||
+                ia->size != ib->size ||
+                !nodeEqual(ia->child[0], ib->child[0], valueCmp))
+                return 0;
+            a = ia->child[1];
+            b = ib->child[1];
+        }
+    }
+
+    ea = (ExtNode *)a;
+    eb = (ExtNode *)b;
+    if (!objStringEqual(ea->key, eb->key)) return 0;
+    switch (valueCmp) {
+    case VALUECMP_STRING: return objStringEqual(ea->value, eb->value);
+    case VALUECMP_IDENTITY: return ea->value == eb->value;
+    }
+    return 1;
+}
+
 static ExtNode *
 nodeGet(Node *n, Tcl_Obj *key)
 {
@@ -356,7 +786,7 @@ static Node *
 newIntNode(Node *left, Node *right, int byte, unsigned char otherBits)
 {
     IntNode *n = ckalloc(sizeof(IntNode));
-    n->refCount = 1; /* mark internal */
+    n->refCount = NODE_INTERNAL;
     n->child[0] = left;
     retainNode(n->child[0]);
     n->child[1] = right;
@@ -380,8 +810,58 @@ newExtNode(Tcl_Obj *key, Tcl_Obj *value)
 }
 
 static Node *
-nodeInsert(Node *n, Tcl_Obj *key, Tcl_Obj *value, int newByte,
-           unsigned char newOtherBits, int newDir)
+newBagNode(Tcl_Obj *key, long count)
+{
+    BagNode *n = ckalloc(sizeof(BagNode));
+    n->refCount = NODE_COUNTED;
+    n->key = key;
+    Tcl_IncrRefCount(n->key);
+    n->count = count;
+    return (Node *)n;
+}
+
+/*
+ * Compare key against leaf e, the closest match found by descending
+ * the tree. Returns 0 if the keys are equal, otherwise 1 with the
+ * critical byte and bit of the new internal node and the direction
+ * of e under it.
+ */
+static int
+keyCrit(ExtNode *e, const unsigned char *keyStr, int keyLen, int *newBytePtr,
+        unsigned char *newOtherBitsPtr, int *newDirPtr)
+{
+    unsigned char *k, newOtherBits;
+    int l, newByte;
+
+    k = (unsigned char *)Tcl_GetStringFromObj(e->key, &l);
+    for (newByte = 0; newByte < keyLen; newByte++) {
+	if (keyStr[newByte] != k[newByte]) {
+	    newOtherBits = keyStr[newByte] ^ k[newByte];
+	    goto different;
+	}
+    }
+    if (k[newByte] != '\0') {
+	newOtherBits = k[newByte];
+	goto different;
+    }
+    return 0;
+
+different:
+    while (newOtherBits & (newOtherBits - 1)) newOtherBits &= (newOtherBits - 1);
+    newOtherBits ^= 255;
+    *newBytePtr = newByte;
+    *newOtherBitsPtr = newOtherBits;
+    *newDirPtr = (1 + (newOtherBits | k[newByte])) >> 8;
+    return 1;
+}
+
+/*
+ * Path-copying insert of leaf, which must have a zero reference
+ * count. With newDir == -1 the leaf replaces the existing leaf with
+ * the same key.
+ */
+static Node *
+nodeInsert(Node *n, Node *leaf, int newByte, unsigned char newOtherBits, int newDir)
 {
     unsigned char *keyStr;
     int c = 0, keyLen;
@@ -389,39 +869,39 @@ nodeInsert(Node *n, Tcl_Obj *key, Tcl_Obj *value, int newByte,
     IntNode *i;
     
     i = (IntNode *)n;
-    keyStr = (unsigned char *)Tcl_GetStringFromObj(key, &keyLen);
+    keyStr = (unsigned char *)Tcl_GetStringFromObj(((ExtNode *)leaf)->key, &keyLen);
     if (isInternal(n) &&
 	(newDir == -1 || i->byte < newByte ||
 	 (i->byte == newByte && newOtherBits > i->otherBits))) {
 	if (i->byte < keyLen) c = keyStr[i->byte];
 	if ((1 + (i->otherBits | c)) >> 8) {
 	    left = i->child[0];
-	    right = nodeInsert(i->child[1], key, value, newByte, newOtherBits, newDir);
+	    right = nodeInsert(i->child[1], leaf, newByte, newOtherBits, newDir);
 	} else {
-	    left = nodeInsert(i->child[0], key, value, newByte, newOtherBits, newDir);
+	    left = nodeInsert(i->child[0], leaf, newByte, newOtherBits, newDir);
 	    right = i->child[1];
 	}
 	return newIntNode(left, right, i->byte, i->otherBits);
     } else if (newDir == -1) {
-	return newExtNode(key, value);
+	return leaf;
     } else {
-	Node *new = newExtNode(key, value);
-	if (newDir) { left = new; right = n; }
-	else { left = n; right = new; }
+	if (newDir) { left = leaf; right = n; }
+	else { left = n; right = leaf; }
 	return newIntNode(left, right, newByte, newOtherBits);
     }
 }
 
+/* In-place counterpart of nodeInsert, for unshared paths only. */
 static void
-nodeInsertInPlace(Node **loc, Tcl_Obj *key, Tcl_Obj *value, int newByte,
+nodeInsertInPlace(Node **loc, Node *leaf, int newByte,
                   unsigned char newOtherBits, int newDir)
 {
     unsigned char *keyStr;
-    int c = 0, keyLen, dir;
-    Node *left, *right, *n, *newNode;
+    int c, keyLen, dir;
+    Node *left, *right, *n;
     IntNode *i;
     
-    keyStr = (unsigned char *)Tcl_GetStringFromObj(key, &keyLen);
+    keyStr = (unsigned char *)Tcl_GetStringFromObj(((ExtNode *)leaf)->key, &keyLen);
 
     for (;;) {
         n = *loc;
@@ -430,14 +910,13 @@ nodeInsertInPlace(Node **loc, Tcl_Obj *key, Tcl_Obj *value, int newByte,
         if (i->byte > newByte) break;
         if (i->byte == newByte && i->otherBits > newOtherBits) break;
         i->size++;
-        if (i->byte < keyLen) c = keyStr[i->byte];
+        c = (i->byte < keyLen) ? keyStr[i->byte] : 0;
         dir = (1 + (i->otherBits | c)) >> 8;
         loc = &i->child[dir];
     }
 
-    newNode = newExtNode(key, value);
-    if (newDir) { left = newNode; right = *loc; }
-    else { left = *loc; right = newNode; }
+    if (newDir) { left = leaf; right = *loc; }
+    else { left = *loc; right = leaf; }
     nodeAssign(loc, newIntNode(left, right, newByte, newOtherBits));
 }
         
@@ -445,8 +924,8 @@ static void
 nodeSet(TreeType type, Node **loc, Tcl_Obj *key, Tcl_Obj *value)
 {
     Node *n;
-    unsigned char *keyStr, *k, newOtherBits;
-    int l, keyLen, newByte, newDir;
+    unsigned char *keyStr, newOtherBits;
+    int keyLen, newByte, newDir;
     ExtNode *e;
     int shared;
 
@@ -471,89 +950,504 @@ nodeSet(TreeType type, Node **loc, Tcl_Obj *key, Tcl_Obj *value)
     }
 
     e = (ExtNode *)n;
-    k = (unsigned char *)Tcl_GetStringFromObj(e->key, &l);
-    for (newByte = 0; newByte < keyLen; newByte++) {
-	if (keyStr[newByte] != k[newByte]) {
-	    newOtherBits = keyStr[newByte] ^ k[newByte];
-	    goto different;
-	}
+    if (!keyCrit(e, keyStr, keyLen, &newByte, &newOtherBits, &newDir)) {
+        if (type == T_SET) {
+            /* value exists in tree, nothing else to do */
+            return;
+        } else if (!shared && !nodeShared(n)) {
+            Tcl_DecrRefCount(e->value);
+            e->value = value;
+            Tcl_IncrRefCount(value);
+        } else {
+            nodeAssign(loc, nodeInsert(*loc, newExtNode(key, value), -1, -1, -1));
+        }
+        return;
+    }
+
+    if (type == T_SET) value = Tcl_NewObj();
+    if (shared) {
+        nodeAssign(loc, nodeInsert(*loc, newExtNode(key, value), newByte, newOtherBits, newDir));
+    } else {
+        nodeInsertInPlace(loc, newExtNode(key, value), newByte, newOtherBits, newDir);
+    }
+}
+
+static int
+countOverflow(Tcl_Interp *interp)
+{
+    if (interp) Tcl_SetObjResult(interp, Tcl_NewStringObj("integer overflow", -1));
+    return TCL_ERROR;
+}
+
+/*
+ * Add delta (which may be negative) to the count of key in the bag
+ * at *loc, and the change to the total count of the bag to *totalPtr.
+ * A count dropping to zero or below removes the leaf. Unshared leaves
+ * are updated in place. A count or total that would go past LONG_MAX
+ * is an error, and leaves the bag as it was.
+ */
+static int
+nodeAddCount(Tcl_Interp *interp, Node **loc, Tcl_Obj *key, long delta,
+             long *totalPtr)
+{
+    Node *n;
+    BagNode *b;
+    unsigned char *keyStr, newOtherBits;
+    int keyLen, newByte, newDir;
+    int shared;
+
+    if (delta == 0) return TCL_OK;
+    if (delta > 0 && delta > LONG_MAX - *totalPtr) return countOverflow(interp);
+    if (!*loc) {
+        if (delta < 0) return TCL_OK;
+        nodeAssign(loc, newBagNode(key, delta));
+        *totalPtr += delta;
+        return TCL_OK;
+    }
+
+    keyStr = (unsigned char *)Tcl_GetStringFromObj(key, &keyLen);
+    n = *loc;
+    shared = 0;
+    while (isInternal(n)) {
+	int dir, c = 0;
+	IntNode *i = (IntNode *)n;
+
+        if (nodeShared(n)) shared = 1;
+	if (i->byte < keyLen) c = keyStr[i->byte];
+	dir = (1 + (i->otherBits | c)) >> 8;
+	n = i->child[dir];
+    }
+
+    b = (BagNode *)n;
+    if (keyCrit((ExtNode *)b, keyStr, keyLen, &newByte, &newOtherBits, &newDir)) {
+        if (delta < 0) return TCL_OK;
+        if (shared) {
+            nodeAssign(loc, nodeInsert(*loc, newBagNode(key, delta), newByte, newOtherBits, newDir));
+        } else {
+            nodeInsertInPlace(loc, newBagNode(key, delta), newByte, newOtherBits, newDir);
+        }
+        *totalPtr += delta;
+        return TCL_OK;
+    }
+
+    if (delta > LONG_MAX - b->count) return countOverflow(interp);
+    if (b->count + delta <= 0) {
+        delta = -b->count;
+        nodeAssign(loc, nodeRemove(*loc, key));
+    } else if (!shared && !nodeShared(n)) {
+        b->count += delta;
+    } else {
+        nodeAssign(loc, nodeInsert(*loc, newBagNode(key, b->count + delta), -1, -1, -1));
+    }
+    *totalPtr += delta;
+    return TCL_OK;
+}
+
+/* As with nodeSet, an in-place version is also possible */
+static Node *
+nodeRemove(Node *n, Tcl_Obj *key)
+{
+    IntNode *i;
+    ExtNode *e;
+    int c = 0, dir, keyLen, l;
+    Node *children[2];
+    unsigned char *keyStr, *k;
+
+    if (!n) return NULL;
+    keyStr = (unsigned char *)Tcl_GetStringFromObj(key, &keyLen);
+    if (isInternal(n)) {
+        i = (IntNode *)n;
+        if (i->byte < keyLen) c = keyStr[i->byte];
+        dir = (1 + (i->otherBits | c)) >> 8;
+        children[0] = i->child[0];
+        children[1] = i->child[1];
+        children[dir] = nodeRemove(i->child[dir], key);
+        if (!children[dir]) return i->child[1-dir];
+        return newIntNode(children[0], children[1], i->byte, i->otherBits);
+    } else {
+        e = (ExtNode *)n;
+        k = (unsigned char *)Tcl_GetStringFromObj(e->key, &l);
+        return (keyLen == l && memcmp(keyStr, k, keyLen) == 0) ? NULL : n;
+    }
+}
+
+/*
+ * Parallel bulk construction. Creating or merging very large trees
+ * partitions the leaves by the two bytes following the longest common
+ * prefix of all keys; every partition is built into an independent
+ * subtree by a pool of worker threads, and the subtrees are then
+ * joined under internal nodes for those two bytes. Because critbit
+ * trees are canonical the result is the same tree the serial path
+ * builds.
+ *
+ * Workers are started by the first build that wants them and then wait
+ * for the next one; they exit with the process. A build posts itself
+ * as the pool's job, or, when another thread's build holds the pool,
+ * does its work alone.
+ *
+ * Workers never touch Tcl_Obj reference counts or string reps: the
+ * leaves are created and their key strings generated beforehand, and
+ * the calling thread holds an extra reference on every leaf so that a
+ * leaf displaced by a duplicate key is never freed by a worker.
+ */
+
+#define BULK_BUCKETS 65536
+
+/* The settings and the pool are guarded by parallelMutex. */
+static int parallelThreshold = 100000; /* number of elements */
+static int parallelThreads = -1; /* -1: number of processors online */
+
+#ifdef TCL_THREADS
+static struct {
+    BulkJob *job;               /* NULL when no build holds the pool */
+    Tcl_ThreadId *threads;
+    int size;                   /* workers started */
+    int exiting;
+    Tcl_Condition wake;         /* job posted, or exiting */
+    Tcl_Condition done;         /* a worker left its job */
+} pool;
+#endif
+
+TCL_DECLARE_MUTEX(parallelMutex)
+
+/* Must hold parallelMutex. */
+static int
+getParallelThreads(void)
+{
+    if (parallelThreads == -1) {
+#if defined(TCL_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+        parallelThreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (parallelThreads < 1) parallelThreads = 1;
+        if (parallelThreads > 8) parallelThreads = 8;
+#else
+        parallelThreads = 1;
+#endif
+    }
+    return parallelThreads;
+}
+
+static int
+useParallel(int n)
+{
+#ifdef TCL_THREADS
+    int result;
+
+    Tcl_MutexLock(&parallelMutex);
+    result = n > 0 && n >= parallelThreshold && getParallelThreads() > 1;
+    Tcl_MutexUnlock(&parallelMutex);
+    return result;
+#else
+    return 0;
+#endif
+}
+
+/* Insert leaf into an unshared tree under construction. */
+static void
+bulkInsert(TreeType type, Node **root, ExtNode *leaf)
+{
+    unsigned char *keyStr, newOtherBits;
+    int keyLen, newByte, newDir;
+    Node **loc;
+
+    if (!*root) {
+        nodeAssign(root, (Node *)leaf);
+        return;
+    }
+
+    keyStr = (unsigned char *)Tcl_GetStringFromObj(leaf->key, &keyLen);
+    loc = root;
+    while (isInternal(*loc)) {
+        IntNode *i = (IntNode *)*loc;
+        int c = (i->byte < keyLen) ? keyStr[i->byte] : 0;
+        loc = &i->child[(1 + (i->otherBits | c)) >> 8];
+    }
+
+    if (keyCrit((ExtNode *)*loc, keyStr, keyLen, &newByte, &newOtherBits, &newDir)) {
+        nodeInsertInPlace(root, (Node *)leaf, newByte, newOtherBits, newDir);
+    } else if (type == T_MAP) {
+        /* Later value wins. Displaced leaf is still referenced by caller. */
+        nodeAssign(loc, (Node *)leaf);
+    }
+}
+
+#ifdef TCL_THREADS
+static void
+bulkWork(BulkJob *job)
+{
+    int b, i;
+    Node *root;
+
+    for (;;) {
+        Tcl_MutexLock(&job->mutex);
+        do {
+            b = job->nextBucket++;
+        } while (b < BULK_BUCKETS && job->start[b] == job->start[b+1]);
+        Tcl_MutexUnlock(&job->mutex);
+        if (b >= BULK_BUCKETS) return;
+
+        root = NULL;
+        for (i = job->start[b]; i < job->start[b+1]; i++) {
+            bulkInsert(job->type, &root, job->leaves[i]);
+        }
+        job->roots[b] = root;
+    }
+}
+
+static Tcl_ThreadCreateType
+poolWorker(ClientData cd)
+{
+    BulkJob *job;
+
+    Tcl_MutexLock(&parallelMutex);
+    for (;;) {
+        while (!pool.exiting && (!pool.job || pool.job->wanted == 0)) {
+            Tcl_ConditionWait(&pool.wake, &parallelMutex, NULL);
+        }
+        if (pool.exiting) break;
+        job = pool.job;
+        job->wanted--;
+        job->working++;
+        Tcl_MutexUnlock(&parallelMutex);
+        bulkWork(job);
+        Tcl_MutexLock(&parallelMutex);
+        job->working--;
+        Tcl_ConditionNotify(&pool.done);
+    }
+    Tcl_MutexUnlock(&parallelMutex);
+    Tcl_ExitThread(TCL_OK);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/* Stop the workers before Tcl finalizes the mutex they wait on. */
+static void
+poolExit(ClientData cd)
+{
+    int i, result;
+
+    Tcl_MutexLock(&parallelMutex);
+    pool.exiting = 1;
+    Tcl_ConditionNotify(&pool.wake);
+    Tcl_MutexUnlock(&parallelMutex);
+    for (i = 0; i < pool.size; i++) Tcl_JoinThread(pool.threads[i], &result);
+    if (pool.threads) ckfree(pool.threads);
+    pool.threads = NULL;
+    pool.size = 0;
+}
+
+/* Start workers until there are n. Must hold parallelMutex. */
+static void
+poolGrow(int n)
+{
+    if (n <= pool.size || pool.exiting) return;
+    if (!pool.threads) Tcl_CreateExitHandler(poolExit, NULL);
+    pool.threads = ckrealloc(pool.threads, sizeof(Tcl_ThreadId) * n);
+    while (pool.size < n &&
+           Tcl_CreateThread(&pool.threads[pool.size], poolWorker, NULL,
+                            TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) == TCL_OK) {
+        pool.size++;
+    }
+}
+
+/*
+ * Join the subtrees of buckets [lo, hi), which differ only in the low
+ * bit+1 bits of their bucket number.
+ */
+static Node *
+bulkJoin(Node **roots, int lo, int hi, int bit, int lcp)
+{
+    Node *left, *right;
+    int mid;
+
+    if (hi - lo == 1) return roots[lo];
+    mid = (lo + hi) >> 1;
+    left = bulkJoin(roots, lo, mid, bit-1, lcp);
+    right = bulkJoin(roots, mid, hi, bit-1, lcp);
+    if (!left) return right;
+    if (!right) return left;
+    return newIntNode(left, right, lcp + (bit < 8), ~(1 << (bit & 7)) & 255);
+}
+#endif
+
+/*
+ * Build a tree from leaves, inserted in order. Returns a referenced
+ * root. The caller keeps ownership of its references to the leaves.
+ */
+static Node *
+bulkBuild(TreeType type, ExtNode **leaves, int n)
+{
+    Node *root = NULL;
+    int i;
+#ifdef TCL_THREADS
+    unsigned char *first, *k;
+    int *bucket, firstLen, l, lcp, posted;
+    BulkJob job;
+
+    /* Strings must exist before any worker looks at them. */
+    for (i = 0; i < n; i++) {
+        Tcl_GetString(leaves[i]->key);
+        retainNode((Node *)leaves[i]);
+    }
+
+    first = (unsigned char *)Tcl_GetStringFromObj(leaves[0]->key, &firstLen);
+    lcp = firstLen;
+    for (i = 1; i < n && lcp > 0; i++) {
+        k = (unsigned char *)Tcl_GetStringFromObj(leaves[i]->key, &l);
+        if (l < lcp) lcp = l;
+        for (l = 0; l < lcp && k[l] == first[l]; l++) ;
+        lcp = l;
+    }
+
+    /* Stable counting sort of the leaves into buckets. */
+    bucket = ckalloc(sizeof(int) * n);
+    job.start = ckalloc(sizeof(int) * (BULK_BUCKETS + 1));
+    memset(job.start, 0, sizeof(int) * (BULK_BUCKETS + 1));
+    for (i = 0; i < n; i++) {
+        k = (unsigned char *)Tcl_GetStringFromObj(leaves[i]->key, &l);
+        bucket[i] = (l > lcp ? k[lcp] << 8 : 0) | (l > lcp+1 ? k[lcp+1] : 0);
+        job.start[bucket[i]+1]++;
     }
-    if (k[newByte] != '\0') {
-	newOtherBits = k[newByte];
-	goto different;
+    for (i = 0; i < BULK_BUCKETS; i++) job.start[i+1] += job.start[i];
+    job.leaves = ckalloc(sizeof(ExtNode *) * n);
+    for (i = 0; i < n; i++) job.leaves[job.start[bucket[i]]++] = leaves[i];
+    for (i = BULK_BUCKETS; i > 0; i--) job.start[i] = job.start[i-1];
+    job.start[0] = 0;
+    ckfree(bucket);
+
+    job.type = type;
+    job.roots = ckalloc(sizeof(Node *) * BULK_BUCKETS);
+    memset(job.roots, 0, sizeof(Node *) * BULK_BUCKETS);
+    job.nextBucket = 0;
+    job.mutex = NULL;
+
+    job.working = 0;
+
+    /* The calling thread works as well. */
+    Tcl_MutexLock(&parallelMutex);
+    posted = !pool.job;
+    if (posted) {
+        job.wanted = getParallelThreads() - 1;
+        poolGrow(job.wanted);
+        if (job.wanted > pool.size) job.wanted = pool.size;
+        pool.job = &job;
+        Tcl_ConditionNotify(&pool.wake);
     }
-    if (type == T_SET) {
-        /* value exists in tree, nothing else to do */
-        return;
-    } else if (!shared && !nodeShared(n)) {
-        Tcl_DecrRefCount(e->value);
-        e->value = value;
-        Tcl_IncrRefCount(value);
-    } else {
-        nodeAssign(loc, nodeInsert(*loc, key, value, -1, -1, -1));
+    Tcl_MutexUnlock(&parallelMutex);
+    bulkWork(&job);
+    if (posted) {
+        Tcl_MutexLock(&parallelMutex);
+        pool.job = NULL;
+        while (job.working > 0) {
+            Tcl_ConditionWait(&pool.done, &parallelMutex, NULL);
+        }
+        Tcl_MutexUnlock(&parallelMutex);
     }
-    return;
-    
-different:
-    if (type == T_SET) value = Tcl_NewObj();
-    while (newOtherBits & (newOtherBits - 1)) newOtherBits &= (newOtherBits - 1);
-    newOtherBits ^= 255;
-    newDir = (1 + (newOtherBits | k[newByte])) >> 8;
-    if (shared) {
-        nodeAssign(loc, nodeInsert(*loc, key, value, newByte, newOtherBits, newDir));
-    } else {
-        nodeInsertInPlace(loc, key, value, newByte, newOtherBits, newDir);
+    Tcl_MutexFinalize(&job.mutex);
+
+    root = bulkJoin(job.roots, 0, BULK_BUCKETS, 15, lcp);
+    if (root) retainNode(root);
+    for (i = 0; i < BULK_BUCKETS; i++) {
+        if (job.roots[i]) releaseNode(job.roots[i]);
+    }
+    for (i = 0; i < n; i++) releaseNode((Node *)leaves[i]);
+    ckfree(job.roots);
+    ckfree(job.leaves);
+    ckfree(job.start);
+#else
+    for (i = 0; i < n; i++) {
+        retainNode((Node *)leaves[i]);
+        bulkInsert(type, &root, leaves[i]);
     }
+    for (i = 0; i < n; i++) releaseNode((Node *)leaves[i]);
+#endif
+    return root;
 }
 
-/* As with nodeSet, an in-place version is also possible */
-static Node *
-nodeRemove(Node *n, Tcl_Obj *key)
+/* Whether internal node a lies above n on any path through both. */
+static int
+nodeAbove(Node *a, Node *n)
 {
-    IntNode *i;
-    ExtNode *e;
-    int c = 0, dir, keyLen, l;
-    Node *children[2];
-    unsigned char *keyStr, *k;
+    IntNode *ia = (IntNode *)a, *in = (IntNode *)n;
 
-    if (!n) return NULL;
-    keyStr = (unsigned char *)Tcl_GetStringFromObj(key, &keyLen);
-    if (isInternal(n)) {
-        i = (IntNode *)n;
-        if (i->byte < keyLen) c = keyStr[i->byte];
-        dir = (1 + (i->otherBits | c)) >> 8;
-        children[0] = i->child[0];
-        children[1] = i->child[1];
-        children[dir] = nodeRemove(i->child[dir], key);
-        if (!children[dir]) return i->child[1-dir];
-        return newIntNode(children[0], children[1], i->byte, i->otherBits);
-    } else {
-        e = (ExtNode *)n;
-        k = (unsigned char *)Tcl_GetStringFromObj(e->key, &l);
-        return (keyLen == l && memcmp(keyStr, k, keyLen) == 0) ? NULL : n;
-    }
+    if (!isInternal(n)) return isInternal(a);
+    return isInternal(a) && (ia->byte < in->byte ||
+                             (ia->byte == in->byte && ia->otherBits < in->otherBits));
 }
 
+/*
+ * Look up key, using and refreshing the path cached in its intrep.
+ * When the tree is a new version of the cached one, the search
+ * descends the new tree only until it meets a node of the cached
+ * path: critbit positions strictly increase along a path, so a merge
+ * by position finds it, and from there on the old descent (and its
+ * result) is still valid. After an update elsewhere in the tree that
+ * is usually a few levels below the root.
+ */
 static Tcl_Obj *
 nodeGetCache(Node *tree, Tcl_Obj *key)
 {
-    TreeKeyRep *rep;
-    ExtNode *node;
+    TreeKeyRep *rep = NULL;
+    Node *n, **path;
+    unsigned char *keyStr, *k;
+    int keyLen, l, depth, capacity, j, found;
 
-    rep = (TreeKeyRep *)&key->internalRep;
-    if (key->typePtr == &treeKeyType && rep->tree == tree)
-        return rep->value;
-    
-    node = nodeGet(tree, key);
-    if (!node) return NULL;
+    if (!tree) return NULL;
+    if (key->typePtr == &treeKeyType) {
+        rep = (TreeKeyRep *)key->internalRep.otherValuePtr;
+        if (rep->tree == tree) goto done;
+    }
+
+    keyStr = (unsigned char *)Tcl_GetStringFromObj(key, &keyLen);
+    capacity = rep ? rep->capacity : 16;
+    path = ckalloc(sizeof(Node *) * capacity);
+    depth = j = 0;
+    for (n = tree;;) {
+        if (rep) {
+            while (j < rep->depth && nodeAbove(rep->path[j], n)) j++;
+            if (j < rep->depth && rep->path[j] == n) {
+                if (depth + rep->depth - j > capacity) {
+                    capacity = depth + rep->depth - j;
+                    path = ckrealloc(path, sizeof(Node *) * capacity);
+                }
+                memcpy(path + depth, rep->path + j, sizeof(Node *) * (rep->depth - j));
+                depth += rep->depth - j;
+                found = rep->found;
+                break;
+            }
+        }
+        if (depth == capacity) {
+            capacity *= 2;
+            path = ckrealloc(path, sizeof(Node *) * capacity);
+        }
+        path[depth++] = n;
+        if (isInternal(n)) {
+            IntNode *i = (IntNode *)n;
+            int c = (i->byte < keyLen) ? keyStr[i->byte] : 0;
+            n = i->child[(1 + (i->otherBits | c)) >> 8];
+        } else {
+            k = (unsigned char *)Tcl_GetStringFromObj(((ExtNode *)n)->key, &l);
+            found = (keyLen == l && memcmp(keyStr, k, keyLen) == 0);
+            break;
+        }
+    }
 
-    if (key->typePtr && key->typePtr->freeIntRepProc) key->typePtr->freeIntRepProc(key);
-    rep->tree = tree;
     retainNode(tree);
-    rep->value = node->value;
-    Tcl_IncrRefCount(rep->value);
-    key->typePtr = &treeKeyType;
-    return node->value;
+    if (rep) {
+        releaseNode(rep->tree);
+        ckfree(rep->path);
+    } else {
+        if (key->typePtr && key->typePtr->freeIntRepProc) key->typePtr->freeIntRepProc(key);
+        rep = ckalloc(sizeof(TreeKeyRep));
+        key->internalRep.otherValuePtr = rep;
+        key->typePtr = &treeKeyType;
+    }
+    rep->tree = tree;
+    rep->path = path;
+    rep->depth = depth;
+    rep->capacity = capacity;
+    rep->found = found;
+
+done:
+    return rep->found ? ((ExtNode *)rep->path[rep->depth-1])->value : NULL;
 }
 
 /* NOTE: does not increment ref count of root */
@@ -567,12 +1461,24 @@ newTreeObj(TreeType type, Node *root)
     return res;
 }
 
+/* NOTE: does not increment ref count of root */
+static Tcl_Obj *
+newBagObj(Node *root, long total)
+{
+    Tcl_Obj *res = Tcl_NewObj();
+    res->typePtr = &treebagType;
+    res->internalRep.ptrAndLongRep.ptr = root;
+    res->internalRep.ptrAndLongRep.value = total;
+    Tcl_InvalidateStringRep(res);
+    return res;
+}
+
 static int
 getTree(TreeType type, Tcl_Interp *interp, Tcl_Obj *obj, Node **rootPtr)
 {
-    if ((type == T_MAP ?
-         setTreeFromAny(interp, obj) :
-         setTreesetFromAny(interp, obj)) == TCL_ERROR) {
+    if ((type == T_MAP ? setTreeFromAny(interp, obj) :
+         type == T_SET ? setTreesetFromAny(interp, obj) :
+         setBagFromAny(interp, obj)) == TCL_ERROR) {
         return TCL_ERROR;
     }
 
@@ -580,6 +1486,39 @@ getTree(TreeType type, Tcl_Interp *interp, Tcl_Obj *obj, Node **rootPtr)
     return TCL_OK;
 }
 
+/*
+ * Set the interp result to a tree of the keys of treeObj that the
+ * regex in expObj matches (as regex::match would tell), sharing
+ * subtrees with treeObj where it can.
+ */
+static int
+treeMatch(TreeType type, Tcl_Interp *interp, Tcl_Obj *treeObj, Tcl_Obj *expObj)
+{
+    RegexWalk *walk;
+    const void *state;
+    Node *tree, *leaf;
+    int code = TCL_ERROR;
+
+    /* Keep the tree and the regex from shimmering each other away. */
+    if (treeObj == expObj) treeObj = Tcl_DuplicateObj(treeObj);
+    Tcl_IncrRefCount(treeObj);
+    if (getTree(type, interp, treeObj, &tree) == TCL_OK &&
+        (walk = regexWalkStart(interp, expObj, &state))) {
+        if (tree) {
+            leaf = tree;
+            while (isInternal(leaf)) leaf = ((IntNode *)leaf)->child[0];
+            tree = nodeFilterRegex(walk, tree, state, 0,
+                                   Tcl_GetString(((ExtNode *)leaf)->key));
+        }
+        regexWalkEnd(walk);
+        if (tree) retainNode(tree);
+        Tcl_SetObjResult(interp, newTreeObj(type, tree));
+        code = TCL_OK;
+    }
+    Tcl_DecrRefCount(treeObj);
+    return code;
+}
+
 static int
 treeObjReplace(TreeType type, Tcl_Interp *interp, Tcl_Obj *treeObj, Tcl_Obj *key,
 	       Tcl_Obj *value, Tcl_Obj **output, int *outputAllocated)
@@ -615,10 +1554,27 @@ treeObjReplace(TreeType type, Tcl_Interp *interp, Tcl_Obj *treeObj, Tcl_Obj *key
 static int
 treeObjMerge(TreeType type, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-    int i;
+    int i, total = 0;
     Node *tree = NULL, *n;
+    ExtNode **leaves, **p;
     ForState state;
-    
+
+    for (i = 0; i < objc; i++) {
+        if (getTree(type, interp, objv[i], &n) == TCL_ERROR) return TCL_ERROR;
+        total += nodeSize(n);
+    }
+    if (useParallel(total)) {
+        leaves = p = ckalloc(sizeof(ExtNode *) * total);
+        for (i = 0; i < objc; i++) {
+            n = objv[i]->internalRep.otherValuePtr;
+            if (n) p = nodeCollectLeaves(n, p);
+        }
+        tree = bulkBuild(type, leaves, total);
+        ckfree(leaves);
+        Tcl_SetObjResult(interp, newTreeObj(type, tree));
+        return TCL_OK;
+    }
+
     /* If non-empty trees exists, use the first such as the base. */ 
     for (i = 0; i < objc; i++) {
         if (getTree(type, interp, objv[i], &tree) == TCL_ERROR) return TCL_ERROR;
@@ -680,6 +1636,164 @@ treeSetCmd(TreeType type, Tcl_Interp *interp, Tcl_Obj *varName, Tcl_Obj *key, Tc
     return TCL_OK;
 }
 
+static int
+getCount(Tcl_Interp *interp, Tcl_Obj *obj, long *countPtr)
+{
+    if (Tcl_GetLongFromObj(interp, obj, countPtr) != TCL_OK) return TCL_ERROR;
+    if (*countPtr < 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad count \"%ld\"", *countPtr));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/* Counterpart of treeObjReplace for bags */
+static int
+bagObjUpdate(Tcl_Interp *interp, Tcl_Obj *bagObj, Tcl_Obj *key, long delta,
+             Tcl_Obj **output, int *outputAllocated)
+{
+    Node *tree;
+    long total;
+    int allocated = 0;
+
+    if (Tcl_IsShared(bagObj)) {
+	bagObj = Tcl_DuplicateObj(bagObj);
+	allocated = 1;
+    }
+
+    if (getTree(T_BAG, interp, bagObj, &tree) == TCL_ERROR) {
+        if (allocated) Tcl_DecrRefCount(bagObj);
+        return TCL_ERROR;
+    }
+    total = bagObj->internalRep.ptrAndLongRep.value;
+    if (nodeAddCount(interp, (Node **)&bagObj->internalRep.ptrAndLongRep.ptr, key,
+                     delta, &total) != TCL_OK) {
+        if (allocated) Tcl_DecrRefCount(bagObj);
+        return TCL_ERROR;
+    }
+    bagObj->internalRep.ptrAndLongRep.value = total;
+    Tcl_InvalidateStringRep(bagObj);
+    *output = bagObj;
+    if (outputAllocated) *outputAllocated = allocated;
+    return TCL_OK;
+}
+
+static int
+bagSetCmd(Tcl_Interp *interp, Tcl_Obj *varName, Tcl_Obj *key, long delta)
+{
+    Tcl_Obj *varValue, *result, *updated;
+    int allocated;
+
+    varValue = Tcl_ObjGetVar2(interp, varName, NULL, 0);
+    if (!varValue) {
+        varValue = Tcl_NewObj();
+    }
+    if (bagObjUpdate(interp, varValue, key, delta, &updated, &allocated) == TCL_ERROR) {
+        if (varValue->refCount == 0) Tcl_DecrRefCount(varValue);
+	return TCL_ERROR;
+    }
+    result = Tcl_ObjSetVar2(interp, varName, NULL, updated, TCL_LEAVE_ERR_MSG);
+    if (!result) {
+        if (updated->refCount == 0) Tcl_DecrRefCount(updated);
+	return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, result);
+    return TCL_OK;
+}
+
+/*
+ * Union adds up the counts of all bags; intersect keeps the values
+ * present in every bag, with the smallest of their counts.
+ */
+static int
+bagCombine(Tcl_Interp *interp, int isUnion, int objc, Tcl_Obj *const objv[])
+{
+    int i, j, size;
+    long count, total = 0;
+    Node *tree = NULL, *n;
+    ExtNode **leaves, *e;
+
+    for (i = 0; i < objc; i++) {
+        if (getTree(T_BAG, interp, objv[i], &n) == TCL_ERROR) return TCL_ERROR;
+    }
+    if (objc == 0) {
+        Tcl_SetObjResult(interp, newBagObj(NULL, 0));
+        return TCL_OK;
+    }
+
+    if (isUnion) {
+        /* Start from the first bag and add the others to it. */
+        tree = objv[0]->internalRep.ptrAndLongRep.ptr;
+        total = objv[0]->internalRep.ptrAndLongRep.value;
+        if (tree) retainNode(tree);
+        i = 1;
+    } else {
+        i = 0;
+    }
+    for (; i < (isUnion ? objc : 1); i++) {
+        n = objv[i]->internalRep.ptrAndLongRep.ptr;
+        if (!n) continue;
+        size = nodeSize(n);
+        leaves = ckalloc(sizeof(ExtNode *) * size);
+        nodeCollectLeaves(n, leaves);
+        for (j = 0; j < size; j++) {
+            count = ((BagNode *)leaves[j])->count;
+            if (!isUnion) {
+                int k;
+                for (k = 1; k < objc && count > 0; k++) {
+                    e = nodeGet(objv[k]->internalRep.ptrAndLongRep.ptr, leaves[j]->key);
+                    if (!e) count = 0;
+                    else if (((BagNode *)e)->count < count) count = ((BagNode *)e)->count;
+                }
+            }
+            if (nodeAddCount(interp, &tree, leaves[j]->key, count, &total) != TCL_OK) {
+                ckfree(leaves);
+                if (tree) releaseNode(tree);
+                return TCL_ERROR;
+            }
+        }
+        ckfree(leaves);
+    }
+    Tcl_SetObjResult(interp, newBagObj(tree, total));
+    return TCL_OK;
+}
+
+static int
+treeEqualCmd(TreeType type, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    static const char *const valueCmps[] = {"string", "identity", NULL};
+    Node *a, *b;
+    int valueCmp = VALUECMP_NONE;
+
+    if (type == T_MAP) {
+        if (objc != 4 && objc != 6) {
+            Tcl_WrongNumArgs(interp, 2, objv, "treeValue treeValue ?-valuecmp string|identity?");
+            return TCL_ERROR;
+        }
+        valueCmp = VALUECMP_STRING;
+        if (objc == 6) {
+            if (strcmp(Tcl_GetString(objv[4]), "-valuecmp") != 0) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad option \"%s\": must be -valuecmp",
+                                                       Tcl_GetString(objv[4])));
+                return TCL_ERROR;
+            }
+            if (Tcl_GetIndexFromObj(interp, objv[5], valueCmps, "value comparison", 0,
+                                    &valueCmp) != TCL_OK)
+                return TCL_ERROR;
+            valueCmp += VALUECMP_STRING;
+        }
+    } else if (objc != 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "set set");
+        return TCL_ERROR;
+    }
+
+    if (getTree(type, interp, objv[2], &a) == TCL_ERROR ||
+        getTree(type, interp, objv[3], &b) == TCL_ERROR)
+        return TCL_ERROR;
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(nodeEqual(a, b, valueCmp)));
+    return TCL_OK;
+}
+
 static int
 treeForNRCmd(ClientData cd, Tcl_Interp *interp, int objc,
              Tcl_Obj *const objv[])
@@ -692,7 +1806,8 @@ treeForNRCmd(ClientData cd, Tcl_Interp *interp, int objc,
     type = (int)cd;
     
     if (objc != 5) {
-        char *usage = (type == T_MAP) ? "{k v} treeValue body" : "varName set body";
+        char *usage = (type == T_MAP) ? "{k v} treeValue body" :
+            (type == T_SET) ? "varName set body" : "{value count} bag body";
         Tcl_WrongNumArgs(interp, 2, objv, usage);
         return TCL_ERROR;
     }
@@ -700,9 +1815,9 @@ treeForNRCmd(ClientData cd, Tcl_Interp *interp, int objc,
     if (Tcl_ListObjGetElements(interp, objv[2], &varCount, &varArray) == TCL_ERROR)
         return TCL_ERROR;
 
-    if (varCount != (type == T_MAP ? 2 : 1)) {
-        char *num = (type == T_MAP) ? "two" : "one";
-        char *s = (type == T_MAP) ? "s" : "";
+    if (varCount != (type == T_SET ? 1 : 2)) {
+        char *num = (type == T_SET) ? "one" : "two";
+        char *s = (type == T_SET) ? "" : "s";
         Tcl_SetObjResult(interp, Tcl_ObjPrintf("must have exactly %s variable name%s", num, s));
         return TCL_ERROR;
     }
@@ -714,7 +1829,7 @@ treeForNRCmd(ClientData cd, Tcl_Interp *interp, int objc,
     state->type = type;
     state->keyVar = varArray[0];
     Tcl_IncrRefCount(state->keyVar);
-    if (type == T_MAP) {
+    if (type != T_SET) {
         state->valueVar = varArray[1];
         Tcl_IncrRefCount(state->valueVar);
     } else {
@@ -752,7 +1867,10 @@ forNext(Tcl_Interp *interp, ForState *state)
     e = (ExtNode *)n;
     if (!Tcl_ObjSetVar2(interp, state->keyVar, NULL, e->key, TCL_LEAVE_ERR_MSG) ||
         (state->type == T_MAP && !Tcl_ObjSetVar2(interp, state->valueVar, NULL, e->value,
-                                                 TCL_LEAVE_ERR_MSG))) {
+                                                 TCL_LEAVE_ERR_MSG)) ||
+        (state->type == T_BAG &&
+         !Tcl_ObjSetVar2(interp, state->valueVar, NULL,
+                         Tcl_NewLongObj(((BagNode *)n)->count), TCL_LEAVE_ERR_MSG))) {
         releaseNode((Node *)e);
         forCleanup(state);
         return TCL_ERROR;
@@ -786,7 +1904,7 @@ forCleanup(ForState *state)
     int i;
     
     Tcl_DecrRefCount(state->keyVar);
-    if (state->type == T_MAP) Tcl_DecrRefCount(state->valueVar);
+    if (state->type != T_SET) Tcl_DecrRefCount(state->valueVar);
     Tcl_DecrRefCount(state->script);
     for (i = 0; i < state->stackSize; i++) releaseNode(state->stack[i]);
     ckfree(state->stack);
@@ -814,19 +1932,21 @@ treeCmd(ClientData cd, Tcl_Interp *interp,
     ExtNode *node;
     Tcl_Obj *obj;
     static const char *const options[] = {
-        "_getchild", "_info",    "create",  "exists",
-        "for",       "get",      "get*",    "getcache",
-        "getcache*", "getor",    "keys",    "max",
-        "merge",     "min",      "modify",  "remove",
-        "replace",   "set",      "size",    "tolist",
+        "_getchild", "_info",    "configure", "create",
+        "equal",     "exists",   "filter",    "for",
+        "get",       "get*",     "getcache",  "getcache*",
+        "getor",     "keys",     "match",     "max",
+        "merge",     "min",      "modify",    "remove",
+        "replace",   "set",      "size",      "tolist",
         "unset",     NULL
     };
     enum option {
-        OPT_GETCHILD,     OPT_INFO,    OPT_CREATE,  OPT_EXISTS,
-        OPT_FOR,          OPT_GET,     OPT_GETSTAR, OPT_GETCACHE,
-        OPT_GETCACHESTAR, OPT_GETOR,   OPT_KEYS,    OPT_MAX,
-        OPT_MERGE,        OPT_MIN,     OPT_MODIFY,  OPT_REMOVE,
-        OPT_REPLACE,      OPT_SET,     OPT_SIZE,    OPT_TOLIST,
+        OPT_GETCHILD, OPT_INFO,     OPT_CONFIGURE, OPT_CREATE,
+        OPT_EQUAL,    OPT_EXISTS,   OPT_FILTER,    OPT_FOR,
+        OPT_GET,      OPT_GETSTAR,  OPT_GETCACHE,  OPT_GETCACHESTAR,
+        OPT_GETOR,    OPT_KEYS,     OPT_MATCH,     OPT_MAX,
+        OPT_MERGE,    OPT_MIN,      OPT_MODIFY,    OPT_REMOVE,
+        OPT_REPLACE,  OPT_SET,      OPT_SIZE,      OPT_TOLIST,
         OPT_UNSET
     };
     
@@ -871,19 +1991,51 @@ treeCmd(ClientData cd, Tcl_Interp *interp,
         if (isInternal(tree)) {
             IntNode *n = (IntNode *)tree;
             info[0] = Tcl_NewStringObj("internal", -1);
-            info[1] = Tcl_NewIntObj(n->refCount >> 1);
+            info[1] = Tcl_NewIntObj(n->refCount >> 2);
             info[2] = Tcl_NewIntObj(n->byte);
             info[3] = Tcl_NewIntObj(n->otherBits);
         } else {
             ExtNode *n = (ExtNode *)tree;
             info[0] = Tcl_NewStringObj("external", -1);
-            info[1] = Tcl_NewIntObj(n->refCount >> 1);
+            info[1] = Tcl_NewIntObj(n->refCount >> 2);
             info[2] = n->key;
             info[3] = n->value;
         }
         Tcl_SetObjResult(interp, Tcl_NewListObj(4, info));
         return TCL_OK;
     }
+    case OPT_CONFIGURE: {
+        static const char *const confOptions[] = {"-threads", "-threshold", NULL};
+        Tcl_Obj *conf[4];
+        int i, opt, val;
+
+        if ((objc & 1) == 1) {
+            Tcl_WrongNumArgs(interp, 2, objv, "?-threads n? ?-threshold n?");
+            return TCL_ERROR;
+        }
+        for (i = 2; i < objc; i += 2) {
+            if (Tcl_GetIndexFromObj(interp, objv[i], confOptions, "option", 0,
+                                    &opt) != TCL_OK ||
+                Tcl_GetIntFromObj(interp, objv[i+1], &val) != TCL_OK)
+                return TCL_ERROR;
+            if (val < 1) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad value \"%d\" for %s", val, confOptions[opt]));
+                return TCL_ERROR;
+            }
+            Tcl_MutexLock(&parallelMutex);
+            if (opt == 0) parallelThreads = val;
+            else parallelThreshold = val;
+            Tcl_MutexUnlock(&parallelMutex);
+        }
+        Tcl_MutexLock(&parallelMutex);
+        conf[1] = Tcl_NewIntObj(getParallelThreads());
+        conf[3] = Tcl_NewIntObj(parallelThreshold);
+        Tcl_MutexUnlock(&parallelMutex);
+        conf[0] = Tcl_NewStringObj(confOptions[0], -1);
+        conf[2] = Tcl_NewStringObj(confOptions[1], -1);
+        Tcl_SetObjResult(interp, Tcl_NewListObj(4, conf));
+        return TCL_OK;
+    }
     case OPT_CREATE:
         if ((objc & 1) == 1) {
             Tcl_WrongNumArgs(interp, 2, objv, "?key value ...?");
@@ -892,6 +2044,8 @@ treeCmd(ClientData cd, Tcl_Interp *interp,
         tree = treeCreate(objc-2, objv+2);
         Tcl_SetObjResult(interp, newTreeObj(T_MAP, tree));
         return TCL_OK;
+    case OPT_EQUAL:
+        return treeEqualCmd(T_MAP, interp, objc, objv);
     case OPT_EXISTS:
         if (objc != 4) {
 badNumArgsNeedTreeKey:
@@ -902,6 +2056,17 @@ badNumArgsNeedTreeKey:
             return TCL_ERROR;
         Tcl_SetObjResult(interp, Tcl_NewBooleanObj(nodeGet(tree, objv[3]) != NULL));
         return TCL_OK;
+    case OPT_FILTER:
+        if (objc != 5) {
+            Tcl_WrongNumArgs(interp, 2, objv, "treeValue -glob|-prefix pattern");
+            return TCL_ERROR;
+        }
+        if (getTree(T_MAP, interp, objv[2], &tree) == TCL_ERROR ||
+            treeSelect(interp, tree, objv[3], objv[4], NULL, &tree) == TCL_ERROR)
+            return TCL_ERROR;
+        if (tree) retainNode(tree);
+        Tcl_SetObjResult(interp, newTreeObj(T_MAP, tree));
+        return TCL_OK;
     case OPT_FOR:
         return Tcl_NRCallObjProc(interp, treeForNRCmd, (ClientData)T_MAP, objc, objv);
     case OPT_GET:
@@ -944,10 +2109,25 @@ notFound:
         Tcl_SetObjResult(interp, node ? node->value : objv[4]);
         return TCL_OK;
     case OPT_KEYS:
-        if (objc != 3) goto badNumArgsNeedTree;
+        if (objc != 3 && objc != 5) {
+            Tcl_WrongNumArgs(interp, 2, objv, "treeValue ?-glob|-prefix pattern?");
+            return TCL_ERROR;
+        }
         if (getTree(T_MAP, interp, objv[2], &tree) == TCL_ERROR) return TCL_ERROR;
-        Tcl_SetObjResult(interp, treeKeys(tree));
+        if (objc == 3) {
+            Tcl_SetObjResult(interp, treeKeys(tree));
+            return TCL_OK;
+        }
+        if (treeSelect(interp, tree, objv[3], objv[4], &obj, NULL) == TCL_ERROR)
+            return TCL_ERROR;
+        Tcl_SetObjResult(interp, obj);
         return TCL_OK;
+    case OPT_MATCH:
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "treeValue regex");
+            return TCL_ERROR;
+        }
+        return treeMatch(T_MAP, interp, objv[2], objv[3]);
     case OPT_MAX:
         if (objc != 3) goto badNumArgsNeedTree;
         if (getTree(T_MAP, interp, objv[2], &tree) == TCL_ERROR) return TCL_ERROR;
@@ -1031,13 +2211,14 @@ treesetCmd(ClientData cd, Tcl_Interp *interp,
     Node *tree;
     Tcl_Obj *obj;
     static const char *const options[] = {
-        "add",    "contains", "create", "for",    "merge",
-        "remove", "set",      "size",   "tolist", "unset",
-        NULL
+        "add",    "contains", "create", "equal",  "filter",
+        "for",    "match",    "merge",  "remove", "set",
+        "size",   "tolist",   "unset",  NULL
     };
     enum option {
-        OPT_ADD,    OPT_CONTAINS, OPT_CREATE, OPT_FOR,    OPT_MERGE,
-        OPT_REMOVE, OPT_SET,      OPT_SIZE,   OPT_TOLIST, OPT_UNSET
+        OPT_ADD,    OPT_CONTAINS, OPT_CREATE, OPT_EQUAL,  OPT_FILTER,
+        OPT_FOR,    OPT_MATCH,    OPT_MERGE,  OPT_REMOVE, OPT_SET,
+        OPT_SIZE,   OPT_TOLIST,   OPT_UNSET
     };
     
     if (objc < 2) {
@@ -1074,9 +2255,28 @@ badNumArgsNeedTreeKey:
         tree = treesetCreate(objc-2, objv+2);
         Tcl_SetObjResult(interp, newTreeObj(T_SET, tree));
         return TCL_OK;
+    case OPT_EQUAL:
+        return treeEqualCmd(T_SET, interp, objc, objv);
+    case OPT_FILTER:
+        if (objc != 5) {
+            Tcl_WrongNumArgs(interp, 2, objv, "set -glob|-prefix pattern");
+            return TCL_ERROR;
+        }
+        if (getTree(T_SET, interp, objv[2], &tree) == TCL_ERROR ||
+            treeSelect(interp, tree, objv[3], objv[4], NULL, &tree) == TCL_ERROR)
+            return TCL_ERROR;
+        if (tree) retainNode(tree);
+        Tcl_SetObjResult(interp, newTreeObj(T_SET, tree));
+        return TCL_OK;
     case OPT_FOR:
         return Tcl_NRCallObjProc(interp, treeForNRCmd, (ClientData)T_SET,
                                  objc, objv);
+    case OPT_MATCH:
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "set regex");
+            return TCL_ERROR;
+        }
+        return treeMatch(T_SET, interp, objv[2], objv[3]);
     case OPT_MERGE:
         return treeObjMerge(T_SET, interp, objc-2, objv+2);
     case OPT_REMOVE:
@@ -1122,3 +2322,105 @@ badNumArgsNeedTree:
     /* Not reached */
     return TCL_OK;
 }
+
+int
+treebagCmd(ClientData cd, Tcl_Interp *interp,
+           int objc, Tcl_Obj *const objv[])
+{
+    int index, i;
+    Node *tree;
+    ExtNode *e;
+    Tcl_Obj *obj, *size[2];
+    long count, total;
+    static const char *const options[] = {
+        "add",    "count",  "create", "for",    "intersect",
+        "remove", "set",    "size",   "tolist", "union",
+        "unset",  NULL
+    };
+    enum option {
+        OPT_ADD,    OPT_COUNT,  OPT_CREATE, OPT_FOR,    OPT_INTERSECT,
+        OPT_REMOVE, OPT_SET,    OPT_SIZE,   OPT_TOLIST, OPT_UNION,
+        OPT_UNSET
+    };
+
+    if (objc < 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "subcommand ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch ((enum option)index) {
+    case OPT_ADD:
+    case OPT_REMOVE:
+        if (objc != 4 && objc != 5) {
+            Tcl_WrongNumArgs(interp, 2, objv, "bag value ?n?");
+            return TCL_ERROR;
+        }
+        count = 1;
+        if (objc == 5 && getCount(interp, objv[4], &count) == TCL_ERROR)
+            return TCL_ERROR;
+        if (bagObjUpdate(interp, objv[2], objv[3], index == OPT_ADD ? count : -count,
+                         &obj, NULL) == TCL_ERROR) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, obj);
+        return TCL_OK;
+    case OPT_COUNT:
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "bag value");
+            return TCL_ERROR;
+        }
+        if (getTree(T_BAG, interp, objv[2], &tree) == TCL_ERROR)
+            return TCL_ERROR;
+        e = nodeGet(tree, objv[3]);
+        Tcl_SetObjResult(interp, Tcl_NewLongObj(e ? ((BagNode *)e)->count : 0));
+        return TCL_OK;
+    case OPT_CREATE:
+        tree = NULL;
+        total = 0;
+        for (i = 2; i < objc; i++) nodeAddCount(NULL, &tree, objv[i], 1, &total);
+        Tcl_SetObjResult(interp, newBagObj(tree, total));
+        return TCL_OK;
+    case OPT_FOR:
+        return Tcl_NRCallObjProc(interp, treeForNRCmd, (ClientData)T_BAG,
+                                 objc, objv);
+    case OPT_INTERSECT:
+    case OPT_UNION:
+        return bagCombine(interp, index == OPT_UNION, objc-2, objv+2);
+    case OPT_SET:
+    case OPT_UNSET:
+        if (objc != 4 && objc != 5) {
+            Tcl_WrongNumArgs(interp, 2, objv, "varName value ?n?");
+            return TCL_ERROR;
+        }
+        count = 1;
+        if (objc == 5 && getCount(interp, objv[4], &count) == TCL_ERROR)
+            return TCL_ERROR;
+        return bagSetCmd(interp, objv[2], objv[3], index == OPT_SET ? count : -count);
+    case OPT_SIZE:
+        if (objc != 3) {
+badNumArgsNeedBag:
+            Tcl_WrongNumArgs(interp, 2, objv, "bag");
+            return TCL_ERROR;
+        }
+        if (getTree(T_BAG, interp, objv[2], &tree) == TCL_ERROR)
+            return TCL_ERROR;
+        size[0] = Tcl_NewIntObj(nodeSize(tree));
+        size[1] = Tcl_NewLongObj((long)objv[2]->internalRep.ptrAndLongRep.value);
+        Tcl_SetObjResult(interp, Tcl_NewListObj(2, size));
+        return TCL_OK;
+    case OPT_TOLIST:
+        if (objc != 3)
+            goto badNumArgsNeedBag;
+        if (getTree(T_BAG, interp, objv[2], &tree) == TCL_ERROR)
+            return TCL_ERROR;
+        Tcl_SetObjResult(interp, bagToList(tree));
+        return TCL_OK;
+    }
+
+    /* Not reached */
+    return TCL_OK;
+}
@@ -1,6 +1,17 @@
 #include <tcl.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 #include "cursor.h"
+#include "regex.h"
 
 int TclGetIntForIndex(Tcl_Interp *, Tcl_Obj *, int, int *);
 
@@ -14,13 +25,136 @@ enum inst {
     INST_END,
     INST_START,
     INST_MATCH,
-    INST_BRACKET
+    INST_BRACKET,
+    INST_HINT,
+    INST_REPEAT,
+    INST_AGAIN,
+    INST_STRING
 };
 
+/*
+ * Lazy DFA, used when only a yes/no answer is wanted. A state is the
+ * set of consuming instructions (CHR, ANY, BRACKET) reachable without
+ * reading input, plus whether MATCH is reachable. States and their
+ * transitions are built on demand and cached per regex.
+ */
+#define DSTATE_MATCH 1        /* MATCH reachable before end of input */
+#define DSTATE_MATCH_AT_END 2 /* MATCH reachable at end of input */
+
+typedef struct DState {
+    struct DState *hashNext;
+    unsigned int hash;
+    int flags;
+    int numPcs;
+    int *pcs;                /* keys, sorted; stored after next[] */
+    struct DState *next[1];  /* by character class, NULL until built */
+} DState;
+
+typedef struct Dfa {
+    int numKeys;
+    int numClasses;
+    int nonAsciiClass;       /* first non-ASCII class, -1 if uncached */
+    int numBounds;
+    int *bounds;             /* non-ASCII chars where a new class starts */
+    unsigned char classMap[128];
+    size_t memUsed;
+    int numStates;
+    unsigned int hashMask;
+    DState **hash;
+    DState *start;
+    DState *idle;            /* unanchored: no thread older than this position */
+    int entry;
+    int unanchored;
+    int flushes;             /* cache flushes during the current search */
+    int bails;               /* searches handed over to the NFA */
+    int generation;
+    unsigned int epoch;      /* flushes ever, see RegexWalk */
+    int *keyBase;            /* as in Regex; NULL if keys are pcs */
+    int *keyPc;              /* pc of each key, if keyBase */
+    int *stamp;              /* per key, generation when last visited */
+    int *stack;
+    int *seeds;
+    int *pcs;                /* keys, really; see Regex */
+} Dfa;
+
+/*
+ * A bracket that loops back to itself, with the other consuming
+ * instructions the loop reaches. See findRuns.
+ */
+#define RUN_MAX 16
+#define RUN_MAX_OTHERS 4
+
+typedef struct Run {
+    int pc;
+    int numOthers;
+    int others[RUN_MAX_OTHERS];
+    unsigned char map[16];   /* ASCII chars a run can skip */
+} Run;
+
+/*
+ * Counters kept per pattern when built with REGEX_STATS, for finding
+ * out which patterns are slow and why (see regex::stats). The STAT
+ * macros compile to nothing otherwise. Each thread has a table of
+ * them by pattern, so all objects holding the same regex add to the
+ * same ones, and a Regex points to its entry.
+ */
+#ifdef REGEX_STATS
+typedef struct Stats {
+    int peakThreads;         /* longest thread list */
+    int peakSubs;            /* see Regex */
+    Tcl_WideInt compiles;
+    Tcl_WideInt compileTime; /* microseconds, all compiles */
+    Tcl_WideInt searches;    /* by execute */
+    Tcl_WideInt dfaSearches; /* by dfaExecute, even if handed back */
+    Tcl_WideInt chars;       /* stepped over, by either */
+    Tcl_WideInt threads;     /* scheduled by follow */
+    Tcl_WideInt follows;     /* calls of follow */
+    Tcl_WideInt subs;        /* allocated */
+} Stats;
+
+#define STAT_ADD(stats, field, n) ((stats)->field += (n))
+#define STAT_MAX(stats, field, n) \
+    ((n) > (stats)->field ? (void)((stats)->field = (n)) : (void)0)
+#else
+#define STAT_ADD(stats, field, n) ((void)0)
+#define STAT_MAX(stats, field, n) ((void)0)
+#endif
+
 typedef struct Regex {
     int numSlots;
     int numInsts;
     int codeLength;
+    Dfa *dfa;                /* created on first use */
+    int peakSubs;            /* most capture sets live in one search */
+    int numRuns;
+    Run *runs;               /* NULL if numRuns is 0 */
+
+    /*
+     * A thread in a counted loop (REPEAT) is told apart by its count
+     * too. Instructions outside loops have the key pc; those in a loop
+     * whose count goes up to n have n+1 keys from keyBase[pc]. NULL
+     * without loops. maxThreads is how many threads a list can hold.
+     */
+    int *keyBase;
+    int numKeys;
+    int maxThreads;
+
+    /*
+     * From the optional HINT header: where execution starts, whether
+     * to behave as if the regex began with .*?, and offsets into prog
+     * of a literal every match starts with and one every match
+     * contains (lengths 0 if none).
+     */
+    int entry;
+    int unanchored;
+    int prefixOffset;
+    int prefixLength;
+    int requiredOffset;
+    int requiredLength;
+
+#ifdef REGEX_STATS
+    Stats *stats;
+#endif
 
     /*
      * Note: if you add fields above, make sure prog is aligned to 32
@@ -29,6 +163,20 @@ typedef struct Regex {
     unsigned char prog[1];
 } Regex;
 
+/*
+ * Several regexes run together in one pass. The programs are copied
+ * one after another into a single Regex (only its code, numSlots and
+ * numInsts are used), each starting at its own entry.
+ */
+typedef struct RegexSet {
+    int refCount;
+    int numPatterns;
+    int *entries;        /* per pattern */
+    int *unanchored;     /* per pattern */
+    int *owner;          /* per pc, the pattern the code belongs to */
+    Regex *regex;
+} RegexSet;
+
 /* Structures related to regex execution. */
 typedef struct Slot {
     const char *charPtr;
@@ -37,11 +185,25 @@ typedef struct Slot {
 
 typedef struct Sub {
     int refCount;
+    struct Sub *nextFree;
     Slot slots[1];
 } Sub;
 
+/*
+ * Subs are carved out of chunks owned by the context, and go on a
+ * free list when released. Everything is reclaimed at once when the
+ * context is next used.
+ */
+typedef struct SubChunk {
+    struct SubChunk *next;
+    size_t size;             /* bytes after the header */
+} SubChunk;
+
+#define SUB_CHUNK_MIN 4096
+
 typedef struct Thread {
     int pc;
+    int count;               /* iterations of the counted loop pc is in */
     Sub *sub;
 } Thread;
 
@@ -50,16 +212,56 @@ typedef struct ThreadList {
     Thread *list;
 } ThreadList;
 
-/* Main execution context */
+/*
+ * Main execution context. Contexts are kept in a per-thread pool and
+ * reused; lastChecked holds turnCount values, and since turnCount
+ * only ever grows, a reused context needs no clearing.
+ */
 typedef struct Context {
     unsigned char *prog;
-    int numSlots;
+    int numSlots;               /* kept per sub, see narrowContext */
+    int bare;                   /* execute uses followBare */
+    int pruned;                 /* a thread died on a STRING this turn */
     int beginning;
-    int turnCount;
-    int *lastChecked;
+    unsigned int turnCount;
+    unsigned int *lastChecked; /* by key, see Regex */
+    int *keyBase;
+    int codeCapacity, instCapacity;
+    struct Context *nextFree;
     ThreadList threadLists[2];
     Sub *savedMatch;
     int extantSubs;
+    int peakSubs;
+    int worker;                 /* leaves the Regex alone, see parallelAll */
+
+    /*
+     * If more is set, the input goes on past end, where the search
+     * stops. A search whose result could still change with more input
+     * is suspended: execute returns 0 and keeps its threads and match
+     * so far, and the next call with ctx goes on with them over the
+     * input that follows, rather than starting a search.
+     */
+    int more;
+    int suspended;
+    const char *end;
+
+    /* If set, only matches that start before limit are looked for. */
+    const char *limit;
+
+    /* Sub allocation */
+    size_t subSize;
+    Sub *freeSubs;
+    SubChunk *subChunks;     /* all chunks */
+    SubChunk *subChunk;      /* the one being carved */
+    char *subNext, *subEnd;
+
+    /* For regex sets: pattern of each pc, and match per pattern */
+    int *owner;
+    Sub **matches;
+
+#ifdef REGEX_STATS
+    Stats *stats;            /* the regex's */
+#endif
 } Context;
 
 static void freeRegexIntRep(Tcl_Obj *);
@@ -67,18 +269,53 @@ static void dupRegexIntRep(Tcl_Obj *, Tcl_Obj *);
 static void updateStringOfRegex(Tcl_Obj *);
 
 static Regex *getRegexFromObj(Tcl_Interp *, Tcl_Obj *);
+static unsigned char *compileRegex(Tcl_Interp *, Tcl_Obj *, int *);
+static unsigned char *cachedRegex(const char *pattern, int *lengthPtr);
+static void cacheRegex(const char *pattern, Regex *regex);
+
+static void freeRegexSetIntRep(Tcl_Obj *);
+static void dupRegexSetIntRep(Tcl_Obj *, Tcl_Obj *);
+static RegexSet *getRegexSetFromObj(Tcl_Interp *, Tcl_Obj *);
 
 /* Execution functions */
+static void freeContextPool(ClientData clientData);
+#ifdef REGEX_STATS
+static void freeStats(ClientData clientData);
+#endif
 static Context *newContext(Regex *regex, int beginning);
+static void restartContext(Context *ctx);
+static void narrowContext(Context *ctx, int numSlots);
+static void releaseContext(Context *ctx);
+static void newSubChunk(Context *ctx);
 static Sub *newSub(Context *ctx);
 static void retainSub(Sub *sub);
 static void releaseSub(Context *ctx, Sub *sub);
 static Sub *updateSub(Context *ctx, Sub *sub, int slot,
                       const char *charPtr, int charIndex);
-static int follow(Context *ctx, int pc, Sub *sub, const char *charPtr,
-                  int charIndex, int atEnd);
-static Sub *execute(Regex *regex, const char *str, const char *end,
-                    int charIndex, int beginning);
+static int follow(Context *ctx, int pc, int count, Sub *sub,
+                  const char *charPtr, int charIndex, int atEnd);
+static int followBare(Context *ctx, int pc, int count, Sub *sub,
+                      const char *charPtr, int charIndex, int atEnd);
+static int matchInst(unsigned char *code, int *pcPtr, int *countPtr,
+                     Tcl_UniChar ch);
+static const char *findLiteral(const char *str, const char *end,
+                               const char *lit, int length);
+static const char *skipToPrefix(Regex *regex, const char *str,
+                                const char *end, int *charIndexPtr);
+static int execute(Context *ctx, Regex *regex, const char *str,
+                   const char *end, int charIndex, Slot *match);
+static void executeSet(RegexSet *set, const char *str, const char *end,
+                       int charIndex, int beginning, Tcl_Obj *result);
+static int nextInst(unsigned char *code, int pc);
+static void findRuns(Regex *regex);
+static int findRepeats(Tcl_Interp *interp, Regex *regex, int numEntries,
+                       int *entries);
+
+/* Lazy DFA functions */
+static Dfa *newDfa(Regex *regex);
+static void freeDfa(Dfa *dfa);
+static DState *dfaState(Dfa *dfa, unsigned char *code, int numSeeds, int atStart);
+static int dfaExecute(Regex *regex, const char *str, const char *end);
     
 const Tcl_ObjType regexType = {
     "regex",
@@ -88,7 +325,376 @@ const Tcl_ObjType regexType = {
     NULL
 };
 
-static Context *contextSpace; /* reuse storage. */
+/* String rep is always kept (the list of patterns). */
+const Tcl_ObjType regexSetType = {
+    "regexset",
+    freeRegexSetIntRep,
+    dupRegexSetIntRep,
+    NULL,
+    NULL
+};
+
+typedef struct ThreadSpecificData {
+    int initialized;
+    Context *freeContexts;   /* Pool of contexts not in use. */
+#ifdef REGEX_STATS
+    Tcl_HashTable stats;     /* Stats by pattern. */
+    Stats otherStats;        /* For regex sets, not reported. */
+#endif
+} ThreadSpecificData;
+
+static Tcl_ThreadDataKey dataKey;
+
+static ThreadSpecificData *
+getThreadData(void)
+{
+    ThreadSpecificData *tsdPtr;
+
+    tsdPtr = Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+    if (!tsdPtr->initialized) {
+        tsdPtr->initialized = 1;
+        tsdPtr->freeContexts = NULL;
+        Tcl_CreateThreadExitHandler(freeContextPool, NULL);
+#ifdef REGEX_STATS
+        Tcl_InitHashTable(&tsdPtr->stats, TCL_STRING_KEYS);
+        Tcl_CreateThreadExitHandler(freeStats, NULL);
+#endif
+    }
+    return tsdPtr;
+}
+
+#ifdef REGEX_STATS
+static void
+freeStats(ClientData clientData)
+{
+    ThreadSpecificData *tsdPtr = getThreadData();
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+
+    for (entry = Tcl_FirstHashEntry(&tsdPtr->stats, &search); entry;
+         entry = Tcl_NextHashEntry(&search)) {
+        ckfree(Tcl_GetHashValue(entry));
+    }
+    Tcl_DeleteHashTable(&tsdPtr->stats);
+}
+
+/* The counters for a pattern, made on first use. */
+static Stats *
+patternStats(const char *pattern)
+{
+    Tcl_HashEntry *entry;
+    Stats *stats;
+    int isNew;
+
+    entry = Tcl_CreateHashEntry(&getThreadData()->stats, pattern, &isNew);
+    if (isNew) {
+        stats = ckalloc(sizeof(Stats));
+        memset(stats, 0, sizeof(Stats));
+        Tcl_SetHashValue(entry, stats);
+    }
+    return Tcl_GetHashValue(entry);
+}
+#endif
+
+/*
+ * Opt-in cache of compiled programs, shared by all threads, so that a
+ * process can start with its regexes already compiled (see
+ * regex::cache). The file is mapped read-only; regexes compiled while
+ * it is open are added in memory, and saved with the rest on request.
+ * Programs are copied out and validated as if just compiled, and one
+ * that fails is compiled afresh.
+ *
+ * The file has a CacheHeader, then for each regex the lengths of its
+ * pattern and its program and a checksum of both, the pattern with a
+ * NUL, and the program, padded to 4 bytes. Entries that don't add up
+ * are skipped. A file made for another compiler (bump
+ * REGEX_COMPILER_VERSION whenever compileRegex's output changes) or
+ * another build is ignored and overwritten on save.
+ */
+#define REGEX_COMPILER_VERSION 1
+#define REGEX_CACHE_MAGIC "rxcache"
+#define REGEX_CACHE_MAX 16384
+
+typedef struct CacheHeader {
+    char magic[8];
+    unsigned int order;          /* 0x01020304 as written */
+    unsigned int version;        /* REGEX_COMPILER_VERSION */
+    unsigned int uniCharSize;    /* sizeof(Tcl_UniChar) */
+    unsigned int numEntries;
+} CacheHeader;
+
+typedef struct CacheEntry {
+    int length;
+    int owned;                   /* code is ours, not in the file */
+    const unsigned char *code;
+} CacheEntry;
+
+static struct {
+    char *path;                  /* NULL when no cache is open */
+    void *map;
+    size_t mapSize;
+    int initialized;
+    Tcl_HashTable entries;       /* CacheEntry by pattern */
+    Tcl_WideInt hits, misses;
+} cache;
+
+TCL_DECLARE_MUTEX(cacheMutex)
+
+/* FNV-1a */
+static unsigned int
+cacheChecksum(const unsigned char *pattern, unsigned int patternLength,
+              const unsigned char *code, unsigned int codeLength)
+{
+    unsigned int h = 2166136261u, i;
+
+    for (i = 0; i < patternLength; i++) h = (h ^ pattern[i]) * 16777619u;
+    for (i = 0; i < codeLength; i++) h = (h ^ code[i]) * 16777619u;
+    return h;
+}
+
+/* Must hold cacheMutex. */
+static void
+closeCache(void)
+{
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+    CacheEntry *e;
+
+    if (!cache.initialized) return;
+    for (entry = Tcl_FirstHashEntry(&cache.entries, &search); entry;
+         entry = Tcl_NextHashEntry(&search)) {
+        e = Tcl_GetHashValue(entry);
+        if (e->owned) ckfree((char *)e->code);
+        ckfree(e);
+    }
+    Tcl_DeleteHashTable(&cache.entries);
+    if (cache.map) munmap(cache.map, cache.mapSize);
+    if (cache.path) ckfree(cache.path);
+    cache.path = NULL;
+    cache.map = NULL;
+    cache.initialized = 0;
+}
+
+static int
+addCacheEntry(const char *pattern, const unsigned char *code, int length,
+              int owned)
+{
+    Tcl_HashEntry *entry;
+    CacheEntry *e;
+    int isNew;
+
+    if (cache.entries.numEntries >= REGEX_CACHE_MAX) return 0;
+    entry = Tcl_CreateHashEntry(&cache.entries, pattern, &isNew);
+    if (!isNew) return 0;
+    e = ckalloc(sizeof(CacheEntry));
+    e->length = length;
+    e->owned = owned;
+    e->code = code;
+    Tcl_SetHashValue(entry, e);
+    return 1;
+}
+
+/*
+ * Open the cache at path, closing any other. Returns how many regexes
+ * it has, or -1 with an error in interp if the file exists but isn't
+ * a cache (which is then left alone).
+ */
+static int
+openCache(Tcl_Interp *interp, const char *path)
+{
+    CacheHeader header;
+    struct stat st;
+    unsigned char *p, *end;
+    unsigned int i, patternLength, codeLength, checksum;
+    void *map = NULL;
+    int fd;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REGEX_CACHE_MAGIC, sizeof(REGEX_CACHE_MAGIC));
+    header.order = 0x01020304;
+    header.version = REGEX_COMPILER_VERSION;
+    header.uniCharSize = sizeof(Tcl_UniChar);
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        if (errno != ENOENT) goto posixError;
+        st.st_size = 0;
+    } else {
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            goto posixError;
+        }
+        if (st.st_size > 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) goto posixError;
+        if ((size_t)st.st_size < sizeof(CacheHeader)
+            || memcmp(map, REGEX_CACHE_MAGIC, sizeof(REGEX_CACHE_MAGIC))) {
+            goto notCache;
+        }
+    }
+
+    Tcl_MutexLock(&cacheMutex);
+    closeCache();
+    Tcl_InitHashTable(&cache.entries, TCL_STRING_KEYS);
+    cache.initialized = 1;
+    cache.path = ckalloc(strlen(path) + 1);
+    strcpy(cache.path, path);
+    cache.map = map;
+    cache.mapSize = st.st_size;
+    cache.hits = cache.misses = 0;
+    if (map && memcmp(map, &header, offsetof(CacheHeader, numEntries)) == 0) {
+        p = (unsigned char *)map + sizeof(CacheHeader);
+        end = (unsigned char *)map + st.st_size;
+        for (i = 0; i < ((CacheHeader *)map)->numEntries; i++) {
+            if (end - p < 12) break;
+            memcpy(&patternLength, p, 4);
+            memcpy(&codeLength, p + 4, 4);
+            memcpy(&checksum, p + 8, 4);
+            p += 12;
+            if (patternLength >= (size_t)(end - p)
+                || codeLength > (size_t)(end - p) - patternLength - 1) {
+                break;
+            }
+            if (p[patternLength] == 0 && !memchr(p, 0, patternLength)
+                && codeLength > 0
+                && checksum == cacheChecksum(p, patternLength,
+                                             p + patternLength + 1,
+                                             codeLength)) {
+                addCacheEntry((char *)p, p + patternLength + 1, codeLength, 0);
+            }
+            if ((size_t)(end - p) < patternLength + 1 + codeLength + 3) break;
+            p += (patternLength + 1 + codeLength + 3) & ~3;
+        }
+    }
+    i = cache.entries.numEntries;
+    Tcl_MutexUnlock(&cacheMutex);
+    return i;
+
+notCache:
+    if (map) munmap(map, st.st_size);
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+        "couldn't open regex cache \"%s\": not a regex cache", path));
+    return -1;
+posixError:
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+        "couldn't open regex cache \"%s\": %s", path, Tcl_PosixError(interp)));
+    return -1;
+}
+
+/*
+ * Write all regexes in the cache to its file, by way of a temporary
+ * one renamed over it. Returns how many, or -1 with an error in
+ * interp.
+ */
+static int
+saveCache(Tcl_Interp *interp)
+{
+    static const char zeros[4] = {0, 0, 0, 0};
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+    Tcl_DString tmp;
+    CacheHeader header;
+    CacheEntry *e;
+    const char *pattern;
+    unsigned int lengths[3];
+    int fd, n, ok = 1;
+
+    Tcl_MutexLock(&cacheMutex);
+    if (!cache.path) {
+        Tcl_MutexUnlock(&cacheMutex);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("no regex cache open", -1));
+        return -1;
+    }
+    Tcl_DStringInit(&tmp);
+    Tcl_DStringAppend(&tmp, cache.path, -1);
+    Tcl_DStringAppend(&tmp, ".tmp", -1);
+    if ((fd = open(Tcl_DStringValue(&tmp), O_WRONLY|O_CREAT|O_TRUNC, 0666))
+        < 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't open \"%s\": %s",
+            Tcl_DStringValue(&tmp), Tcl_PosixError(interp)));
+        Tcl_MutexUnlock(&cacheMutex);
+        Tcl_DStringFree(&tmp);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REGEX_CACHE_MAGIC, sizeof(REGEX_CACHE_MAGIC));
+    header.order = 0x01020304;
+    header.version = REGEX_COMPILER_VERSION;
+    header.uniCharSize = sizeof(Tcl_UniChar);
+    header.numEntries = n = cache.entries.numEntries;
+    ok = write(fd, &header, sizeof(header)) == sizeof(header);
+    for (entry = Tcl_FirstHashEntry(&cache.entries, &search); ok && entry;
+         entry = Tcl_NextHashEntry(&search)) {
+        pattern = Tcl_GetHashKey(&cache.entries, entry);
+        e = Tcl_GetHashValue(entry);
+        lengths[0] = strlen(pattern);
+        lengths[1] = e->length;
+        lengths[2] = cacheChecksum((unsigned char *)pattern, lengths[0],
+                                   e->code, e->length);
+        ok = write(fd, lengths, 12) == 12
+            && write(fd, pattern, lengths[0] + 1) == lengths[0] + 1
+            && write(fd, e->code, e->length) == e->length
+            && write(fd, zeros, -(lengths[0] + 1 + e->length) & 3)
+               == (-(lengths[0] + 1 + e->length) & 3);
+    }
+    if (close(fd) < 0) ok = 0;
+    if (ok && rename(Tcl_DStringValue(&tmp), cache.path) < 0) ok = 0;
+    if (!ok) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "couldn't write regex cache \"%s\": %s", cache.path,
+            Tcl_PosixError(interp)));
+        unlink(Tcl_DStringValue(&tmp));
+        n = -1;
+    }
+    Tcl_MutexUnlock(&cacheMutex);
+    Tcl_DStringFree(&tmp);
+    return n;
+}
+
+/* A copy of the cached program for pattern, or NULL. */
+static unsigned char *
+cachedRegex(const char *pattern, int *lengthPtr)
+{
+    Tcl_HashEntry *entry;
+    CacheEntry *e;
+    unsigned char *code = NULL;
+
+    if (!cache.path) return NULL;    /* a racy peek is fine */
+    Tcl_MutexLock(&cacheMutex);
+    if (cache.path) {
+        if ((entry = Tcl_FindHashEntry(&cache.entries, pattern))) {
+            e = Tcl_GetHashValue(entry);
+            code = ckalloc(e->length);
+            memcpy(code, e->code, e->length);
+            *lengthPtr = e->length;
+            cache.hits++;
+        } else {
+            cache.misses++;
+        }
+    }
+    Tcl_MutexUnlock(&cacheMutex);
+    return code;
+}
+
+/* Add regex, just compiled and validated, to an open cache. */
+static void
+cacheRegex(const char *pattern, Regex *regex)
+{
+    unsigned char *code;
+
+    if (!cache.path) return;
+    Tcl_MutexLock(&cacheMutex);
+    if (cache.path && !Tcl_FindHashEntry(&cache.entries, pattern)) {
+        code = ckalloc(regex->codeLength);
+        memcpy(code, regex->prog, regex->codeLength);
+        if (!addCacheEntry(pattern, code, regex->codeLength, 1)) {
+            ckfree(code);
+        }
+    }
+    Tcl_MutexUnlock(&cacheMutex);
+}
 
 #define GET_REGEX(o) ((o)->internalRep.otherValuePtr)
 #define SET_REGEX(o, c) ((o)->internalRep.otherValuePtr = (c))
@@ -98,40 +704,40 @@ getRegexFromObj(Tcl_Interp *interp, Tcl_Obj *obj)
 {
     unsigned char op, *code, *p, *end, *validDest;
     Tcl_UniChar ch;
-    int pass, target1, target2, n, codeLen, size, maxSlot = -1;
+    int pass, target1, target2, n, i, codeLen, maxSlot, cached;
     Regex *regex;
-    static ssize_t maxSize = -1;
-    ssize_t spaceNeeded;
-    Tcl_InterpState interpState;
-    static Tcl_Obj *compileCmd = NULL;
-    Tcl_Obj *cmdLine[2], *result;
+#ifdef REGEX_STATS
+    Tcl_Time start, now;
+#endif
 
     if (obj->typePtr == &regexType) {
         return GET_REGEX(obj);
     }
 
-    if (!compileCmd) {
-        compileCmd = Tcl_NewStringObj("::regex::compile", -1);
-        Tcl_IncrRefCount(compileCmd);
-    }
-    cmdLine[0] = compileCmd;
-    cmdLine[1] = obj;
-    interpState = Tcl_SaveInterpState(interp, TCL_OK);
-    if (Tcl_EvalObjv(interp, 2, cmdLine, TCL_EVAL_GLOBAL) != TCL_OK) {
-        result = Tcl_GetObjResult(interp);
-        Tcl_IncrRefCount(result);
-        Tcl_RestoreInterpState(interp, interpState);
-        Tcl_SetObjResult(interp, result);
-        Tcl_DecrRefCount(result);
+#ifdef REGEX_STATS
+    Tcl_GetTime(&start);
+#endif
+    code = cachedRegex(Tcl_GetString(obj), &codeLen);
+    cached = code != NULL;
+compile:
+    if (!code && !(code = compileRegex(interp, obj, &codeLen))) {
         return NULL;
     }
-    code = Tcl_GetByteArrayFromObj(Tcl_GetObjResult(interp), &codeLen);
+    maxSlot = -1;
     regex = ckalloc(sizeof(Regex) + codeLen - 1);
     regex->numInsts = 0;
     regex->codeLength = codeLen;
+    regex->dfa = NULL;
+    regex->peakSubs = 0;
+    regex->numRuns = 0;
+    regex->runs = NULL;
+    regex->keyBase = NULL;
+    regex->entry = 0;
+    regex->unanchored = 0;
+    regex->prefixOffset = regex->prefixLength = 0;
+    regex->requiredOffset = regex->requiredLength = 0;
     memcpy(regex->prog, code, codeLen);
-    
-    Tcl_RestoreInterpState(interp, interpState);
+    ckfree(code);
     code = regex->prog;
     
     /*
@@ -161,6 +767,26 @@ getRegexFromObj(Tcl_Interp *interp, Tcl_Obj *obj)
                 if (!Tcl_UtfCharComplete((char *)p, end-p)) goto error;
                 p += Tcl_UtfToUniChar((char *)p, &ch);
                 continue;
+            case INST_STRING:
+                /*
+                 * Length in bytes, then the chars. A thread can be at
+                 * each of them, keyed by the byte's pc, so it counts as
+                 * that many instructions.
+                 */
+                if (p >= end) goto error;
+                n = *p++;
+                if (n < 2 || end - p < n) goto error;
+                for (i = 0; i < n; ) {
+                    if (p[i] == 0
+                        || !Tcl_UtfCharComplete((char *)p + i, n - i)) {
+                        goto error;
+                    }
+                    i += Tcl_UtfToUniChar((char *)p + i, &ch);
+                    if (pass == 0 && i < n) regex->numInsts++;
+                }
+                if (i != n) goto error;
+                p += n;
+                continue;
             case INST_GOTO:
                 if (p+1 >= end) goto error;
                 target1 = p[0] << 8 | p[1];
@@ -189,18 +815,48 @@ getRegexFromObj(Tcl_Interp *interp, Tcl_Obj *obj)
                 continue;
             case INST_ANY: case INST_END: case INST_START: case INST_MATCH:
                 continue;
+            case INST_REPEAT:
+                if (end - p < 6) goto error;
+                target1 = p[4] << 8 | p[5];
+                p += 6;
+                if (pass == 1 && (target1 >= codeLen || !validDest[target1]))
+                    goto error;
+                continue;
+            case INST_AGAIN:
+                if (p+1 >= end) goto error;
+                target1 = p[0] << 8 | p[1];
+                p += 2;
+                if (pass == 1 && (target1 >= codeLen || !validDest[target1]
+                                  || code[target1] >> 2 != INST_REPEAT))
+                    goto error;
+                continue;
             case INST_BRACKET:
+                /* Bitmap of chars below 256, then ranges unless op & 2 */
+                if (end - p < 32) goto error;
+                p += 32;
+                if (op & 2) continue;
                 if (p+1 >= end) goto error;
                 n = p[0] << 8 | p[1];
                 p += 2;
-                if (op & 2) {
-                    size = 1;
-                } else {
-                    size = 4;
-                    p = (unsigned char *)(((uintptr_t)p + 3) & ~3);
-                }
-                if (n < 1 || p + 2*n*size > end) goto error;
-                p += 2*n*size;
+                p = (unsigned char *)(((uintptr_t)p + 3) & ~3);
+                if (n < 1 || p + 8*n > end) goto error;
+                p += 8*n;
+                continue;
+            case INST_HINT:
+                /* Header, only valid as the first instruction */
+                if (p-1 != code) goto error;
+                validDest[0] = 0;
+                regex->unanchored = op & 1;
+                if (p+1 >= end) goto error;
+                regex->prefixLength = p[0] << 8 | p[1];
+                regex->prefixOffset = p+2 - code;
+                p += 2 + regex->prefixLength;
+                if (p+1 >= end) goto error;
+                regex->requiredLength = p[0] << 8 | p[1];
+                regex->requiredOffset = p+2 - code;
+                p += 2 + regex->requiredLength;
+                if (p >= end) goto error;
+                regex->entry = p - code;
                 continue;
             default:
                 goto error;
@@ -212,9 +868,20 @@ getRegexFromObj(Tcl_Interp *interp, Tcl_Obj *obj)
     if ((regex->numSlots & 1) == 1) {
         /* Never happens with regex compiler */
         Tcl_SetObjResult(interp, Tcl_NewStringObj("odd number of slots", -1));
-        ckfree(regex);
-        return NULL;
+        goto fail;
     }
+    if (findRepeats(interp, regex, 1, &regex->entry) != TCL_OK) {
+        goto fail;
+    }
+    findRuns(regex);
+    if (!cached) cacheRegex(Tcl_GetString(obj), regex);
+#ifdef REGEX_STATS
+    Tcl_GetTime(&now);
+    regex->stats = patternStats(Tcl_GetString(obj));
+    regex->stats->compiles++;
+    regex->stats->compileTime += (Tcl_WideInt)(now.sec - start.sec) * 1000000
+        + now.usec - start.usec;
+#endif
 
     /* Set internal representation. */
     if (obj->typePtr && obj->typePtr->freeIntRepProc) {
@@ -222,32 +889,32 @@ getRegexFromObj(Tcl_Interp *interp, Tcl_Obj *obj)
     }
     SET_REGEX(obj, regex);
     obj->typePtr = &regexType;
-
-    /* Reserve needed space */
-    spaceNeeded = sizeof(Context)
-        + regex->codeLength*sizeof(int) /* lastChecked */
-        + 2*regex->numInsts*sizeof(Thread); /* threadLists */
-    if (maxSize == -1) {
-        contextSpace = ckalloc(spaceNeeded);
-        maxSize = spaceNeeded;
-    } else if (spaceNeeded > maxSize) {
-        contextSpace = ckrealloc(contextSpace, spaceNeeded);
-        maxSize = spaceNeeded;
-    }
-
     return regex;
 
 error:
     ckfree(validDest);
-    ckfree(regex);
     Tcl_SetObjResult(interp, Tcl_ObjPrintf("regex bytecode bad at %d", p-code));
+fail:
+    ckfree(regex);
+    if (cached) {
+        /* A bad program from the cache: compile it after all */
+        Tcl_ResetResult(interp);
+        code = NULL;
+        cached = 0;
+        goto compile;
+    }
     return NULL;
 }
 
 static void
 freeRegexIntRep(Tcl_Obj *obj)
 {
-    ckfree(GET_REGEX(obj));
+    Regex *regex = GET_REGEX(obj);
+
+    if (regex->dfa) freeDfa(regex->dfa);
+    if (regex->runs) ckfree(regex->runs);
+    if (regex->keyBase) ckfree(regex->keyBase);
+    ckfree(regex);
     obj->typePtr = NULL;
 }
 
@@ -261,6 +928,16 @@ dupRegexIntRep(Tcl_Obj *src, Tcl_Obj *dst)
     size = sizeof(Regex) + srcRegex->codeLength - 1;
     dstRegex = ckalloc(size);
     memcpy(dstRegex, srcRegex, size);
+    dstRegex->dfa = NULL;
+    if (srcRegex->runs) {
+        dstRegex->runs = ckalloc(sizeof(Run) * RUN_MAX);
+        memcpy(dstRegex->runs, srcRegex->runs, sizeof(Run) * srcRegex->numRuns);
+    }
+    if (srcRegex->keyBase) {
+        dstRegex->keyBase = ckalloc(sizeof(int) * srcRegex->codeLength);
+        memcpy(dstRegex->keyBase, srcRegex->keyBase,
+               sizeof(int) * srcRegex->codeLength);
+    }
     SET_REGEX(dst, dstRegex);
     dst->typePtr = &regexType;
 }
@@ -280,273 +957,4488 @@ updateStringOfRegex(Tcl_Obj *obj)
     Tcl_DecrRefCount(b);
 }
 
-/* Execution functions */
-static Context *
-newContext(Regex *regex, int beginning)
-{
-    Context *ctx;
-    char *p;
-
-    ctx = contextSpace;
-    p = (char *)ctx;
-    p += sizeof(Context);
-    ctx->lastChecked = (int *)p;
-    memset(ctx->lastChecked, 0, regex->codeLength*sizeof(int));
-    p += regex->codeLength*sizeof(int);
-    ctx->threadLists[0].list = (Thread *)p;
-    p += regex->numInsts*sizeof(Thread);
-    ctx->threadLists[1].list = (Thread *)p;
-
-    ctx->prog = regex->prog;
-    ctx->numSlots = regex->numSlots;
-    ctx->beginning = beginning;
-    ctx->turnCount = 1;
-    ctx->threadLists[0].numThreads = 0;
-    ctx->threadLists[1].numThreads = 0;
-    ctx->savedMatch = NULL;
-    ctx->extantSubs = 0;
-    return ctx;
-}
-
-static Sub *
-newSub(Context *ctx)
+static void
+releaseRegexSet(RegexSet *set)
 {
-    int i;
-    Sub *sub;
-
-    sub = ckalloc(sizeof(Sub) + (ctx->numSlots-1)*sizeof(Slot));
-    sub->refCount = 1;
-    for (i = 0; i < ctx->numSlots; i++) {
-        sub->slots[i].charPtr = NULL;
-        sub->slots[i].charIndex = 0;
-    }
-    ctx->extantSubs++;
-    return sub;
+    if (--set->refCount > 0) return;
+    ckfree(set->entries);
+    ckfree(set->unanchored);
+    ckfree(set->owner);
+    if (set->regex->keyBase) ckfree(set->regex->keyBase);
+    ckfree(set->regex);
+    ckfree(set);
 }
 
 static void
-retainSub(Sub *sub)
+freeRegexSetIntRep(Tcl_Obj *obj)
 {
-    sub->refCount++;
+    releaseRegexSet(obj->internalRep.otherValuePtr);
+    obj->typePtr = NULL;
 }
 
 static void
-releaseSub(Context *ctx, Sub *sub)
+dupRegexSetIntRep(Tcl_Obj *src, Tcl_Obj *dst)
 {
-    if (sub->refCount-- <= 1) {
-        sub->refCount = 0xdeadbeef;
-        ckfree(sub);
-        ctx->extantSubs--;
-    }
+    RegexSet *set = src->internalRep.otherValuePtr;
+
+    set->refCount++;
+    dst->internalRep.otherValuePtr = set;
+    dst->typePtr = &regexSetType;
 }
 
-static Sub *
-updateSub(Context *ctx, Sub *sub, int slot, const char *charPtr, int charIndex)
+/*
+ * Compile a list of regexes into a set. Each program is copied whole
+ * (header included, so that BRACKET alignment is kept) at a multiple
+ * of 4, and its jump targets relocated.
+ */
+static RegexSet *
+getRegexSetFromObj(Tcl_Interp *interp, Tcl_Obj *obj)
 {
-    Sub *result;
+    int objc, i, pc, base, pad, target, len, capacity;
+    Tcl_Obj **objv;
+    unsigned char *code = NULL, *cp;
+    RegexSet *set;
+    Regex *regex, *combined;
 
-    if (sub->refCount > 1) {
-        result = newSub(ctx);
-        memcpy(result->slots, sub->slots, ctx->numSlots*sizeof(Slot));
-        sub->refCount--;
-    } else {
-        result = sub;
+    if (obj->typePtr == &regexSetType) {
+        return obj->internalRep.otherValuePtr;
     }
-    result->slots[slot].charPtr = charPtr;
-    result->slots[slot].charIndex = charIndex;
-    return result;
-}
 
-#define curList (&ctx->threadLists[ctx->turnCount & 1])
-#define nextList (&ctx->threadLists[1 ^ (ctx->turnCount & 1)])
+    Tcl_GetString(obj);
+    if (Tcl_ListObjGetElements(interp, obj, &objc, &objv) != TCL_OK) {
+        return NULL;
+    }
 
-/*
- * Expects sub's ref count to be pre-incremented. Will "match" one
- * ref count of sub by either storing or decrementing.
- */
-static int
-follow(Context *ctx, int pc, Sub *sub, const char *charPtr, int charIndex,
-       int atEnd)
-{
-    int op;
-    unsigned char *cp;
-    Thread *thread;
+    set = ckalloc(sizeof(RegexSet));
+    set->refCount = 1;
+    set->numPatterns = objc;
+    set->entries = ckalloc(sizeof(int) * (objc + 1));
+    set->unanchored = ckalloc(sizeof(int) * (objc + 1));
+    set->owner = NULL;
+    combined = ckalloc(sizeof(Regex));
+    memset(combined, 0, sizeof(Regex));
+    len = capacity = 0;
 
     /*
-     * Check if we've already scheduled this thread during this turn.
+     * Copy each program right away: the list may hold the same object
+     * twice, or objects shared with other lists.
      */
-    if (ctx->lastChecked[pc] == ctx->turnCount) {
-        releaseSub(ctx, sub);
-        return 0;
-    }
-
-    ctx->lastChecked[pc] = ctx->turnCount;
-    cp = ctx->prog + pc;
-    op = *cp;
-    switch (op >> 2) {
-    case INST_GOTO:
-        return follow(ctx, cp[1] << 8 | cp[2], sub, charPtr, charIndex, atEnd);
-    case INST_SPLIT:
-        retainSub(sub); /* prevent first follow call from altering sub */
-        if (follow(ctx, cp[1] << 8 | cp[2], sub, charPtr, charIndex, atEnd)) {
-            releaseSub(ctx, sub);
-            return 1;
+    for (i = 0; i < objc; i++) {
+        if (!(regex = getRegexFromObj(interp, objv[i]))) goto error;
+        base = (len + 3) & ~3;
+        pad = base - len;
+        len = base + regex->codeLength;
+        if (len > 0x10000) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("regex set too large", -1));
+            goto error;
         }
-        return follow(ctx, cp[3] << 8 | cp[4], sub, charPtr, charIndex, atEnd);
-    case INST_SAVE:
-        sub = updateSub(ctx, sub, cp[1] << 8 | cp[2], charPtr, charIndex);
-        return follow(ctx, pc+3, sub, charPtr, charIndex, atEnd);
-    case INST_MATCH:
-        if (ctx->savedMatch) releaseSub(ctx, ctx->savedMatch);
-        ctx->savedMatch = sub;
-        return 1;
-    case INST_END:
-        if (atEnd)
-            return follow(ctx, pc+1, sub, charPtr, charIndex, atEnd);
-        releaseSub(ctx, sub);
-        break;
-    case INST_START:
-        if (charIndex == ctx->beginning)
-            return follow(ctx, pc+1, sub, charPtr, charIndex, atEnd);
-        releaseSub(ctx, sub);
-        break;
-    default:
-        if (atEnd) {
-            releaseSub(ctx, sub);
-        } else {
-            thread = &nextList->list[nextList->numThreads++];
-            thread->pc = pc;
-            thread->sub = sub;
+        if (len > capacity) {
+            capacity = 2*len;
+            code = ckrealloc(code, capacity);
+            set->owner = ckrealloc(set->owner, sizeof(int) * capacity);
+        }
+        memset(code + base - pad, 0, pad);
+        memcpy(code + base, regex->prog, regex->codeLength);
+        for (pc = base; pc < len; pc++) set->owner[pc] = i;
+        for (pc = base + regex->entry; pc < len; pc = nextInst(code, pc)) {
+            cp = code + pc;
+            switch (*cp >> 2) {
+            case INST_REPEAT:
+                target = (cp[5] << 8 | cp[6]) + base;
+                cp[5] = target >> 8;
+                cp[6] = target & 0xff;
+                break;
+            case INST_SPLIT:
+                target = (cp[3] << 8 | cp[4]) + base;
+                cp[3] = target >> 8;
+                cp[4] = target & 0xff;
+                /* fall through */
+            case INST_GOTO: case INST_AGAIN:
+                target = (cp[1] << 8 | cp[2]) + base;
+                cp[1] = target >> 8;
+                cp[2] = target & 0xff;
+                break;
+            }
         }
+        set->entries[i] = base + regex->entry;
+        set->unanchored[i] = regex->unanchored;
+        if (regex->numSlots > combined->numSlots) combined->numSlots = regex->numSlots;
+        combined->numInsts += regex->numInsts;
     }
-    return 0;
-}
-
-static Sub *
-execute(Regex *regex, const char *str, const char *end, int charIndex,
-        int beginning)
-{
-    unsigned char *code;
-    Context *ctx;
-    Sub *sub;
-    int i, pc, op, invert, ascii, size, length;
-    Tcl_UniChar ch, matchChar;
 
-    ctx = newContext(regex, beginning);
-    sub = newSub(ctx);
-    code = ctx->prog;
+    set->regex = ckalloc(sizeof(Regex) + len);
+    *set->regex = *combined;
+    ckfree(combined);
+    set->regex->codeLength = len;
+    if (len) memcpy(set->regex->prog, code, len);
+    if (code) ckfree(code);
+    if (!set->owner) set->owner = ckalloc(sizeof(int));
+#ifdef REGEX_STATS
+    set->regex->stats = &getThreadData()->otherStats;
+#endif
+    if (findRepeats(interp, set->regex, objc, set->entries) != TCL_OK) {
+        releaseRegexSet(set);
+        return NULL;
+    }
+
+    if (obj->typePtr && obj->typePtr->freeIntRepProc) {
+        obj->typePtr->freeIntRepProc(obj);
+    }
+    obj->internalRep.otherValuePtr = set;
+    obj->typePtr = &regexSetType;
+    return set;
+
+error:
+    if (code) ckfree(code);
+    if (set->owner) ckfree(set->owner);
+    ckfree(set->entries);
+    ckfree(set->unanchored);
+    ckfree(set);
+    ckfree(combined);
+    return NULL;
+}
+
+/*
+ * Native compiler. This is a transcription of regex::compile in
+ * regex.tcl, which stays the reference: for every regex both must
+ * produce the same bytecode, errors included. The functions below are
+ * named after the procedures they mirror.
+ */
+
+/* Parse tree, as built by regex::parse_exp and friends */
+enum {
+    AST_EMPTY, AST_CHR, AST_ANY, AST_START, AST_END, AST_BRACKET,
+    AST_SUB, AST_CAT, AST_ALT, AST_REP, AST_REP1, AST_REPEAT,
+    AST_BACKSLASH               /* a trailing backslash, never compiles */
+};
+
+typedef struct Ast {
+    int type;
+    int value;                  /* CHR: char, SUB: group, BRACKET: invert,
+                                 * REPEAT: min count */
+    int hi;                     /* REPEAT: max count, -1 if unbounded */
+    int greedy;                 /* ALT: -1 unless it came from ? */
+    struct Ast *a, *b;
+    int numChars;               /* BRACKET: elements joined, as in Tcl */
+    int charsCapacity;
+    int *chars;
+} Ast;
+
+/* Continuation-passing form, as built by regex::comp */
+enum {
+    K_MATCH, K_GOTO, K_SPLIT, K_CHR, K_ANY, K_START, K_END, K_BRACKET,
+    K_SAVE, K_LABEL, K_REPEAT, K_AGAIN, K_STRING
+};
+
+typedef struct Kont {
+    int type;
+    int value;                  /* CHR: char, SAVE: slot, STRING: number
+                                 * of chars, others: label */
+    int value2;                 /* SPLIT: second label, STRING: bytes */
+    int *chars;                 /* STRING */
+    Ast *ast;                   /* BRACKET, and REPEAT for its counts */
+    struct Kont *next;          /* rest of the code, NULL after a jump */
+} Kont;
+
+/* Labels: Lm is 0, Ln is n, and the start label Ls is -1. */
+#define LABEL_MATCH 0
+#define LABEL_START -1
+
+/* Results of the parse functions, as the PARSE FAIL/ERROR codes */
+#define PARSE_OK 0
+#define PARSE_FAIL 1
+#define PARSE_ERROR 2
+
+typedef struct Compiler {
+    int *in;                    /* the regex, one char per element */
+    int length;
+    int pos;
+    Tcl_Obj *errMsg;            /* for PARSE_ERROR and compile errors */
+    int errPos;
+    int captureCount;
+
+    int nextLabel;
+    int inLoop;                 /* comp is in a counted loop's body */
+    Kont **blocks;              /* by label, NULL once placed */
+    int blocksCapacity;
+    void *allocs;               /* chain of everything allocated */
+
+    unsigned char *buf;
+    int bufLength, bufCapacity;
+    int *labelPos;
+    int *fixups;                /* pairs of code offset, label */
+    int numFixups, fixupsCapacity;
+} Compiler;
+
+static void *
+compAlloc(Compiler *c, size_t size)
+{
+    void **p = ckalloc(sizeof(void *) + size);
+
+    *p = c->allocs;
+    c->allocs = p;
+    return p + 1;
+}
+
+static Ast *
+newAst(Compiler *c, int type, Ast *a, Ast *b)
+{
+    Ast *ast = compAlloc(c, sizeof(Ast));
+
+    ast->type = type;
+    ast->value = 0;
+    ast->hi = 0;
+    ast->greedy = -1;
+    ast->a = a;
+    ast->b = b;
+    ast->numChars = ast->charsCapacity = 0;
+    ast->chars = NULL;
+    return ast;
+}
+
+static Kont *
+newKont(Compiler *c, int type, int value, Kont *next)
+{
+    Kont *k = compAlloc(c, sizeof(Kont));
+
+    k->type = type;
+    k->value = value;
+    k->value2 = 0;
+    k->chars = NULL;
+    k->ast = NULL;
+    k->next = next;
+    return k;
+}
+
+static int
+parseError(Compiler *c, Tcl_Obj *msg)
+{
+    c->errMsg = msg;
+    Tcl_IncrRefCount(msg);
+    c->errPos = c->pos;
+    return PARSE_ERROR;
+}
+
+#define PEEK(c) ((c)->pos < (c)->length ? (c)->in[(c)->pos] : -1)
+
+/* Left fold of an array of trees, empty for none (regex::fold) */
+static Ast *
+foldAst(Compiler *c, int type, Ast **ls, int n)
+{
+    Ast *exp;
+    int i;
+
+    if (n == 0) return newAst(c, AST_EMPTY, NULL, NULL);
+    exp = ls[0];
+    for (i = 1; i < n; i++) exp = newAst(c, type, exp, ls[i]);
+    return exp;
+}
+
+static int parseExp(Compiler *c, Ast **expPtr);
+
+static int
+parseGreedy(Compiler *c)
+{
+    if (PEEK(c) == '?') {
+        c->pos++;
+        return 0;
+    }
+    return 1;
+}
+
+/* Append n chars to a bracket's joined elements. */
+static void
+bracketAppend(Compiler *c, Ast *bracket, const int *chars, int n)
+{
+    int *p;
+
+    if (bracket->numChars + n > bracket->charsCapacity) {
+        bracket->charsCapacity = bracket->charsCapacity
+            ? 2*bracket->charsCapacity : 16;
+        if (bracket->charsCapacity < bracket->numChars + n) {
+            bracket->charsCapacity = bracket->numChars + n;
+        }
+        p = compAlloc(c, sizeof(int) * bracket->charsCapacity);
+        if (bracket->numChars) {
+            memcpy(p, bracket->chars, sizeof(int) * bracket->numChars);
+        }
+        bracket->chars = p;
+    }
+    memcpy(bracket->chars + bracket->numChars, chars, sizeof(int) * n);
+    bracket->numChars += n;
+}
+
+/* tcl_parser::parse_backslash_escape, past the backslash */
+static int
+parseBackslashEscape(Compiler *c)
+{
+    static const char escapes[] = "a\007b\010f\014n\012r\015t\011v\013";
+    const char *e;
+    int ch = PEEK(c), digits, i, d, res;
+
+    for (e = escapes; *e; e += 2) {
+        if (ch == e[0]) {
+            c->pos++;
+            return e[1];
+        }
+    }
+    if (ch == 'x' || ch == 'u' || ch == 'U') {
+        digits = ch == 'x' ? 2 : ch == 'u' ? 4 : 8;
+        c->pos++;
+        res = 0;
+        for (i = 0; i < digits; i++) {
+            d = PEEK(c);
+            if (d >= '0' && d <= '9') d -= '0';
+            else if (d >= 'a' && d <= 'f') d -= 'a' - 10;
+            else if (d >= 'A' && d <= 'F') d -= 'A' - 10;
+            else break;
+            c->pos++;
+            res = res*16 + d;
+        }
+        return i > 0 ? res : ch;
+    }
+    c->pos++;
+    return ch;
+}
+
+/*
+ * regex::parse_backslash. In a bracket, the chars go into bracket;
+ * otherwise the result is a tree.
+ */
+static Ast *
+parseBackslash(Compiler *c, Ast *bracket)
+{
+    static const int digit[] = {'0', '-', '9'};
+    static const int space[] = {' ', '\r', '\n', '\t', '\v'};
+    static const int word[] = {'a', '-', 'z', 'A', '-', 'Z', '0', '-', '9', '_'};
+    const int *range;
+    int n, ch;
+    Ast *exp;
+
+    switch (ch = (c->pos + 1 < c->length ? c->in[c->pos + 1] : -1)) {
+    case 'd': range = digit; n = 3; break;
+    case 's': range = space; n = 5; break;
+    case 'w': range = word; n = 10; break;
+    case 'A': case 'Z':
+        c->pos += 2;
+        if (!bracket) {
+            return newAst(c, ch == 'A' ? AST_START : AST_END, NULL, NULL);
+        }
+        range = &ch;
+        n = 1;
+        break;
+    case -1:
+        c->pos++;
+        if (!bracket) return newAst(c, AST_BACKSLASH, NULL, NULL);
+        ch = '\\';
+        range = &ch;
+        n = 1;
+        break;
+    default:
+        c->pos++;
+        ch = parseBackslashEscape(c);
+        if (!bracket) {
+            exp = newAst(c, AST_CHR, NULL, NULL);
+            exp->value = ch;
+            return exp;
+        }
+        range = &ch;
+        n = 1;
+    }
+    if (range != &ch) c->pos += 2;
+    exp = NULL;
+    if (!bracket) exp = bracket = newAst(c, AST_BRACKET, NULL, NULL);
+    bracketAppend(c, bracket, range, n);
+    return exp;
+}
+
+static int
+parsePrimary(Compiler *c, Ast **expPtr)
+{
+    Ast *exp;
+    int ch, r;
+
+    switch (ch = PEEK(c)) {
+    case '(':
+        c->pos++;
+        if (c->pos + 1 < c->length && c->in[c->pos] == '?'
+            && c->in[c->pos + 1] == ':') {
+            c->pos += 2;
+            if ((r = parseExp(c, &exp)) != PARSE_OK) return r;
+        } else {
+            int n = ++c->captureCount;
+            if ((r = parseExp(c, &exp)) != PARSE_OK) return r;
+            exp = newAst(c, AST_SUB, exp, NULL);
+            exp->value = n;
+        }
+        if (PEEK(c) != ')') return PARSE_FAIL;
+        c->pos++;
+        break;
+    case '.':
+        c->pos++;
+        exp = newAst(c, AST_ANY, NULL, NULL);
+        break;
+    case '^':
+        c->pos++;
+        exp = newAst(c, AST_START, NULL, NULL);
+        break;
+    case '$':
+        c->pos++;
+        exp = newAst(c, AST_END, NULL, NULL);
+        break;
+    case '[':
+        c->pos++;
+        exp = newAst(c, AST_BRACKET, NULL, NULL);
+        if (PEEK(c) == '^') {
+            c->pos++;
+            exp->value = 1;
+        }
+        for (;;) {
+            ch = PEEK(c);
+            if (ch == ']') break;
+            if (ch == -1) {
+                return parseError(c, Tcl_NewStringObj("bracket unbalanced", -1));
+            }
+            if (ch == '\\') {
+                parseBackslash(c, exp);
+            } else {
+                bracketAppend(c, exp, &ch, 1);
+                c->pos++;
+            }
+        }
+        c->pos++;
+        if (exp->numChars == 0) exp = newAst(c, AST_EMPTY, NULL, NULL);
+        break;
+    case '{':
+        c->pos++;
+        if (c->pos >= c->length || Tcl_UniCharIsDigit(c->in[c->pos])) {
+            return PARSE_FAIL;
+        }
+        exp = newAst(c, AST_CHR, NULL, NULL);
+        exp->value = ch;
+        break;
+    case '\\':
+        exp = parseBackslash(c, NULL);
+        break;
+    case '|': case ')': case -1:
+        return PARSE_FAIL;
+    default:
+        c->pos++;
+        exp = newAst(c, AST_CHR, NULL, NULL);
+        exp->value = ch;
+    }
+    *expPtr = exp;
+    return PARSE_OK;
+}
+
+/* regex::parse_int */
+static int
+parseInt(Compiler *c, int *valuePtr)
+{
+    int value = 0;
+
+    if (PEEK(c) == '0') {
+        c->pos++;
+        *valuePtr = 0;
+        return PARSE_OK;
+    }
+    if (PEEK(c) < '0' || PEEK(c) > '9') return PARSE_FAIL;
+    while (PEEK(c) >= '0' && PEEK(c) <= '9') {
+        value = value*10 + (c->in[c->pos++] - '0');
+        if (value > 0xffff) value = 0xffff;
+    }
+    if (value > 0xfffe) {
+        return parseError(c, Tcl_NewStringObj("count too large", -1));
+    }
+    *valuePtr = value;
+    return PARSE_OK;
+}
+
+/* regex::has_repeat */
+static int
+hasRepeat(Ast *ex)
+{
+    switch (ex->type) {
+    case AST_REPEAT:
+        return 1;
+    case AST_SUB: case AST_REP: case AST_REP1:
+        return hasRepeat(ex->a);
+    case AST_CAT: case AST_ALT:
+        return hasRepeat(ex->a) || hasRepeat(ex->b);
+    }
+    return 0;
+}
+
+/* regex::width */
+static int
+width(Ast *ex)
+{
+    int x, y;
+
+    switch (ex->type) {
+    case AST_CHR: case AST_ANY: case AST_BRACKET:
+        return 1;
+    case AST_EMPTY: case AST_START: case AST_END:
+        return 0;
+    case AST_SUB:
+        return width(ex->a);
+    case AST_CAT:
+        x = width(ex->a);
+        y = width(ex->b);
+        return x < 0 || y < 0 ? -1 : x + y;
+    case AST_ALT:
+        x = width(ex->a);
+        return x == width(ex->b) ? x : -1;
+    }
+    return -1;
+}
+
+static int
+parseQuantified(Compiler *c, Ast **expPtr)
+{
+    Ast *exp, *min, *tail, **copies;
+    int r, lo, hi, hasHi, hasComma, greedy, i, save;
+
+    if ((r = parsePrimary(c, &exp)) != PARSE_OK) return r;
+
+    if (exp->type != AST_START && exp->type != AST_END) {
+        switch (PEEK(c)) {
+        case '+':
+            c->pos++;
+            exp = newAst(c, AST_REP1, exp, NULL);
+            exp->greedy = parseGreedy(c);
+            break;
+        case '*':
+            c->pos++;
+            exp = newAst(c, AST_REP, exp, NULL);
+            exp->greedy = parseGreedy(c);
+            break;
+        case '?':
+            c->pos++;
+            exp = newAst(c, AST_ALT, exp, newAst(c, AST_EMPTY, NULL, NULL));
+            exp->greedy = parseGreedy(c);
+            break;
+        case '{':
+            c->pos++;
+            if ((r = parseInt(c, &lo)) != PARSE_OK) return r;
+            hasComma = hasHi = 0;
+            if (PEEK(c) == ',') {
+                c->pos++;
+                hasComma = 1;
+                save = c->pos;
+                if ((r = parseInt(c, &hi)) == PARSE_OK) {
+                    hasHi = 1;
+                } else if (r == PARSE_FAIL) {
+                    c->pos = save;
+                } else {
+                    return r;
+                }
+            }
+            if (PEEK(c) != '}') return PARSE_FAIL;
+            c->pos++;
+            greedy = parseGreedy(c);
+            if (!hasComma) {
+                hi = lo;
+            } else if (!hasHi) {
+                hi = -1;        /* no upper bound */
+            } else if (hi < lo) {
+                return parseError(c, Tcl_ObjPrintf("bad range [%d, %d]", lo, hi));
+            }
+
+            if ((lo > 8 || hi > 8) && width(exp) > 0 && !hasRepeat(exp)) {
+                /*
+                 * Counted loop; the engine keeps a count per thread.
+                 * Loops don't nest, so an outer count still gets
+                 * expanded. So does a body of varying length, where
+                 * the expansion's choice of the count up front gives
+                 * other submatches.
+                 */
+                exp = newAst(c, AST_REPEAT, exp, NULL);
+                exp->value = lo;
+                exp->hi = hi;
+                exp->greedy = greedy;
+                break;
+            }
+
+            /* Simplify counted expressions by expansion */
+            copies = ckalloc(sizeof(Ast *) * (lo + 1));
+            for (i = 0; i < lo; i++) copies[i] = exp;
+            min = foldAst(c, AST_CAT, copies, lo);
+            ckfree(copies);
+            if (hi == lo) {
+                exp = min;
+            } else if (hi < 0) {
+                tail = newAst(c, AST_REP, exp, NULL);
+                tail->greedy = greedy;
+                exp = newAst(c, AST_CAT, min, tail);
+            } else {
+                tail = newAst(c, AST_ALT, exp, newAst(c, AST_EMPTY, NULL, NULL));
+                tail->greedy = greedy;
+                for (i = lo; i+1 < hi; i++) {
+                    tail = newAst(c, AST_ALT, newAst(c, AST_CAT, tail, exp),
+                                  newAst(c, AST_EMPTY, NULL, NULL));
+                    tail->greedy = greedy;
+                }
+                exp = newAst(c, AST_CAT, min, tail);
+            }
+            break;
+        }
+    }
+    *expPtr = exp;
+    return PARSE_OK;
+}
+
+/* Parse into a growing array of trees until the parser fails. */
+static int
+parseRep(Compiler *c, int (*parser)(Compiler *, Ast **), Ast ***lsPtr,
+         int *nPtr)
+{
+    Ast *exp = NULL, **ls = NULL;
+    int n = 0, capacity = 0, save, r;
+
+    for (;;) {
+        save = c->pos;
+        if ((r = parser(c, &exp)) == PARSE_FAIL) {
+            c->pos = save;
+            break;
+        }
+        if (r == PARSE_ERROR) {
+            if (ls) ckfree(ls);
+            return r;
+        }
+        if (n == capacity) {
+            capacity = capacity ? 2*capacity : 8;
+            ls = ckrealloc(ls, sizeof(Ast *) * capacity);
+        }
+        ls[n++] = exp;
+    }
+    *lsPtr = ls;
+    *nPtr = n;
+    return PARSE_OK;
+}
+
+static int
+parseCat(Compiler *c, Ast **expPtr)
+{
+    Ast **ls;
+    int n;
+
+    if (parseRep(c, parseQuantified, &ls, &n) != PARSE_OK) return PARSE_ERROR;
+    *expPtr = foldAst(c, AST_CAT, ls, n);
+    if (ls) ckfree(ls);
+    return PARSE_OK;
+}
+
+/* Separator and alternative, for parseRep over alternatives */
+static int
+parseBarCat(Compiler *c, Ast **expPtr)
+{
+    if (PEEK(c) != '|') return PARSE_FAIL;
+    c->pos++;
+    return parseCat(c, expPtr);
+}
+
+static int
+parseExp(Compiler *c, Ast **expPtr)
+{
+    Ast *first, **ls;
+    int i, n;
+
+    if (parseCat(c, &first) != PARSE_OK) return PARSE_ERROR;
+    if (parseRep(c, parseBarCat, &ls, &n) != PARSE_OK) return PARSE_ERROR;
+    for (i = 0; i < n; i++) first = newAst(c, AST_ALT, first, ls[i]);
+    if (ls) ckfree(ls);
+    *expPtr = first;
+    return PARSE_OK;
+}
+
+/* Flatten the top-level sequence of a regex (regex::sequence) */
+static void
+sequence(Ast *ex, Ast ***lsPtr, int *nPtr, int *capacityPtr)
+{
+    if (ex->type == AST_CAT) {
+        sequence(ex->a, lsPtr, nPtr, capacityPtr);
+        sequence(ex->b, lsPtr, nPtr, capacityPtr);
+    } else if (ex->type == AST_SUB) {
+        sequence(ex->a, lsPtr, nPtr, capacityPtr);
+    } else {
+        if (*nPtr == *capacityPtr) {
+            *capacityPtr = *capacityPtr ? 2 * *capacityPtr : 16;
+            *lsPtr = ckrealloc(*lsPtr, sizeof(Ast *) * *capacityPtr);
+        }
+        (*lsPtr)[(*nPtr)++] = ex;
+    }
+}
+
+/*
+ * regex::literals: the literal every match starts with, and the
+ * longest literal after it, as start and length in the sequence.
+ */
+static void
+literals(Ast *ex, Ast ***lsPtr, int *nPtr, int *prefixLengthPtr,
+         int *requiredStartPtr, int *requiredLengthPtr)
+{
+    Ast **ls = NULL;
+    int n = 0, capacity = 0, i, run, runStart, first = 1;
+
+    sequence(ex, &ls, &n, &capacity);
+    *prefixLengthPtr = *requiredStartPtr = *requiredLengthPtr = 0;
+    run = runStart = 0;
+    for (i = 0; i <= n; i++) {
+        if (i < n && ls[i]->type == AST_CHR && ls[i]->value != 0) {
+            if (run++ == 0) runStart = i;
+            continue;
+        }
+        if (first) {
+            *prefixLengthPtr = run;
+            first = 0;
+        } else if (run > *requiredLengthPtr) {
+            *requiredStartPtr = runStart;
+            *requiredLengthPtr = run;
+        }
+        run = 0;
+    }
+    if (*prefixLengthPtr > 256) *prefixLengthPtr = 256;
+    if (*requiredLengthPtr > 256) *requiredLengthPtr = 256;
+    *lsPtr = ls;
+    *nPtr = n;
+}
+
+static int
+genLabel(Compiler *c)
+{
+    int label = ++c->nextLabel;
+
+    if (label >= c->blocksCapacity) {
+        c->blocksCapacity = 2*label;
+        c->blocks = ckrealloc(c->blocks, sizeof(Kont *) * c->blocksCapacity);
+    }
+    c->blocks[label] = NULL;
+    return label;
+}
+
+static int
+labelOf(Compiler *c, Kont *k)
+{
+    int label;
+
+    if (k->type == K_GOTO) return k->value;
+    if (k->type == K_MATCH) return LABEL_MATCH;
+    label = genLabel(c);
+    c->blocks[label] = k;
+    return label;
+}
+
+static Kont *
+split(Compiler *c, Kont *l, Kont *r, int greedy)
+{
+    Kont *t, *k;
+
+    if (greedy == 0) {
+        t = l;
+        l = r;
+        r = t;
+    }
+    k = newKont(c, K_SPLIT, 0, NULL);
+    k->value = labelOf(c, l);
+    k->value2 = labelOf(c, r);
+    return k;
+}
+
+/* regex::stringable */
+static int
+stringable(int ch)
+{
+    return ch != 0 && (ch < 0xd800 || ch > 0xdfff);
+}
+
+static int
+utf8Length(int ch)
+{
+    return ch < 0x80 ? 1 : ch < 0x800 ? 2 : ch < 0x10000 ? 3 : 4;
+}
+
+/* CPS-transform regex (regex::comp). Returns NULL on error. */
+static Kont *
+comp(Compiler *c, Ast *ex, Kont *k)
+{
+    Kont *l, *r, *test;
+    int label, n, bytes;
+
+    switch (ex->type) {
+    case AST_EMPTY:
+        return k;
+    case AST_CHR:
+        /*
+         * Merge a run of chars into one STRING of at most 255 bytes.
+         * Not in a counted loop, where the per thread count is taken.
+         */
+        if (!c->inLoop && stringable(ex->value)
+                && (k->type == K_STRING
+                    || (k->type == K_CHR && stringable(k->value)))) {
+            n = k->type == K_STRING ? k->value : 1;
+            bytes = utf8Length(ex->value)
+                + (k->type == K_STRING ? k->value2 : utf8Length(k->value));
+            if (bytes <= 255) {
+                l = newKont(c, K_STRING, n + 1, k->next);
+                l->value2 = bytes;
+                l->chars = compAlloc(c, sizeof(int) * (n + 1));
+                l->chars[0] = ex->value;
+                if (k->type == K_STRING) {
+                    memcpy(l->chars + 1, k->chars, sizeof(int) * n);
+                } else {
+                    l->chars[1] = k->value;
+                }
+                return l;
+            }
+        }
+        return newKont(c, K_CHR, ex->value, k);
+    case AST_ANY:
+        return newKont(c, K_ANY, 0, k);
+    case AST_START:
+        return newKont(c, K_START, 0, k);
+    case AST_END:
+        return newKont(c, K_END, 0, k);
+    case AST_BRACKET:
+        k = newKont(c, K_BRACKET, 0, k);
+        k->ast = ex;
+        return k;
+    case AST_SUB:
+        k = comp(c, ex->a, newKont(c, K_SAVE, ex->value*2+1, k));
+        return k ? newKont(c, K_SAVE, ex->value*2, k) : NULL;
+    case AST_CAT:
+        k = comp(c, ex->b, k);
+        return k ? comp(c, ex->a, k) : NULL;
+    case AST_ALT:
+        k = newKont(c, K_GOTO, labelOf(c, k), NULL);
+        if (!(l = comp(c, ex->a, k)) || !(r = comp(c, ex->b, k))) return NULL;
+        return split(c, l, r, ex->greedy);
+    case AST_REP:
+        /*
+         * Micro-optimization: Russ Cox's version loops back to the
+         * split, we just duplicate the split.
+         */
+        label = genLabel(c);
+        test = split(c, newKont(c, K_GOTO, label, NULL), k, ex->greedy);
+        if (!(k = comp(c, ex->a, test))) return NULL;
+        c->blocks[label] = k;   /* comp may have moved blocks */
+        return test;
+    case AST_REP1:
+        label = genLabel(c);
+        test = split(c, newKont(c, K_GOTO, label, NULL), k, ex->greedy);
+        if (!(k = comp(c, ex->a, test))) return NULL;
+        return newKont(c, K_LABEL, label, k);
+    case AST_REPEAT:
+        /* L: repeat lo hi greedy exit; body; again L */
+        label = genLabel(c);
+        test = newKont(c, K_REPEAT, labelOf(c, k), NULL);
+        test->ast = ex;
+        c->inLoop++;
+        test->next = comp(c, ex->a, newKont(c, K_AGAIN, label, NULL));
+        c->inLoop--;
+        if (!test->next) return NULL;
+        return newKont(c, K_LABEL, label, test);
+    }
+    c->errMsg = Tcl_NewStringObj("unhandled \\", -1);
+    return NULL;
+}
+
+static void
+emit(Compiler *c, const unsigned char *bytes, int n)
+{
+    if (c->bufLength + n > c->bufCapacity) {
+        c->bufCapacity = 2*(c->bufLength + n);
+        c->buf = ckrealloc(c->buf, c->bufCapacity);
+    }
+    memcpy(c->buf + c->bufLength, bytes, n);
+    c->bufLength += n;
+}
+
+static void
+emitOp(Compiler *c, int inst, int flags)
+{
+    unsigned char op = inst<<2 | flags;
+
+    emit(c, &op, 1);
+}
+
+static void
+emitShort(Compiler *c, int value)
+{
+    unsigned char b[2];
+
+    b[0] = (value >> 8) & 0xff;
+    b[1] = value & 0xff;
+    emit(c, b, 2);
+}
+
+/* As encoding convertto utf-8, so \0 is a single zero byte. */
+static void
+emitUtf8(Compiler *c, int ch)
+{
+    unsigned char b[4];
+    int n;
+
+    if (ch < 0x80) {
+        b[0] = ch;
+        n = 1;
+    } else if (ch < 0x800) {
+        b[0] = 0xc0 | ch >> 6;
+        b[1] = 0x80 | (ch & 0x3f);
+        n = 2;
+    } else if (ch < 0x10000) {
+        b[0] = 0xe0 | ch >> 12;
+        b[1] = 0x80 | ((ch >> 6) & 0x3f);
+        b[2] = 0x80 | (ch & 0x3f);
+        n = 3;
+    } else {
+        b[0] = 0xf0 | ((ch >> 18) & 0x07);
+        b[1] = 0x80 | ((ch >> 12) & 0x3f);
+        b[2] = 0x80 | ((ch >> 6) & 0x3f);
+        b[3] = 0x80 | (ch & 0x3f);
+        n = 4;
+    }
+    emit(c, b, n);
+}
+
+static void
+emitAddr(Compiler *c, int label)
+{
+    if (c->numFixups == c->fixupsCapacity) {
+        c->fixupsCapacity = c->fixupsCapacity ? 2*c->fixupsCapacity : 32;
+        c->fixups = ckrealloc(c->fixups, sizeof(int) * 2 * c->fixupsCapacity);
+    }
+    c->fixups[2*c->numFixups] = c->bufLength;
+    c->fixups[2*c->numFixups+1] = label;
+    c->numFixups++;
+    emitShort(c, 0);
+}
+
+/* Emit the chars of a literal, preceded by their length in bytes. */
+static void
+emitLiteral(Compiler *c, Ast **ls, int start, int length)
+{
+    int i, lengthPos = c->bufLength;
+
+    emitShort(c, 0);
+    for (i = start; i < start + length; i++) emitUtf8(c, ls[i]->value);
+    c->buf[lengthPos] = ((c->bufLength - lengthPos - 2) >> 8) & 0xff;
+    c->buf[lengthPos+1] = (c->bufLength - lengthPos - 2) & 0xff;
+}
+
+static int
+compareRanges(const void *a, const void *b)
+{
+    const int *x = a, *y = b;
+
+    return x[0] != y[0] ? (x[0] < y[0] ? -1 : 1)
+        : x[1] != y[1] ? (x[1] < y[1] ? -1 : 1) : 0;
+}
+
+/* regex::asm_bracket */
+static int
+asmBracket(Compiler *c, Ast *bracket)
+{
+    int *ranges, *merged, numRanges = 0, numMerged, limit, numWide, i, ch;
+    int *chars = bracket->chars, n = bracket->numChars;
+    unsigned char bitmap[32];
+
+    /* Combine chars and ranges into only ranges. */
+    ranges = ckalloc(sizeof(int) * 2 * n);
+    for (i = 0; i < n; numRanges++) {
+        ranges[2*numRanges] = ranges[2*numRanges+1] = chars[i];
+        if (i + 2 < n && chars[i+1] == '-') {
+            ranges[2*numRanges+1] = chars[i+2];
+            i += 3;
+        } else {
+            i++;
+        }
+        if (ranges[2*numRanges+1] < ranges[2*numRanges]) {
+            ckfree(ranges);
+            c->errMsg = Tcl_NewStringObj("assertion $hi >= $lo failed", -1);
+            return TCL_ERROR;
+        }
+    }
+
+    /* Sort and merge ranges. */
+    qsort(ranges, numRanges, 2*sizeof(int), compareRanges);
+    merged = ckalloc(sizeof(int) * 2 * numRanges);
+    merged[0] = ranges[0];
+    limit = ranges[1];
+    numMerged = 1;
+    for (i = 1; i < numRanges; i++) {
+        if (ranges[2*i] > limit) {
+            merged[numMerged++] = limit;
+            merged[numMerged++] = ranges[2*i];
+        }
+        if (ranges[2*i+1] > limit) limit = ranges[2*i+1];
+    }
+    merged[numMerged++] = limit;
+    ckfree(ranges);
+
+    /*
+     * Chars below 256 go in a bitmap, and only what lies above is
+     * left as ranges, clipped to start at 256.
+     */
+    memset(bitmap, 0, sizeof(bitmap));
+    numWide = 0;
+    for (i = 0; i < numMerged; i += 2) {
+        for (ch = merged[i]; ch <= merged[i+1] && ch < 256; ch++) {
+            bitmap[ch >> 3] |= 1 << (ch & 7);
+        }
+        if (merged[i+1] >= 256) {
+            merged[numWide++] = merged[i] < 256 ? 256 : merged[i];
+            merged[numWide++] = merged[i+1];
+        }
+    }
+
+    emitOp(c, INST_BRACKET, (numWide ? 0 : 2) | bracket->value);
+    emit(c, bitmap, sizeof(bitmap));
+    if (numWide) {
+        /* Align code point array to 32-bit boundary. */
+        static const unsigned char zeros[4] = {0, 0, 0, 0};
+        emitShort(c, numWide/2);
+        if (c->bufLength & 3) emit(c, zeros, 4 - (c->bufLength & 3));
+        for (i = 0; i < numWide; i++) {
+            emit(c, (unsigned char *)&merged[i], 4);
+        }
+    }
+    ckfree(merged);
+    return TCL_OK;
+}
+
+/* regex::asm, less the printing */
+static int
+assemble(Compiler *c, Kont *k)
+{
+    for (; k; k = k->next) {
+        switch (k->type) {
+        case K_MATCH: emitOp(c, INST_MATCH, 0); break;
+        case K_ANY: emitOp(c, INST_ANY, 0); break;
+        case K_START: emitOp(c, INST_START, 0); break;
+        case K_END: emitOp(c, INST_END, 0); break;
+        case K_CHR:
+            emitOp(c, INST_CHR, 0);
+            emitUtf8(c, k->value);
+            break;
+        case K_STRING: {
+            unsigned char length = k->value2;
+            int i;
+
+            emitOp(c, INST_STRING, 0);
+            emit(c, &length, 1);
+            for (i = 0; i < k->value; i++) emitUtf8(c, k->chars[i]);
+            break;
+        }
+        case K_SAVE:
+            emitOp(c, INST_SAVE, 0);
+            emitShort(c, k->value);
+            break;
+        case K_GOTO:
+            emitOp(c, INST_GOTO, 0);
+            emitAddr(c, k->value);
+            break;
+        case K_SPLIT:
+            emitOp(c, INST_SPLIT, 0);
+            emitAddr(c, k->value);
+            emitAddr(c, k->value2);
+            break;
+        case K_LABEL:
+            if (k->value != LABEL_START) c->labelPos[k->value] = c->bufLength;
+            break;
+        case K_BRACKET:
+            if (asmBracket(c, k->ast) != TCL_OK) return TCL_ERROR;
+            break;
+        case K_REPEAT:
+            emitOp(c, INST_REPEAT, !k->ast->greedy);
+            emitShort(c, k->ast->value);
+            emitShort(c, k->ast->hi < 0 ? 0xffff : k->ast->hi);
+            emitAddr(c, k->value);
+            break;
+        case K_AGAIN:
+            emitOp(c, INST_AGAIN, 0);
+            emitAddr(c, k->value);
+            break;
+        }
+    }
+    return TCL_OK;
+}
+
+/* Labels in the order regex::compile's tree of blocks keeps them. */
+static int
+compareLabels(const void *a, const void *b)
+{
+    char x[TCL_INTEGER_SPACE+2], y[TCL_INTEGER_SPACE+2];
+    int l = *(const int *)a, r = *(const int *)b;
+
+    if (l == LABEL_MATCH) strcpy(x, "Lm"); else sprintf(x, "L%d", l);
+    if (r == LABEL_MATCH) strcpy(y, "Lm"); else sprintf(y, "L%d", r);
+    return strcmp(x, y);
+}
+
+/*
+ * Schedule the blocks into traces, trying to put each goto target
+ * right after the goto so the goto can go, and assemble them.
+ * (regex::compile never gets a block that is just a goto to forward,
+ * so there is no forwarding step.)
+ */
+static int
+schedule(Compiler *c, Kont *exp)
+{
+    Kont **loc;
+    int *order, numLabels = c->nextLabel + 1, next = 0, label, i;
+
+    order = ckalloc(sizeof(int) * numLabels);
+    for (i = 0; i < numLabels; i++) order[i] = i;
+    qsort(order, numLabels, sizeof(int), compareLabels);
+
+    label = LABEL_START;
+    for (;;) {
+        /*
+         * Extend the trace while the last instruction is a goto to a
+         * block yet to be placed.
+         */
+        loc = &exp;
+        for (;;) {
+            while ((*loc)->next) loc = &(*loc)->next;
+            if ((*loc)->type != K_GOTO || !c->blocks[(*loc)->value]) break;
+            i = (*loc)->value;
+            *loc = newKont(c, K_LABEL, i, c->blocks[i]);
+            c->blocks[i] = NULL;
+        }
+
+        if (label != LABEL_START) c->labelPos[label] = c->bufLength;
+        if (assemble(c, exp) != TCL_OK) {
+            ckfree(order);
+            return TCL_ERROR;
+        }
+
+        while (next < numLabels && !c->blocks[order[next]]) next++;
+        if (next == numLabels) break;
+        label = order[next];
+        exp = c->blocks[label];
+        c->blocks[label] = NULL;
+    }
+    ckfree(order);
+    return TCL_OK;
+}
+
+/*
+ * Compile the regex in obj to bytecode. Returns a ckalloc'ed program
+ * and its length, or NULL with an error message in interp.
+ */
+static unsigned char *
+compileRegex(Tcl_Interp *interp, Tcl_Obj *obj, int *lengthPtr)
+{
+    Compiler compiler, *c = &compiler;
+    Ast *ast, *first, **ls = NULL;
+    Kont *start;
+    const char *str, *end;
+    Tcl_UniChar ch;
+    unsigned char *code = NULL;
+    int n, i, r, length, anchored, prefixLength, requiredStart, requiredLength;
+    void **p;
+
+    memset(c, 0, sizeof(Compiler));
+    str = Tcl_GetStringFromObj(obj, &length);
+    end = str + length;
+    c->in = ckalloc(sizeof(int) * (length + 1));
+    while (str < end) {
+        str += Tcl_UtfToUniChar(str, &ch);
+        c->in[c->length++] = ch;
+    }
+
+    /* Parse regex */
+    r = parseExp(c, &ast);
+    if (r == PARSE_OK && c->pos < c->length) {
+        r = parseError(c, Tcl_NewStringObj("expected eof", -1));
+        r = PARSE_FAIL;
+    }
+    if (r != PARSE_OK) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("parse %s at \"%s\": %d: %s",
+            r == PARSE_ERROR ? "error" : "failed", Tcl_GetString(obj),
+            c->errPos, Tcl_GetString(c->errMsg)));
+        Tcl_DecrRefCount(c->errMsg);
+        c->errMsg = NULL;
+        goto done;
+    }
+
+    /* Check if anchored by ^ or \A */
+    for (first = ast; first->type == AST_CAT; first = first->a) {}
+    anchored = first->type == AST_START;
+
+    /* Add implicit capture of entire match. */
+    ast = newAst(c, AST_SUB, ast, NULL);
+    ast->value = 0;
+    literals(ast, &ls, &n, &prefixLength, &requiredStart, &requiredLength);
+
+    /* Compile/linearize regex. */
+    c->blocksCapacity = 16;
+    c->blocks = ckalloc(sizeof(Kont *) * c->blocksCapacity);
+    c->blocks[LABEL_MATCH] = newKont(c, K_MATCH, 0, NULL);
+    start = comp(c, ast, newKont(c, K_GOTO, LABEL_MATCH, NULL));
+    if (start) {
+        c->labelPos = ckalloc(sizeof(int) * (c->nextLabel + 1));
+        memset(c->labelPos, 0, sizeof(int) * (c->nextLabel + 1));
+        emitOp(c, INST_HINT, !anchored);
+        emitLiteral(c, ls, 0, prefixLength);
+        emitLiteral(c, ls, requiredStart, requiredLength);
+    }
+    if (!start || schedule(c, start) != TCL_OK) {
+        Tcl_SetObjResult(interp, c->errMsg);
+        goto done;
+    }
+    if (c->bufLength > 0x10000) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("regex too large", -1));
+        goto done;
+    }
+    for (i = 0; i < c->numFixups; i++) {
+        int at = c->fixups[2*i], pos = c->labelPos[c->fixups[2*i+1]];
+        c->buf[at] = (pos >> 8) & 0xff;
+        c->buf[at+1] = pos & 0xff;
+    }
+    code = c->buf;
+    c->buf = NULL;
+    *lengthPtr = c->bufLength;
+
+done:
+    while ((p = c->allocs)) {
+        c->allocs = *p;
+        ckfree(p);
+    }
+    if (ls) ckfree(ls);
+    ckfree(c->in);
+    if (c->blocks) ckfree(c->blocks);
+    if (c->labelPos) ckfree(c->labelPos);
+    if (c->fixups) ckfree(c->fixups);
+    if (c->buf) ckfree(c->buf);
+    return code;
+}
+
+/* Execution functions */
+static void
+freeContextPool(ClientData clientData)
+{
+    ThreadSpecificData *tsdPtr = getThreadData();
+    Context *ctx;
+    SubChunk *chunk;
+
+    while ((ctx = tsdPtr->freeContexts)) {
+        tsdPtr->freeContexts = ctx->nextFree;
+        while ((chunk = ctx->subChunks)) {
+            ctx->subChunks = chunk->next;
+            ckfree(chunk);
+        }
+        ckfree(ctx);
+    }
+}
+
+/*
+ * Take a context from this thread's pool, or make one, big enough for
+ * regex. Contexts in use are off the pool, so a search may run while
+ * another is in progress.
+ */
+static Context *
+newContext(Regex *regex, int beginning)
+{
+    ThreadSpecificData *tsdPtr = getThreadData();
+    Context *ctx;
+    SubChunk *subChunks = NULL;
+    char *p;
+    int codeCapacity, instCapacity;
+    size_t checkedSize;
+
+    ctx = tsdPtr->freeContexts;
+    if (ctx) {
+        tsdPtr->freeContexts = ctx->nextFree;
+        if (ctx->codeCapacity < regex->numKeys
+            || ctx->instCapacity < regex->maxThreads) {
+            codeCapacity = ctx->codeCapacity;
+            instCapacity = ctx->instCapacity;
+            if (codeCapacity < regex->numKeys) codeCapacity = regex->numKeys;
+            if (instCapacity < regex->maxThreads) instCapacity = regex->maxThreads;
+            subChunks = ctx->subChunks;
+            ckfree(ctx);
+            ctx = NULL;
+        }
+    } else {
+        codeCapacity = regex->numKeys;
+        instCapacity = regex->maxThreads;
+    }
+
+    if (!ctx) {
+        /* Threads hold pointers, so they start pointer aligned. */
+        checkedSize = (codeCapacity*sizeof(int) + sizeof(void *)-1)
+            & ~(sizeof(void *)-1);
+        ctx = ckalloc(sizeof(Context)
+                      + checkedSize /* lastChecked */
+                      + 2*instCapacity*sizeof(Thread)); /* threadLists */
+        p = (char *)ctx;
+        p += sizeof(Context);
+        ctx->lastChecked = (unsigned int *)p;
+        p += checkedSize;
+        ctx->threadLists[0].list = (Thread *)p;
+        p += instCapacity*sizeof(Thread);
+        ctx->threadLists[1].list = (Thread *)p;
+        ctx->codeCapacity = codeCapacity;
+        ctx->instCapacity = instCapacity;
+        ctx->turnCount = 0;
+        memset(ctx->lastChecked, 0, codeCapacity*sizeof(int));
+        ctx->subChunks = subChunks;
+    }
+
+    ctx->prog = regex->prog;
+    ctx->keyBase = regex->keyBase;
+    ctx->numSlots = regex->numSlots;
+    ctx->bare = 0;
+    ctx->beginning = beginning;
+    ctx->more = ctx->suspended = 0;
+    ctx->limit = NULL;
+    ctx->worker = 0;
+    ctx->extantSubs = 0;
+    ctx->peakSubs = 0;
+    ctx->subSize = sizeof(Sub) + (regex->numSlots-1)*sizeof(Slot);
+    ctx->freeSubs = NULL;
+    ctx->subChunk = NULL;
+    ctx->subNext = ctx->subEnd = NULL;
+    ctx->owner = NULL;
+    ctx->matches = NULL;
+#ifdef REGEX_STATS
+    ctx->stats = regex->stats;
+#endif
+    return ctx;
+}
+
+/*
+ * Ready ctx for a search. A context may serve several searches in a
+ * row (regex::match -all, regex::sub, regex::foreach); what stays is
+ * its lastChecked, which the new turn makes stale, and the subs it has
+ * freed.
+ */
+static void
+restartContext(Context *ctx)
+{
+    /*
+     * A search takes at most one turn per character, which fits in
+     * half the range, so only clear lastChecked before it could wrap.
+     */
+    if (ctx->turnCount >= 0x80000000u) {
+        memset(ctx->lastChecked, 0, ctx->codeCapacity*sizeof(int));
+        ctx->turnCount = 0;
+    }
+    ctx->turnCount++;
+    ctx->threadLists[0].numThreads = 0;
+    ctx->threadLists[1].numThreads = 0;
+    ctx->savedMatch = NULL;
+    ctx->pruned = 0;
+}
+
+/*
+ * Have the searches with ctx keep only the first numSlots slots: 2
+ * when only where the match is matters, 0 when only whether there is
+ * one, for which execute runs followBare and keeps no subs at all.
+ * Must come before the first search with ctx.
+ */
+static void
+narrowContext(Context *ctx, int numSlots)
+{
+    if (numSlots < ctx->numSlots) {
+        ctx->numSlots = numSlots;
+        ctx->subSize = sizeof(Sub) + (numSlots ? numSlots-1 : 0)*sizeof(Slot);
+        ctx->bare = numSlots == 0;
+    }
+}
+
+static void
+releaseContext(Context *ctx)
+{
+    ThreadSpecificData *tsdPtr = getThreadData();
+
+    ctx->nextFree = tsdPtr->freeContexts;
+    tsdPtr->freeContexts = ctx;
+}
+
+/*
+ * Move on to the next chunk big enough for a sub, allocating one
+ * (twice the size of the last) when there is none.
+ */
+static void
+newSubChunk(Context *ctx)
+{
+    SubChunk *chunk, **link;
+    size_t size;
+
+    link = ctx->subChunk ? &ctx->subChunk->next : &ctx->subChunks;
+    for (chunk = *link; chunk; link = &chunk->next, chunk = *link) {
+        if (chunk->size >= ctx->subSize) break;
+    }
+    if (!chunk) {
+        size = ctx->subChunk ? 2*ctx->subChunk->size : SUB_CHUNK_MIN;
+        if (size < 16*ctx->subSize) size = 16*ctx->subSize;
+        chunk = ckalloc(sizeof(SubChunk) + size);
+        chunk->next = NULL;
+        chunk->size = size;
+        *link = chunk;
+    }
+    ctx->subChunk = chunk;
+    ctx->subNext = (char *)(chunk + 1);
+    ctx->subEnd = ctx->subNext + chunk->size;
+}
+
+static Sub *
+newSub(Context *ctx)
+{
+    int i;
+    Sub *sub;
+
+    if ((sub = ctx->freeSubs)) {
+        ctx->freeSubs = sub->nextFree;
+    } else {
+        if ((size_t)(ctx->subEnd - ctx->subNext) < ctx->subSize) {
+            newSubChunk(ctx);
+        }
+        sub = (Sub *)ctx->subNext;
+        ctx->subNext += ctx->subSize;
+    }
+    sub->refCount = 1;
+    STAT_ADD(ctx->stats, subs, 1);
+    for (i = 0; i < ctx->numSlots; i++) {
+        sub->slots[i].charPtr = NULL;
+        sub->slots[i].charIndex = 0;
+    }
+    if (++ctx->extantSubs > ctx->peakSubs) {
+        ctx->peakSubs = ctx->extantSubs;
+    }
+    return sub;
+}
+
+static void
+retainSub(Sub *sub)
+{
+    sub->refCount++;
+}
+
+static void
+releaseSub(Context *ctx, Sub *sub)
+{
+    if (sub->refCount-- <= 1) {
+        sub->refCount = 0xdeadbeef;
+        sub->nextFree = ctx->freeSubs;
+        ctx->freeSubs = sub;
+        ctx->extantSubs--;
+    }
+}
+
+static Sub *
+updateSub(Context *ctx, Sub *sub, int slot, const char *charPtr, int charIndex)
+{
+    Sub *result;
+
+    if (sub->refCount > 1) {
+        result = newSub(ctx);
+        memcpy(result->slots, sub->slots, ctx->numSlots*sizeof(Slot));
+        sub->refCount--;
+    } else {
+        result = sub;
+    }
+    result->slots[slot].charPtr = charPtr;
+    result->slots[slot].charIndex = charIndex;
+    return result;
+}
+
+/*
+ * Decode the char at str and advance past it. Tcl's UTF-8 never uses
+ * a byte below 0x80 inside a multi-byte sequence, so ASCII needs no
+ * call to Tcl_UtfToUniChar.
+ */
+#define NEXT_CHAR(str, ch)                                      \
+    do {                                                        \
+        if (*(unsigned char *)(str) < 0x80) {                   \
+            (ch) = *(unsigned char *)(str)++;                   \
+        } else {                                                \
+            (str) += Tcl_UtfToUniChar((str), &(ch));            \
+        }                                                       \
+    } while (0)
+
+#define curList (&ctx->threadLists[ctx->turnCount & 1])
+#define nextList (&ctx->threadLists[1 ^ (ctx->turnCount & 1)])
+
+/*
+ * Whether the input at charPtr begins with the chars of the STRING at
+ * cp, or, with more input to come, could.
+ */
+static int
+stringAhead(Context *ctx, unsigned char *cp, const char *charPtr)
+{
+    if (ctx->end - charPtr < cp[1]) {
+        return ctx->more;
+    }
+    return memcmp(charPtr, cp+2, cp[1]) == 0;
+}
+
+/*
+ * follow is made twice from FOLLOW_TEMPLATE. With CAPTURES, each
+ * thread carries a Sub of its captures, and a call "matches" one ref
+ * count of the sub it's given, which the caller has to have taken, by
+ * storing or releasing it. followBare is for when only whether there
+ * is a match matters: threads carry no sub, and it returns 1 at the
+ * first MATCH reached, whatever its priority.
+ */
+#define FOLLOW_TEMPLATE(NAME, CAPTURES)                                      \
+static int                                                                   \
+NAME(Context *ctx, int pc, int count, Sub *sub, const char *charPtr,         \
+     int charIndex, int atEnd)                                               \
+{                                                                            \
+    int op, key, lo, hi, slot;                                               \
+    unsigned char *cp;                                                       \
+    Thread *thread;                                                          \
+                                                                             \
+    STAT_ADD(ctx->stats, follows, 1);                                        \
+                                                                             \
+    /* Check if we've already scheduled this thread during this turn. */     \
+    key = (ctx->keyBase ? ctx->keyBase[pc] : pc) + count;                    \
+    if (ctx->lastChecked[key] == ctx->turnCount) {                           \
+        if (CAPTURES) releaseSub(ctx, sub);                                  \
+        return 0;                                                            \
+    }                                                                        \
+                                                                             \
+    ctx->lastChecked[key] = ctx->turnCount;                                  \
+    cp = ctx->prog + pc;                                                     \
+    op = *cp;                                                                \
+    switch (op >> 2) {                                                       \
+    case INST_GOTO:                                                          \
+        return NAME(ctx, cp[1] << 8 | cp[2], count, sub, charPtr, charIndex, \
+                    atEnd);                                                  \
+    case INST_SPLIT:                                                         \
+        /* prevent first call from altering sub */                           \
+        if (CAPTURES) retainSub(sub);                                        \
+        if (NAME(ctx, cp[1] << 8 | cp[2], count, sub, charPtr, charIndex,    \
+                 atEnd)) {                                                   \
+            if (CAPTURES) releaseSub(ctx, sub);                              \
+            return 1;                                                        \
+        }                                                                    \
+        return NAME(ctx, cp[3] << 8 | cp[4], count, sub, charPtr, charIndex, \
+                    atEnd);                                                  \
+    case INST_REPEAT:                                                        \
+        lo = cp[1] << 8 | cp[2];                                             \
+        hi = cp[3] << 8 | cp[4];                                             \
+        if (count < lo)                                                      \
+            return NAME(ctx, pc+7, count, sub, charPtr, charIndex, atEnd);   \
+        if (count == hi)                                                     \
+            return NAME(ctx, cp[5] << 8 | cp[6], 0, sub, charPtr, charIndex, \
+                        atEnd);                                              \
+        if (CAPTURES) retainSub(sub);                                        \
+        if (op & 1) {                                                        \
+            if (NAME(ctx, cp[5] << 8 | cp[6], 0, sub, charPtr, charIndex,    \
+                     atEnd)) {                                               \
+                if (CAPTURES) releaseSub(ctx, sub);                          \
+                return 1;                                                    \
+            }                                                                \
+            return NAME(ctx, pc+7, count, sub, charPtr, charIndex, atEnd);   \
+        }                                                                    \
+        if (NAME(ctx, pc+7, count, sub, charPtr, charIndex, atEnd)) {        \
+            if (CAPTURES) releaseSub(ctx, sub);                              \
+            return 1;                                                        \
+        }                                                                    \
+        return NAME(ctx, cp[5] << 8 | cp[6], 0, sub, charPtr, charIndex,     \
+                    atEnd);                                                  \
+    case INST_AGAIN:                                                         \
+        pc = cp[1] << 8 | cp[2];                                             \
+        cp = ctx->prog + pc;                                                 \
+        hi = cp[3] << 8 | cp[4];                                             \
+        if (hi == 0xffff) hi = cp[1] << 8 | cp[2];                           \
+        if (count < hi) count++;                                             \
+        return NAME(ctx, pc, count, sub, charPtr, charIndex, atEnd);         \
+    case INST_SAVE:                                                          \
+        slot = cp[1] << 8 | cp[2];                                           \
+        if (CAPTURES && slot < ctx->numSlots)                                \
+            sub = updateSub(ctx, sub, slot, charPtr, charIndex);             \
+        return NAME(ctx, pc+3, count, sub, charPtr, charIndex, atEnd);       \
+    case INST_MATCH:                                                         \
+        if (!CAPTURES) {                                                     \
+            return 1;                                                        \
+        }                                                                    \
+        if (ctx->owner) {                                                    \
+            Sub **m = &ctx->matches[ctx->owner[pc]];                         \
+            if (*m) releaseSub(ctx, *m);                                     \
+            *m = sub;                                                        \
+            return 1;                                                        \
+        }                                                                    \
+        if (ctx->savedMatch) releaseSub(ctx, ctx->savedMatch);               \
+        ctx->savedMatch = sub;                                               \
+        return 1;                                                            \
+    case INST_END:                                                           \
+        if (atEnd)                                                           \
+            return NAME(ctx, pc+1, count, sub, charPtr, charIndex, atEnd);   \
+        if (ctx->more && charPtr == ctx->end) {                              \
+            /* Can't tell yet; keep it only to hold back the result */       \
+            goto wait;                                                       \
+        }                                                                    \
+        if (CAPTURES) releaseSub(ctx, sub);                                  \
+        break;                                                               \
+    case INST_START:                                                         \
+        if (charIndex == ctx->beginning)                                     \
+            return NAME(ctx, pc+1, count, sub, charPtr, charIndex, atEnd);   \
+        if (CAPTURES) releaseSub(ctx, sub);                                  \
+        break;                                                               \
+    case INST_STRING:                                                        \
+        /*                                                                   \
+         * On getting to a string, compare all of it at once, so a           \
+         * thread that will fail on it dies now instead of after a           \
+         * few turns. From then on, count is how far it got.                 \
+         */                                                                  \
+        if (atEnd || (count == 0 && !stringAhead(ctx, cp, charPtr))) {       \
+            ctx->pruned = 1;                                                 \
+            if (CAPTURES) releaseSub(ctx, sub);                              \
+            break;                                                           \
+        }                                                                    \
+        goto wait;                                                           \
+    default:                                                                 \
+        if (atEnd) {                                                         \
+            if (CAPTURES) releaseSub(ctx, sub);                              \
+        } else {                                                             \
+        wait:                                                                \
+            thread = &nextList->list[nextList->numThreads++];                \
+            STAT_ADD(ctx->stats, threads, 1);                                \
+            thread->pc = pc;                                                 \
+            thread->count = count;                                           \
+            thread->sub = sub;                                               \
+        }                                                                    \
+    }                                                                        \
+    return 0;                                                                \
+}
+
+FOLLOW_TEMPLATE(follow, 1)
+FOLLOW_TEMPLATE(followBare, 0)
+#undef FOLLOW_TEMPLATE
+
+/*
+ * Test consuming instruction at *pcPtr against ch. Advances *pcPtr
+ * to the following instruction. In a STRING, *countPtr is the offset
+ * of the char to test, which is advanced instead until the last.
+ */
+static int
+matchInst(unsigned char *code, int *pcPtr, int *countPtr, Tcl_UniChar ch)
+{
+    int pc, op, invert, length, offset;
+    Tcl_UniChar matchChar;
+
+    pc = *pcPtr;
+    op = code[pc];
+    switch (op >> 2) {
+    case INST_CHR:
+        if (code[pc+1] < 0x80) {
+            *pcPtr = pc + 2;
+            return code[pc+1] == ch;
+        }
+        *pcPtr = pc + 1 + Tcl_UtfToUniChar(((char *)(code+pc+1)), &matchChar);
+        return matchChar == ch;
+    case INST_STRING:
+        offset = *countPtr;
+        if (code[pc+2+offset] < 0x80) {
+            matchChar = code[pc+2+offset];
+            offset++;
+        } else {
+            offset += Tcl_UtfToUniChar((char *)code+pc+2+offset, &matchChar);
+        }
+        if (offset == code[pc+1]) {
+            *pcPtr = pc + 2 + offset;
+            *countPtr = 0;
+        } else {
+            *countPtr = offset;
+        }
+        return matchChar == ch;
+    case INST_ANY:
+        *pcPtr = pc + 1;
+        return 1;
+    case INST_BRACKET:
+        invert = op & 1;
+        if (op & 2) {
+            *pcPtr = pc + 33;
+            if (ch >= 256) return invert;
+        } else {
+            *pcPtr = nextInst(code, pc);
+        }
+        if (ch < 256) return (code[pc+1 + (ch >> 3)] >> (ch & 7) & 1) ^ invert;
+        {
+            int bs, be, pos;
+            struct Pair {int lo, hi;} *ranges;
+
+            length = code[pc+33] << 8 | code[pc+34];
+            bs = 0;
+            be = length-1; /* length >= 1 */
+            ranges = (struct Pair *)(code + ((pc + 35 + 3) & ~3));
+            while (bs <= be) {
+                pos = (bs + be) >> 1;
+                if (ch < ranges[pos].lo) be = pos-1;
+                else if (ch > ranges[pos].hi) bs = pos+1;
+                else return !invert;
+            }
+            return invert;
+        }
+    default:
+        Tcl_Panic("unknown op %d\n", op>>2);
+    }
+    return 0;
+}
+
+/*
+ * Most keys a regex may need, for lastChecked. Counted loops keep the
+ * program small, but each count is a state of its own.
+ */
+#define MAX_KEYS (1 << 20)
+
+/* Where the code at pc can go on to; returns how many places. */
+static int
+successors(unsigned char *code, int pc, int *next)
+{
+    unsigned char *cp = code + pc;
+
+    switch (*cp >> 2) {
+    case INST_GOTO: case INST_AGAIN:
+        next[0] = cp[1] << 8 | cp[2];
+        return 1;
+    case INST_SPLIT:
+        next[0] = cp[1] << 8 | cp[2];
+        next[1] = cp[3] << 8 | cp[4];
+        return 2;
+    case INST_REPEAT:
+        next[0] = pc + 7;
+        next[1] = cp[5] << 8 | cp[6];
+        return 2;
+    case INST_MATCH:
+        return 0;
+    default:
+        next[0] = nextInst(code, pc);
+        return 1;
+    }
+}
+
+/*
+ * Give the instructions in counted loops their keys (see Regex).
+ * The body of a loop is what its REPEAT leads to before getting back
+ * through an AGAIN; it must not hold another loop, share code with
+ * one, or reach MATCH, so that a count only ever applies to its own
+ * loop and is 0 everywhere else.
+ */
+static int
+findRepeats(Tcl_Interp *interp, Regex *regex, int numEntries, int *entries)
+{
+    unsigned char *code = regex->prog;
+    int i, j, n, pc, sp, cap, numLoops = 0, numBody, next[2];
+    int *loopOf, *stack, *loops, numKeys, maxThreads;
+    const char *msg = NULL;
+
+    regex->keyBase = NULL;
+    regex->numKeys = regex->codeLength;
+    regex->maxThreads = regex->numInsts;
+    if (regex->codeLength == 0) return TCL_OK;
+
+    /* Find the loops that can be reached. */
+    loopOf = ckalloc(sizeof(int) * regex->codeLength);
+    memset(loopOf, 0, sizeof(int) * regex->codeLength);
+    stack = ckalloc(sizeof(int) * (2*regex->numInsts + numEntries + 1));
+    loops = ckalloc(sizeof(int) * (regex->numInsts + 1));
+    sp = 0;
+    for (i = 0; i < numEntries; i++) stack[sp++] = entries[i];
+    while (sp > 0) {
+        pc = stack[--sp];
+        if (pc >= regex->codeLength || loopOf[pc]) continue;
+        loopOf[pc] = -1;
+        if (code[pc] >> 2 == INST_REPEAT) loops[numLoops++] = pc;
+        n = successors(code, pc, next);
+        for (j = 0; j < n; j++) stack[sp++] = next[j];
+    }
+    if (numLoops == 0) goto done;
+
+    /* Mark each loop's body, with the REPEAT itself and its AGAINs. */
+    memset(loopOf, 0, sizeof(int) * regex->codeLength);
+    numKeys = regex->codeLength;
+    maxThreads = regex->numInsts;
+    regex->keyBase = ckalloc(sizeof(int) * regex->codeLength);
+    for (pc = 0; pc < regex->codeLength; pc++) regex->keyBase[pc] = pc;
+    for (i = 0; i < numLoops; i++) {
+        cap = code[loops[i]+3] << 8 | code[loops[i]+4];
+        if (cap == 0xffff) cap = code[loops[i]+1] << 8 | code[loops[i]+2];
+        numBody = 0;
+        sp = 0;
+        stack[sp++] = loops[i];
+        while (sp > 0) {
+            pc = stack[--sp];
+            if (pc >= regex->codeLength) continue;
+            if (loopOf[pc] == loops[i] + 1) continue;
+            if (loopOf[pc] || code[pc] >> 2 == INST_MATCH
+                    || (code[pc] >> 2 == INST_REPEAT && pc != loops[i])) {
+                msg = "regex bytecode bad: nested loop";
+                goto done;
+            }
+            if (code[pc] >> 2 == INST_STRING) {
+                /* Its threads' count is where they are in it */
+                msg = "regex bytecode bad: string in loop";
+                goto done;
+            }
+            loopOf[pc] = loops[i] + 1;
+            regex->keyBase[pc] = numKeys;
+            numKeys += cap + 1;
+            numBody++;
+            if (numKeys > MAX_KEYS) {
+                msg = "regex too large";
+                goto done;
+            }
+            if (code[pc] >> 2 == INST_AGAIN) {
+                if ((code[pc+1] << 8 | code[pc+2]) != loops[i]) {
+                    msg = "regex bytecode bad: loop";
+                    goto done;
+                }
+                continue;
+            }
+            if (pc == loops[i]) {
+                stack[sp++] = pc + 7;
+                continue;
+            }
+            n = successors(code, pc, next);
+            for (j = 0; j < n; j++) stack[sp++] = next[j];
+        }
+        maxThreads += numBody * cap;
+    }
+    regex->numKeys = numKeys;
+    regex->maxThreads = maxThreads;
+
+done:
+    ckfree(loopOf);
+    ckfree(stack);
+    ckfree(loops);
+    if (msg) {
+        ckfree(regex->keyBase);
+        regex->keyBase = NULL;
+        if (interp) Tcl_SetObjResult(interp, Tcl_NewStringObj(msg, -1));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ * Find the brackets a thread can loop on. Say the thread is at
+ * bracket X. After a char X matches, following the code gets back to
+ * X, with no SAVE on the way, and maybe to some other consuming
+ * instructions, and to MATCH if only after X. If the next char
+ * matches X but none of those others, the threads the others got die
+ * on it, X is as before, and any match found is replaced by one
+ * further on. So over a run of such chars nothing happens but X
+ * moving along, and execute can skip all but the last of them.
+ */
+static void
+findRuns(Regex *regex)
+{
+    unsigned char *code = regex->prog, *cp, c;
+    int pc, q, i, sp, numSaves, ok, reached, generation = 0;
+    int *stamp, *stack, *saves;
+    Run *run;
+
+    stamp = ckalloc(sizeof(int) * regex->codeLength);
+    memset(stamp, 0, sizeof(int) * regex->codeLength);
+    stack = ckalloc(sizeof(int) * (2*regex->numInsts + 1));
+    saves = ckalloc(sizeof(int) * (regex->numInsts + 1));
+    for (pc = regex->entry; pc < regex->codeLength; pc = nextInst(code, pc)) {
+        if (code[pc] >> 2 != INST_BRACKET) continue;
+        if (regex->numRuns == RUN_MAX) break;
+        if (!regex->runs) regex->runs = ckalloc(sizeof(Run) * RUN_MAX);
+        run = &regex->runs[regex->numRuns];
+        run->pc = pc;
+        run->numOthers = 0;
+        for (i = 0; i < 16; i++) {
+            run->map[i] = code[pc+1+i] ^ (code[pc] & 1 ? 0xff : 0);
+        }
+
+        /*
+         * Walk the code reached after X, then once more from past
+         * every SAVE seen, where X must not turn up.
+         */
+        ok = 1;
+        reached = 0;
+        numSaves = 0;
+        generation++;
+        sp = 0;
+        stack[sp++] = nextInst(code, pc);
+        while (ok && sp > 0) {
+            /* In the order follow goes, to see what comes before MATCH */
+            q = stack[--sp];
+            if (stamp[q] == generation) continue;
+            stamp[q] = generation;
+            cp = code + q;
+            switch (*cp >> 2) {
+            case INST_GOTO:
+                stack[sp++] = cp[1] << 8 | cp[2];
+                break;
+            case INST_SPLIT:
+                stack[sp++] = cp[3] << 8 | cp[4];
+                stack[sp++] = cp[1] << 8 | cp[2];
+                break;
+            case INST_SAVE:
+                saves[numSaves++] = q+3;
+                stack[sp++] = q+3;
+                break;
+            case INST_END: case INST_START:
+                /* Dead away from the end, and past the beginning */
+                break;
+            case INST_MATCH:
+                /* Would cut X off */
+                if (!reached) ok = 0;
+                break;
+            case INST_CHR:
+                if (q == pc) {
+                    reached = 1;
+                } else if (run->numOthers == RUN_MAX_OTHERS) {
+                    ok = 0;
+                } else {
+                    run->others[run->numOthers++] = q;
+                    c = cp[1];
+                    if (c < 0x80) run->map[c >> 3] &= ~(1 << (c & 7));
+                }
+                break;
+            case INST_STRING:
+                /* As CHR for its first char; see findRun for the rest */
+                if (run->numOthers == RUN_MAX_OTHERS) {
+                    ok = 0;
+                } else {
+                    run->others[run->numOthers++] = q;
+                    c = cp[2];
+                    if (c < 0x80) run->map[c >> 3] &= ~(1 << (c & 7));
+                }
+                break;
+            case INST_BRACKET:
+                if (q == pc) {
+                    reached = 1;
+                } else if (run->numOthers == RUN_MAX_OTHERS) {
+                    ok = 0;
+                } else {
+                    run->others[run->numOthers++] = q;
+                    for (i = 0; i < 16; i++) {
+                        run->map[i] &= ~(cp[1+i] ^ (*cp & 1 ? 0xff : 0));
+                    }
+                }
+                break;
+            default:
+                /* ANY, which would leave nothing to skip */
+                ok = 0;
+            }
+        }
+        generation++;
+        sp = 0;
+        for (i = 0; i < numSaves; i++) stack[sp++] = saves[i];
+        while (ok && sp > 0) {
+            q = stack[--sp];
+            if (q == pc) ok = 0;
+            if (stamp[q] == generation) continue;
+            stamp[q] = generation;
+            cp = code + q;
+            switch (*cp >> 2) {
+            case INST_GOTO:
+                stack[sp++] = cp[1] << 8 | cp[2];
+                break;
+            case INST_SPLIT:
+                stack[sp++] = cp[1] << 8 | cp[2];
+                stack[sp++] = cp[3] << 8 | cp[4];
+                break;
+            case INST_SAVE:
+                stack[sp++] = q+3;
+                break;
+            }
+        }
+        if (ok && reached) regex->numRuns++;
+    }
+    if (regex->runs && !regex->numRuns) {
+        ckfree(regex->runs);
+        regex->runs = NULL;
+    }
+    ckfree(stamp);
+    ckfree(stack);
+    ckfree(saves);
+}
+
+/*
+ * The run the threads in list are in, if any: one of them at the run's
+ * bracket, and the rest at its others. A thread past the first char of
+ * a STRING could take any char, so there is none then.
+ */
+static Run *
+findRun(Regex *regex, ThreadList *list)
+{
+    int i, j, k, pc;
+    Run *run;
+
+    for (i = 0; i < list->numThreads; i++) {
+        for (run = regex->runs; run < regex->runs + regex->numRuns; run++) {
+            if (run->pc == list->list[i].pc) goto found;
+        }
+    }
+    return NULL;
+
+found:
+    for (j = 0; j < list->numThreads; j++) {
+        if (j == i) continue;
+        pc = list->list[j].pc;
+        for (k = 0; k < run->numOthers && run->others[k] != pc; k++);
+        if (k == run->numOthers) return NULL;
+        if (list->list[j].count && regex->prog[pc] >> 2 == INST_STRING) {
+            return NULL;
+        }
+    }
+    return run;
+}
+
+/*
+ * Skip the chars in [str, end) that are in map. Returns the first one
+ * not skipped.
+ */
+static const char *
+skipRun(const unsigned char *map, const char *str, const char *end)
+{
+    unsigned char c;
+
+#ifdef __SSSE3__
+    {
+        /*
+         * Sixteen chars at a time: look up each one's map byte
+         * (c >> 3) and bit (c & 7) with shuffles. A non-ASCII byte
+         * has its top bit set, which makes the shuffle give 0.
+         */
+        __m128i table = _mm_loadu_si128((const __m128i *)map);
+        __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                     1, 2, 4, 8, 16, 32, 64, -128);
+        __m128i mask7 = _mm_set1_epi8(0x87), mask15 = _mm_set1_epi8(15);
+        __m128i top = _mm_set1_epi8(-128), zero = _mm_setzero_si128();
+        int miss;
+
+        while (end - str >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)str);
+            __m128i hi = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 3), mask15),
+                                      _mm_and_si128(v, top));
+            __m128i row = _mm_shuffle_epi8(table, hi);
+            __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(v, mask7));
+
+            miss = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), zero));
+            if (miss) return str + __builtin_ctz(miss);
+            str += 16;
+        }
+    }
+#endif
+    while (str < end) {
+        c = *(unsigned char *)str;
+        if (c >= 0x80 || !(map[c >> 3] >> (c & 7) & 1)) break;
+        str++;
+    }
+    return str;
+}
+
+/* Find the first occurrence of lit in [str, end), or NULL. */
+static const char *
+findLiteral(const char *str, const char *end, const char *lit, int length)
+{
+    const char *last = end - length;
+
+    while (str <= last) {
+        str = memchr(str, lit[0], last - str + 1);
+        if (!str) return NULL;
+        if (memcmp(str, lit, length) == 0) return str;
+        str++;
+    }
+    return NULL;
+}
+
+/*
+ * Advance to the next occurrence of the regex's literal prefix,
+ * keeping *charIndexPtr in step. Returns NULL if there is none.
+ */
+static const char *
+skipToPrefix(Regex *regex, const char *str, const char *end, int *charIndexPtr)
+{
+    const char *q;
+
+    q = findLiteral(str, end, (char *)regex->prog + regex->prefixOffset,
+                    regex->prefixLength);
+    if (q) *charIndexPtr += Tcl_NumUtfChars(str, q - str);
+    return q;
+}
+
+/*
+ * With more input to come, where a literal prefix not found in
+ * [str, end) could still begin, so that input after end completes it.
+ */
+static const char *
+prefixTail(Regex *regex, const char *str, const char *end, int *charIndexPtr)
+{
+    const char *q = end - (regex->prefixLength - 1);
+
+    if (q < str) q = str;
+    while (q > str && (*q & 0xC0) == 0x80) q--;
+    *charIndexPtr += Tcl_NumUtfChars(str, q - str);
+    return q;
+}
+
+/*
+ * The subs of a suspended search: its match so far and those of its
+ * threads, which are waiting in nextList. nextFree isn't used while a
+ * sub is live, so moveSuspended marks the ones it has done with it.
+ */
+#define SUSPENDED_SUBS(ctx, i, sub)                                     \
+    for ((i) = -1; (i) < nextList->numThreads; (i)++)                   \
+        if (((sub) = (i) < 0 ? (ctx)->savedMatch                        \
+                             : nextList->list[(i)].sub))
+
+/*
+ * The earliest input a suspended search still refers to, if before p.
+ * Input before it can be dropped.
+ */
+static const char *
+suspendedStart(Context *ctx, const char *p)
+{
+    Sub *sub;
+    int i, j;
+
+    SUSPENDED_SUBS(ctx, i, sub) {
+        for (j = 0; j < ctx->numSlots; j++) {
+            if (sub->slots[j].charPtr && sub->slots[j].charPtr < p) {
+                p = sub->slots[j].charPtr;
+            }
+        }
+    }
+    return p;
+}
+
+/*
+ * Have a suspended search refer to input that was at from at to
+ * instead, after the caller moved it.
+ */
+static void
+moveSuspended(Context *ctx, const char *from, const char *to)
+{
+    Sub *sub;
+    int i, j;
+
+    SUSPENDED_SUBS(ctx, i, sub) sub->nextFree = NULL;
+    SUSPENDED_SUBS(ctx, i, sub) {
+        if (sub->nextFree) continue;
+        for (j = 0; j < ctx->numSlots; j++) {
+            if (sub->slots[j].charPtr) {
+                sub->slots[j].charPtr = to + (sub->slots[j].charPtr - from);
+            }
+        }
+        sub->nextFree = sub;
+    }
+}
+
+/* How execute calls follow, or with a bare context, followBare. */
+#define EXECUTE_FOLLOW(pc, count, sub, charPtr, charIndex, atEnd)      \
+    (bare ? followBare(ctx, pc, count, NULL, charPtr, charIndex, atEnd) \
+          : follow(ctx, pc, count, sub, charPtr, charIndex, atEnd))
+
+/*
+ * Search for regex in [str, end) with ctx, which came from newContext
+ * for it and may be reused for the next search. On a match, copies
+ * its slots into match and returns 1. See Context for ctx->more and a
+ * suspended search, which goes on at str, and narrowContext for a bare
+ * ctx, with which any match ends the search.
+ */
+static int
+execute(Context *ctx, Regex *regex, const char *str, const char *end,
+        int charIndex, Slot *match)
+{
+    unsigned char *code;
+    const char *q;
+    Sub *sub;
+    Run *run;
+    int i, pc, count, bare;
+    Tcl_UniChar ch;
+
+    code = ctx->prog;
+    bare = ctx->bare;
+    ctx->end = end;
+
+    if (ctx->suspended) {
+        /*
+         * The threads were left waiting at the end of the last input;
+         * follow them again to tell those at END that it goes on, or
+         * that it ended. A search spanning that many turns clears
+         * lastChecked on the way, keeping the lists where they are.
+         */
+        ctx->suspended = 0;
+        if (ctx->turnCount >= 0xF0000000u) {
+            memset(ctx->lastChecked, 0, ctx->codeCapacity*sizeof(int));
+            ctx->turnCount &= 1;
+        }
+        ctx->turnCount++;
+        nextList->numThreads = 0;
+        for (i = 0; i < curList->numThreads; i++) {
+            if (EXECUTE_FOLLOW(curList->list[i].pc, curList->list[i].count,
+                               curList->list[i].sub, str, charIndex,
+                               str == end && !ctx->more)) {
+                if (bare) return 1;
+                for (i++; i < curList->numThreads; i++) {
+                    releaseSub(ctx, curList->list[i].sub);
+                }
+            }
+        }
+    } else {
+        restartContext(ctx);
+        STAT_ADD(ctx->stats, searches, 1);
+        if (regex->unanchored && regex->prefixLength) {
+            if (!(q = skipToPrefix(regex, str, end, &charIndex))) {
+                if (!ctx->more) return 0;
+                q = prefixTail(regex, str, end, &charIndex);
+            }
+            if (ctx->limit && q >= ctx->limit) return 0;
+            str = q;
+        }
+        if (EXECUTE_FOLLOW(regex->entry, 0, newSub(ctx), str, charIndex,
+                           str == end && !ctx->more) && bare) {
+            return 1;
+        }
+    }
+    while (str < end) {
+        ctx->turnCount++;
+        nextList->numThreads = 0;
+        STAT_MAX(ctx->stats, peakThreads, curList->numThreads);
+
+        /* If all threads died on the previous turn, we're done */
+        if (curList->numThreads == 0 && (!regex->unanchored || ctx->savedMatch
+                                         || (ctx->limit && str >= ctx->limit)))
+            break;
+
+        /*
+         * Threads started from here on would die the same way, except
+         * at the end, where $ may still match. Unless it was a STRING
+         * they died on, which depends on the input there.
+         */
+        if (curList->numThreads == 0 && !ctx->pruned) {
+            if (ctx->limit) break;
+            charIndex += Tcl_NumUtfChars(str, end - str);
+            str = end;
+            if (EXECUTE_FOLLOW(regex->entry, 0, newSub(ctx), str, charIndex,
+                               !ctx->more) && bare) {
+                return 1;
+            }
+            break;
+        }
+        ctx->pruned = 0;
+
+        /*
+         * Skip a run (see findRuns) if no new threads are to be
+         * started. The last char of the run is left to the step
+         * below, as the threads it gets have to be for real.
+         */
+        if (regex->runs && (!regex->unanchored || ctx->savedMatch)
+                && curList->numThreads <= RUN_MAX_OTHERS + 1
+                && (run = findRun(regex, curList))) {
+            const char *q = skipRun(run->map, str, end);
+            if (q - str > 1) {
+                charIndex += q - str - 1;
+                str = q - 1;
+            }
+        }
+
+        NEXT_CHAR(str, ch);
+        charIndex++;
+        STAT_ADD(ctx->stats, chars, 1);
+        for (i = 0; i < curList->numThreads; i++) {
+            pc = curList->list[i].pc;
+            count = curList->list[i].count;
+            sub = curList->list[i].sub;
+            if (!matchInst(code, &pc, &count, ch)) {
+                if (!bare) releaseSub(ctx, sub);
+            } else if (EXECUTE_FOLLOW(pc, count, sub, str, charIndex,
+                                      str == end && !ctx->more)) {
+                if (bare) return 1;
+                goto skip;
+            }
+        }
+
+        /*
+         * An unanchored regex starts a new thread at every position,
+         * with lowest priority, as a leading .*? would. If no older
+         * thread is left, skip to where the literal prefix occurs.
+         */
+        if (regex->unanchored && !ctx->savedMatch
+                && (!ctx->limit || str < ctx->limit)) {
+            if (nextList->numThreads == 0 && regex->prefixLength) {
+                if (!(q = skipToPrefix(regex, str, end, &charIndex))) {
+                    if (!ctx->more) break;
+                    q = prefixTail(regex, str, end, &charIndex);
+                }
+                if (ctx->limit && q >= ctx->limit) break;
+                str = q;
+            }
+            if (EXECUTE_FOLLOW(regex->entry, 0, newSub(ctx), str, charIndex,
+                               str == end && !ctx->more) && bare) {
+                return 1;
+            }
+        }
+skip:
+        for (i++; i < curList->numThreads; i++) {
+            releaseSub(ctx, curList->list[i].sub);
+        }
+    }
+
+    /*
+     * More input could still change the result while threads wait
+     * for it, or, with no match yet, by holding one. The search is
+     * suspended, with its threads still in nextList.
+     */
+    if (ctx->more && (nextList->numThreads
+                      || (regex->unanchored && !ctx->savedMatch))) {
+        ctx->suspended = 1;
+        return 0;
+    }
+
+    if ((sub = ctx->savedMatch)) {
+        memcpy(match, sub->slots, ctx->numSlots*sizeof(Slot));
+        releaseSub(ctx, sub);
+    }
+    if (ctx->extantSubs) {
+        Tcl_Panic("Leaked %d subs", ctx->extantSubs);
+    }
+    if (!ctx->worker && ctx->peakSubs > regex->peakSubs) {
+        regex->peakSubs = ctx->peakSubs;
+    }
+    STAT_MAX(ctx->stats, peakSubs, ctx->peakSubs);
+    return sub != NULL;
+}
+
+/*
+ * Run all patterns of a set in one pass over the string, as execute
+ * would run each of them. A match only cuts off the lower priority
+ * threads of its own pattern. Appends index {start end} to result for
+ * every pattern that matched.
+ */
+static void
+executeSet(RegexSet *set, const char *str, const char *end, int charIndex,
+           int beginning, Tcl_Obj *result)
+{
+    unsigned char *code;
+    Context *ctx;
+    Sub *sub, **matches;
+    int i, k, pc, count, seeding;
+    unsigned int *cut;
+    Tcl_UniChar ch;
+    Tcl_Obj *range[2];
+
+    ctx = newContext(set->regex, beginning);
+    restartContext(ctx);
+    code = ctx->prog;
+    matches = ckalloc(sizeof(Sub *) * (set->numPatterns + 1));
+    cut = ckalloc(sizeof(unsigned int) * (set->numPatterns + 1));
+    for (k = 0; k < set->numPatterns; k++) {
+        matches[k] = NULL;
+        cut[k] = 0;
+    }
+    ctx->owner = set->owner;
+    ctx->matches = matches;
+    ctx->end = end;
+
+    for (k = 0; k < set->numPatterns; k++) {
+        follow(ctx, set->entries[k], 0, newSub(ctx), str, charIndex,
+               str == end);
+    }
+    while (str < end) {
+        ctx->turnCount++;
+        nextList->numThreads = 0;
+        STAT_MAX(ctx->stats, peakThreads, curList->numThreads);
+
+        seeding = 0;
+        for (k = 0; k < set->numPatterns; k++) {
+            if (set->unanchored[k] && !matches[k]) seeding = 1;
+        }
+        if (curList->numThreads == 0 && !seeding)
+            break;
+
+        NEXT_CHAR(str, ch);
+        charIndex++;
+        STAT_ADD(ctx->stats, chars, 1);
+        for (i = 0; i < curList->numThreads; i++) {
+            pc = curList->list[i].pc;
+            count = curList->list[i].count;
+            sub = curList->list[i].sub;
+            k = set->owner[pc];
+            if (cut[k] == ctx->turnCount || !matchInst(code, &pc, &count, ch)) {
+                releaseSub(ctx, sub);
+            } else if (follow(ctx, pc, count, sub, str, charIndex,
+                              str == end)) {
+                cut[k] = ctx->turnCount;
+            }
+        }
+        for (k = 0; seeding && k < set->numPatterns; k++) {
+            if (set->unanchored[k] && !matches[k]) {
+                follow(ctx, set->entries[k], 0, newSub(ctx), str, charIndex,
+                       str == end);
+            }
+        }
+    }
+
+    for (k = 0; k < set->numPatterns; k++) {
+        if (!(sub = matches[k])) continue;
+        range[0] = Tcl_NewIntObj(sub->slots[0].charIndex);
+        range[1] = Tcl_NewIntObj(sub->slots[1].charIndex-1);
+        Tcl_ListObjAppendElement(NULL, result, Tcl_NewIntObj(k));
+        Tcl_ListObjAppendElement(NULL, result, Tcl_NewListObj(2, range));
+        releaseSub(ctx, sub);
+    }
+    if (ctx->extantSubs) {
+        Tcl_Panic("Leaked %d subs", ctx->extantSubs);
+    }
+    if (ctx->peakSubs > set->regex->peakSubs) {
+        set->regex->peakSubs = ctx->peakSubs;
+    }
+    releaseContext(ctx);
+    ckfree(matches);
+    ckfree(cut);
+}
+
+#undef curList
+#undef nextList
+#undef EXECUTE_FOLLOW
+
+/*
+ * Lazy DFA. Instead of running one thread per NFA state, the DFA
+ * steps through states that each stand for a whole set of threads,
+ * so when only the existence of a match matters a search is a table
+ * lookup per character. The cache is bounded: when it is full, all
+ * states are dropped and the search goes on; a search that keeps
+ * flushing falls back to execute.
+ *
+ * Characters are mapped to classes of characters that no instruction
+ * can tell apart, and transitions are cached per class. An ASCII
+ * char's class is a table lookup. Non-ASCII chars fall into intervals
+ * between the non-ASCII chars and range ends the regex mentions, found
+ * by binary search; only a regex with more than DFA_MAX_BOUNDS of
+ * those sends them down the uncached path.
+ */
+#define DFA_MAX_MEMORY (256*1024)
+#define DFA_MAX_BOUNDS 64
+#define DFA_MAX_FLUSHES 4
+#define DFA_MAX_BAILS 8
+
+static int
+nextInst(unsigned char *code, int pc)
+{
+    Tcl_UniChar ch;
+    int length;
+
+    switch (code[pc] >> 2) {
+    case INST_CHR:
+        if (code[pc+1] < 0x80) return pc + 2;
+        return pc + 1 + Tcl_UtfToUniChar((char *)(code+pc+1), &ch);
+    case INST_GOTO: case INST_SAVE: case INST_AGAIN:
+        return pc + 3;
+    case INST_SPLIT:
+        return pc + 5;
+    case INST_REPEAT:
+        return pc + 7;
+    case INST_STRING:
+        return pc + 2 + code[pc+1];
+    case INST_BRACKET:
+        if (code[pc] & 2) return pc + 33;
+        length = code[pc+33] << 8 | code[pc+34];
+        return ((pc + 35 + 3) & ~3) + 8*length;
+    default:
+        return pc + 1;
+    }
+}
+
+static int
+comparePcs(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Note that a new class starts at ch. */
+static void
+addBound(unsigned char *boundary, int **boundsPtr, int *numPtr, int *maxPtr,
+         int ch)
+{
+    if (ch < 128) {
+        boundary[ch] = 1;
+        return;
+    }
+    if (*numPtr == *maxPtr) {
+        *maxPtr = *maxPtr ? *maxPtr*2 : 16;
+        *boundsPtr = ckrealloc(*boundsPtr, sizeof(int) * *maxPtr);
+    }
+    (*boundsPtr)[(*numPtr)++] = ch;
+}
+
+static Dfa *
+newDfa(Regex *regex)
+{
+    Dfa *dfa;
+    unsigned char *code, boundary[129];
+    int pc, i, n, cls, numBounds = 0, maxBounds = 0, *bounds = NULL;
+    int numStrings = 0;
+    Tcl_UniChar ch;
+
+    code = regex->prog;
+    memset(boundary, 0, sizeof(boundary));
+#define BOUND(x) addBound(boundary, &bounds, &numBounds, &maxBounds, (x))
+    for (pc = regex->entry; pc < regex->codeLength; pc = nextInst(code, pc)) {
+        switch (code[pc] >> 2) {
+        case INST_CHR:
+            Tcl_UtfToUniChar((char *)(code+pc+1), &ch);
+            BOUND(ch);
+            BOUND(ch+1);
+            break;
+        case INST_STRING:
+            for (i = 0; i < code[pc+1]; ) {
+                i += Tcl_UtfToUniChar((char *)(code+pc+2+i), &ch);
+                BOUND(ch);
+                BOUND(ch+1);
+            }
+            numStrings++;
+            break;
+        case INST_BRACKET:
+            for (i = 1; i <= 256; i++) {
+                int in = i < 256 && (code[pc+1 + (i >> 3)] >> (i & 7) & 1);
+                int prev = code[pc+1 + ((i-1) >> 3)] >> ((i-1) & 7) & 1;
+                if (in != prev) BOUND(i);
+            }
+            if (!(code[pc] & 2)) {
+                int *r = (int *)(code + ((pc+35+3) & ~3));
+                n = code[pc+33] << 8 | code[pc+34];
+                for (i = 0; i < n; i++) {
+                    BOUND(r[2*i]);
+                    BOUND(r[2*i+1]+1);
+                }
+            }
+            break;
+        }
+    }
+#undef BOUND
+
+    dfa = ckalloc(sizeof(Dfa));
+    cls = 0;
+    for (i = 0; i < 128; i++) {
+        if (i > 0 && boundary[i]) cls++;
+        dfa->classMap[i] = cls;
+    }
+    dfa->numClasses = cls + 1;
+
+    /* Sort the non-ASCII bounds and drop duplicates; 128 is implied. */
+    if (numBounds) qsort(bounds, numBounds, sizeof(int), comparePcs);
+    for (i = n = 0; i < numBounds; i++) {
+        if (bounds[i] > 128 && (n == 0 || bounds[i] != bounds[n-1]))
+            bounds[n++] = bounds[i];
+    }
+    if (n > DFA_MAX_BOUNDS) {
+        dfa->nonAsciiClass = -1;
+        dfa->numBounds = 0;
+    } else {
+        dfa->nonAsciiClass = dfa->numClasses;
+        dfa->numClasses += n + 1;
+        dfa->numBounds = n;
+    }
+    if (dfa->numBounds == 0 && bounds) {
+        ckfree(bounds);
+        bounds = NULL;
+    }
+    dfa->bounds = bounds;
+
+    dfa->memUsed = 0;
+    dfa->numStates = 0;
+    dfa->hashMask = 63;
+    dfa->hash = ckalloc(sizeof(DState *) * (dfa->hashMask + 1));
+    memset(dfa->hash, 0, sizeof(DState *) * (dfa->hashMask + 1));
+    dfa->start = NULL;
+    dfa->idle = NULL;
+    dfa->entry = regex->entry;
+    dfa->unanchored = regex->unanchored;
+    dfa->flushes = 0;
+    dfa->bails = 0;
+    dfa->generation = 0;
+    dfa->epoch = 0;
+    dfa->keyBase = regex->keyBase;
+    dfa->keyPc = NULL;
+    if (regex->keyBase || numStrings) {
+        /*
+         * Loop instructions have their keys in one block each. A
+         * STRING's keys are the pcs of its bytes.
+         */
+        dfa->keyPc = ckalloc(sizeof(int) * regex->numKeys);
+        for (i = 0; i < regex->numKeys; i++) {
+            dfa->keyPc[i] = i < regex->codeLength ? i : -1;
+        }
+        for (pc = 0; regex->keyBase && pc < regex->codeLength; pc++) {
+            if (regex->keyBase[pc] != pc) dfa->keyPc[regex->keyBase[pc]] = pc;
+        }
+        for (i = regex->codeLength; i < regex->numKeys; i++) {
+            if (dfa->keyPc[i] < 0) dfa->keyPc[i] = dfa->keyPc[i-1];
+        }
+        for (pc = regex->entry; numStrings && pc < regex->codeLength;
+             pc = nextInst(code, pc)) {
+            if (code[pc] >> 2 != INST_STRING) continue;
+            for (i = 1; i < code[pc+1]; i++) dfa->keyPc[pc+i] = pc;
+        }
+    }
+    dfa->numKeys = regex->numKeys;
+    dfa->stamp = ckalloc(sizeof(int) * regex->numKeys);
+    memset(dfa->stamp, 0, sizeof(int) * regex->numKeys);
+    dfa->stack = ckalloc(sizeof(int) * regex->maxThreads);
+    dfa->seeds = ckalloc(sizeof(int) * (regex->maxThreads + 1));
+    dfa->pcs = ckalloc(sizeof(int) * regex->maxThreads);
+    return dfa;
+}
+
+static void
+dfaFlush(Dfa *dfa)
+{
+    unsigned int i;
+    DState *s, *next;
+
+    for (i = 0; i <= dfa->hashMask; i++) {
+        for (s = dfa->hash[i]; s; s = next) {
+            next = s->hashNext;
+            ckfree(s);
+        }
+        dfa->hash[i] = NULL;
+    }
+    dfa->memUsed = 0;
+    dfa->numStates = 0;
+    dfa->start = NULL;
+    dfa->idle = NULL;
+    dfa->epoch++;
+}
+
+static void
+freeDfa(Dfa *dfa)
+{
+    dfaFlush(dfa);
+    ckfree(dfa->hash);
+    if (dfa->keyPc) ckfree(dfa->keyPc);
+    ckfree(dfa->stamp);
+    ckfree(dfa->stack);
+    ckfree(dfa->seeds);
+    ckfree(dfa->pcs);
+    if (dfa->bounds) ckfree(dfa->bounds);
+    ckfree(dfa);
+}
+
+#define DFA_KEY(dfa, pc, count) \
+    (((dfa)->keyBase ? (dfa)->keyBase[pc] : (pc)) + (count))
+#define DFA_PC(dfa, key) ((dfa)->keyPc ? (dfa)->keyPc[key] : (key))
+
+/*
+ * Follow all non-consuming instructions from the seeds. Unless atEnd
+ * is set, the consuming instructions reached are stored in dfa->pcs
+ * in ascending order of key. Returns whether MATCH is reachable.
+ */
+static int
+dfaClosure(Dfa *dfa, unsigned char *code, int numSeeds, int atStart, int atEnd,
+           int *numPcsPtr)
+{
+    int i, key, pc, count, lo, hi, sp = 0, n = 0, matched = 0;
+    unsigned char *cp;
+
+    if (++dfa->generation < 0) {
+        memset(dfa->stamp, 0, sizeof(int) * dfa->numKeys);
+        dfa->generation = 1;
+    }
+#define PUSHKEY(x)                                              \
+    do {                                                        \
+        int x_ = (x);                                           \
+        if (dfa->stamp[x_] != dfa->generation) {                \
+            dfa->stamp[x_] = dfa->generation;                   \
+            dfa->stack[sp++] = x_;                              \
+        }                                                       \
+    } while (0)
+#define PUSH(x, c) PUSHKEY(DFA_KEY(dfa, (x), (c)))
+
+    for (i = 0; i < numSeeds; i++) PUSHKEY(dfa->seeds[i]);
+    while (sp > 0) {
+        key = dfa->stack[--sp];
+        pc = DFA_PC(dfa, key);
+        count = key - (dfa->keyBase ? dfa->keyBase[pc] : pc);
+        cp = code + pc;
+        switch (*cp >> 2) {
+        case INST_GOTO:
+            PUSH(cp[1] << 8 | cp[2], count);
+            break;
+        case INST_SPLIT:
+            PUSH(cp[1] << 8 | cp[2], count);
+            PUSH(cp[3] << 8 | cp[4], count);
+            break;
+        case INST_REPEAT:
+            lo = cp[1] << 8 | cp[2];
+            hi = cp[3] << 8 | cp[4];
+            if (count < lo) {
+                PUSH(pc+7, count);
+            } else if (count == hi) {
+                PUSH(cp[5] << 8 | cp[6], 0);
+            } else {
+                PUSH(pc+7, count);
+                PUSH(cp[5] << 8 | cp[6], 0);
+            }
+            break;
+        case INST_AGAIN:
+            pc = cp[1] << 8 | cp[2];
+            cp = code + pc;
+            hi = cp[3] << 8 | cp[4];
+            if (hi == 0xffff) hi = cp[1] << 8 | cp[2];
+            PUSH(pc, count < hi ? count+1 : count);
+            break;
+        case INST_SAVE:
+            PUSH(pc+3, count);
+            break;
+        case INST_MATCH:
+            matched = 1;
+            break;
+        case INST_END:
+            if (atEnd) PUSH(pc+1, count);
+            break;
+        case INST_START:
+            if (atStart) PUSH(pc+1, count);
+            break;
+        default:
+            if (!atEnd) dfa->pcs[n++] = key;
+        }
+    }
+#undef PUSH
+#undef PUSHKEY
+
+    if (!atEnd) {
+        qsort(dfa->pcs, n, sizeof(int), comparePcs);
+        *numPcsPtr = n;
+    }
+    return matched;
+}
+
+/*
+ * Find or build the state reached from the numSeeds instructions in
+ * dfa->seeds. Returns NULL if the cache had to be flushed too often.
+ */
+static DState *
+dfaState(Dfa *dfa, unsigned char *code, int numSeeds, int atStart)
+{
+    int i, n, flags = 0;
+    unsigned int hash;
+    size_t size;
+    DState *s, **bucket;
+
+    if (dfaClosure(dfa, code, numSeeds, atStart, 0, &n)) {
+        /* The search ends here; no need for the consuming instructions. */
+        flags = DSTATE_MATCH | DSTATE_MATCH_AT_END;
+        n = 0;
+    } else if (dfaClosure(dfa, code, numSeeds, atStart, 1, NULL)) {
+        flags = DSTATE_MATCH_AT_END;
+    }
+
+    hash = flags;
+    for (i = 0; i < n; i++) hash = hash*31 + dfa->pcs[i];
+    for (s = dfa->hash[hash & dfa->hashMask]; s; s = s->hashNext) {
+        if (s->hash == hash && s->flags == flags && s->numPcs == n &&
+            memcmp(s->pcs, dfa->pcs, n*sizeof(int)) == 0) {
+            return s;
+        }
+    }
+
+    size = sizeof(DState) + (dfa->numClasses-1)*sizeof(DState *) + n*sizeof(int);
+    if (dfa->memUsed + size > DFA_MAX_MEMORY) {
+        if (++dfa->flushes > DFA_MAX_FLUSHES) return NULL;
+        dfaFlush(dfa);
+    }
+
+    if (dfa->numStates > (int)dfa->hashMask) {
+        /* Grow the hash table. */
+        unsigned int mask = dfa->hashMask*2 + 1;
+        DState **table, *next;
+
+        table = ckalloc(sizeof(DState *) * (mask + 1));
+        memset(table, 0, sizeof(DState *) * (mask + 1));
+        for (i = 0; i <= (int)dfa->hashMask; i++) {
+            for (s = dfa->hash[i]; s; s = next) {
+                next = s->hashNext;
+                s->hashNext = table[s->hash & mask];
+                table[s->hash & mask] = s;
+            }
+        }
+        ckfree(dfa->hash);
+        dfa->hash = table;
+        dfa->hashMask = mask;
+    }
+
+    s = ckalloc(size);
+    s->hash = hash;
+    s->flags = flags;
+    s->numPcs = n;
+    memset(s->next, 0, dfa->numClasses*sizeof(DState *));
+    s->pcs = (int *)&s->next[dfa->numClasses];
+    memcpy(s->pcs, dfa->pcs, n*sizeof(int));
+    bucket = &dfa->hash[hash & dfa->hashMask];
+    s->hashNext = *bucket;
+    *bucket = s;
+    dfa->numStates++;
+    dfa->memUsed += size;
+    return s;
+}
+
+/* State of an unanchored search with nothing in progress */
+static DState *
+dfaIdle(Dfa *dfa, unsigned char *code)
+{
+    if (!dfa->idle) {
+        dfa->seeds[0] = DFA_KEY(dfa, dfa->entry, 0);
+        dfa->idle = dfaState(dfa, code, 1, 0);
+    }
+    return dfa->idle;
+}
+
+/* Number of bounds <= ch, which is ch's offset from nonAsciiClass. */
+static int
+boundsBelow(Dfa *dfa, Tcl_UniChar ch)
+{
+    int lo = 0, hi = dfa->numBounds, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (dfa->bounds[mid] <= (int)ch) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Read the char at *strPtr into *chPtr, and return its class. */
+static int
+dfaClass(Dfa *dfa, const char **strPtr, Tcl_UniChar *chPtr)
+{
+    unsigned char c = *(unsigned char *)*strPtr;
+    int cls;
+
+    if (c < 128) {
+        *chPtr = c;
+        ++*strPtr;
+        return dfa->classMap[c];
+    }
+    *strPtr += Tcl_UtfToUniChar(*strPtr, chPtr);
+    cls = dfa->nonAsciiClass;
+    if (dfa->numBounds) cls += boundsBelow(dfa, *chPtr);
+    return cls;
+}
+
+/* Transition from s on ch, caching it under class cls unless -1. */
+static DState *
+dfaStep(Dfa *dfa, unsigned char *code, DState *s, Tcl_UniChar ch, int cls)
+{
+    int i, pc, count, numSeeds = 0, flushes = dfa->flushes;
+    DState *next;
+
+    for (i = 0; i < s->numPcs; i++) {
+        pc = DFA_PC(dfa, s->pcs[i]);
+        count = s->pcs[i] - (dfa->keyBase ? dfa->keyBase[pc] : pc);
+        if (matchInst(code, &pc, &count, ch))
+            dfa->seeds[numSeeds++] = DFA_KEY(dfa, pc, count);
+    }
+    if (!dfa->unanchored) {
+        next = dfaState(dfa, code, numSeeds, 0);
+    } else if (numSeeds == 0) {
+        next = dfaIdle(dfa, code);
+    } else {
+        dfa->seeds[numSeeds++] = DFA_KEY(dfa, dfa->entry, 0);
+        next = dfaState(dfa, code, numSeeds, 0);
+    }
+
+    /* s is gone if the cache was flushed */
+    if (next && cls >= 0 && dfa->flushes == flushes) s->next[cls] = next;
+    return next;
+}
+
+/*
+ * Returns 1 if regex matches anywhere in str (from its start, as
+ * execute would), 0 if not, and -1 if the caller should use execute
+ * instead.
+ */
+static int
+dfaExecute(Regex *regex, const char *str, const char *end)
+{
+    Dfa *dfa;
+    DState *s, *next;
+    unsigned char *code = regex->prog;
+    const char *prefix = (char *)code + regex->prefixOffset;
+    const char *q;
+    int prefixLength = regex->unanchored ? regex->prefixLength : 0;
+    Tcl_UniChar ch;
+    int cls;
+
+    STAT_ADD(regex->stats, dfaSearches, 1);
+    if (!regex->dfa) regex->dfa = newDfa(regex);
+    dfa = regex->dfa;
+    if (dfa->bails > DFA_MAX_BAILS) return -1;
+    dfa->flushes = 0;
+
+    q = prefixLength ? findLiteral(str, end, prefix, prefixLength) : str;
+    if (!q) return 0;
+    if (q != str) {
+        /* Past the beginning, so ^ can no longer match */
+        str = q;
+        if (!(s = dfaIdle(dfa, code))) goto bail;
+    } else if (!(s = dfa->start)) {
+        dfa->seeds[0] = DFA_KEY(dfa, dfa->entry, 0);
+        if (!(s = dfaState(dfa, code, 1, 1))) goto bail;
+        dfa->start = s;
+    }
 
-    follow(ctx, 0, sub, str, charIndex, str == end);
     while (str < end) {
-        ctx->turnCount++;
-        nextList->numThreads = 0;
+        if (s->flags & DSTATE_MATCH) return 1;
+        if (s->numPcs == 0 && !dfa->unanchored) return 0;
+        if (s == dfa->idle && prefixLength) {
+            if (!(str = findLiteral(str, end, prefix, prefixLength))) return 0;
+        }
+        STAT_ADD(regex->stats, chars, 1);
+        cls = dfaClass(dfa, &str, &ch);
+        if (cls < 0 || !(next = s->next[cls])) {
+            if (!(next = dfaStep(dfa, code, s, ch, cls))) goto bail;
+        }
+        s = next;
+    }
+    return (s->flags & DSTATE_MATCH_AT_END) != 0;
+
+bail:
+    dfa->bails++;
+    dfaFlush(dfa);
+    return -1;
+}
+
+/*
+ * The value of the capture in s[0..1]: cursors into curString if
+ * given, else indices or the substring.
+ */
+static Tcl_Obj *
+captureObj(Slot *s, Tcl_Obj *curString, int indices)
+{
+    Tcl_Obj *range[2];
+
+    if (curString) {
+        char *base = curString->bytes;
+        range[0] = newCursorObj(curString, s[0].charPtr-base, s[0].charIndex);
+        range[1] = newCursorObj(curString, s[1].charPtr-base, s[1].charIndex);
+        return Tcl_NewListObj(2, range);
+    }
+    if (indices) {
+        range[0] = Tcl_NewLongObj(s[0].charIndex);
+        range[1] = Tcl_NewLongObj(s[1].charIndex-1);
+        return Tcl_NewListObj(2, range);
+    }
+    return Tcl_NewStringObjWithCharLength(s[0].charPtr,
+        s[1].charPtr-s[0].charPtr, s[1].charIndex-s[0].charIndex);
+}
+
+/*
+ * Parallel -all. The input is cut into chunks at char boundaries, and
+ * a worker thread finds, for each chunk, the matches -all would find
+ * starting in it if its searches began at the start of the chunk. A
+ * match may run on past its chunk, so the searches see the rest of
+ * the input too, but start no threads past the chunk.
+ *
+ * The match a search finds is the best one at the leftmost start that
+ * has one, which depends only on the input from that start. So when
+ * the searches in order come to a chunk before its start, or find a
+ * match at a start its worker found one at, from there on they go as
+ * the worker's did. Only when a match runs over into the next chunk
+ * do the searches from where it ended have to be run again, until one
+ * meets a match the worker found; usually the first.
+ *
+ * Indices in a chunk count from its start (chunk 0 from the start of
+ * the search), and ^ can't match in any but chunk 0.
+ */
+#define PARALLEL_MIN_CHUNK 65536 /* bytes */
+#define PARALLEL_KEEP 64         /* matches kept per chunk without -inline */
+
+typedef struct Chunk {
+    const char *start, *limit;   /* limit is NULL for the last chunk */
+    int charIndex;               /* index of start, see above */
+    int beginning;
+    int numChars;                /* in [start, limit) */
+    int numMatches;
+    int numKept;                 /* all of them, or PARALLEL_KEEP */
+    int capacity;
+    Slot *matches;               /* numKept times numSlots */
+    Slot *last;                  /* last match */
+    int peakSubs;
+#ifdef REGEX_STATS
+    Stats stats;                 /* added to the regex's after */
+#endif
+} Chunk;
+
+typedef struct ParallelJob {
+    Regex *regex;
+    const char *end;
+    int numSlots;                /* kept per match */
+    int keepAll;
+    int numChunks;
+    Chunk *chunks;
+#ifdef TCL_THREADS
+    int nextChunk;
+    Tcl_Mutex mutex;
+#endif
+
+    /* Putting the chunks' matches together, on the calling thread */
+    int *offsets;                /* index of each chunk's start */
+    Tcl_Obj *result;             /* for -inline, or NULL */
+    int numCaptures;
+    Tcl_Obj *curString;
+    int indices;
+    Slot *match;                 /* last match so far */
+    int numMatches;
+} ParallelJob;
+
+#define KEPT_MATCH(job, chunk, i) \
+    ((Slot *)((char *)(chunk)->matches + (i) * (job)->numSlots * sizeof(Slot)))
+
+/* Where -all searches on from after match. */
+static const char *
+nextStart(Slot *match, int *charIndexPtr)
+{
+    *charIndexPtr = match[1].charIndex;
+    if (match[1].charPtr == match[0].charPtr) {
+        ++*charIndexPtr;
+        return Tcl_UtfNext(match[1].charPtr);
+    }
+    return match[1].charPtr;
+}
+
+static Context *
+chunkContext(ParallelJob *job, Chunk *chunk)
+{
+    Context *ctx = newContext(job->regex, chunk->beginning);
+
+    narrowContext(ctx, job->numSlots);
+    ctx->limit = chunk->limit;
+    ctx->worker = 1;
+#ifdef REGEX_STATS
+    ctx->stats = &chunk->stats;
+#endif
+    return ctx;
+}
+
+#ifdef TCL_THREADS
+static void
+searchChunk(ParallelJob *job, Chunk *chunk)
+{
+    Context *ctx;
+    const char *p = chunk->start;
+    const char *limit = chunk->limit ? chunk->limit : job->end;
+    int charIndex = chunk->charIndex;
+
+    chunk->numChars = Tcl_NumUtfChars(chunk->start, limit - chunk->start);
+    ctx = chunkContext(job, chunk);
+    while (execute(ctx, job->regex, p, job->end, charIndex, chunk->last)) {
+        if (chunk->numKept < chunk->capacity || job->keepAll) {
+            if (chunk->numKept == chunk->capacity) {
+                chunk->capacity *= 2;
+                chunk->matches = ckrealloc(chunk->matches, chunk->capacity
+                                           * job->numSlots * sizeof(Slot));
+            }
+            memcpy(KEPT_MATCH(job, chunk, chunk->numKept), chunk->last,
+                   job->numSlots * sizeof(Slot));
+            chunk->numKept++;
+        }
+        chunk->numMatches++;
+        p = nextStart(chunk->last, &charIndex);
+        if (p >= limit) break;
+    }
+    chunk->peakSubs = ctx->peakSubs;
+    releaseContext(ctx);
+}
+
+static void
+parallelWork(ParallelJob *job)
+{
+    int k;
+
+    for (;;) {
+        Tcl_MutexLock(&job->mutex);
+        k = job->nextChunk++;
+        Tcl_MutexUnlock(&job->mutex);
+        if (k >= job->numChunks) return;
+        searchChunk(job, &job->chunks[k]);
+    }
+}
+
+static Tcl_ThreadCreateType
+parallelWorker(ClientData clientData)
+{
+    parallelWork((ParallelJob *)clientData);
+    Tcl_ExitThread(TCL_OK);
+    TCL_THREAD_CREATE_RETURN;
+}
+#endif
+
+/* Add match, found in chunk k, after the matches so far. */
+static void
+addMatch(ParallelJob *job, int k, Slot *match)
+{
+    int i;
+
+    for (i = 0; i < job->numSlots; i++) {
+        if (match[i].charPtr) match[i].charIndex += job->offsets[k];
+    }
+    for (i = 0; job->result && i < job->numCaptures; i++) {
+        Tcl_ListObjAppendElement(NULL, job->result,
+            captureObj(&match[i*2], job->curString, job->indices));
+    }
+    memcpy(job->match, match, job->numSlots * sizeof(Slot));
+    job->numMatches++;
+}
+
+/*
+ * Run the searches in chunk k from *pPtr (index *indexPtr), adding
+ * their matches, until one finds a match the worker found. Returns
+ * which of the kept ones that is, or -1 if the searches ran past the
+ * chunk without meeting one.
+ */
+static int
+catchUp(ParallelJob *job, int k, const char **pPtr, int *indexPtr)
+{
+    Chunk *chunk = &job->chunks[k];
+    Context *ctx = chunkContext(job, chunk);
+    Slot *found = ckalloc(job->numSlots * sizeof(Slot));
+    const char *p = *pPtr;
+    int i = 0, met = -1;
+
+    while (execute(ctx, job->regex, p, job->end, *indexPtr - job->offsets[k],
+                   found)) {
+        while (i < chunk->numKept
+               && KEPT_MATCH(job, chunk, i)->charPtr < found[0].charPtr) {
+            i++;
+        }
+        if (i < chunk->numKept
+            && KEPT_MATCH(job, chunk, i)->charPtr == found[0].charPtr) {
+            met = i;
+            break;
+        }
+        addMatch(job, k, found);
+        p = nextStart(job->match, indexPtr);
+        if (p >= job->end || (chunk->limit && p >= chunk->limit)) break;
+    }
+    if (ctx->peakSubs > chunk->peakSubs) chunk->peakSubs = ctx->peakSubs;
+    releaseContext(ctx);
+    ckfree(found);
+    *pPtr = p;
+    return met;
+}
+
+/*
+ * Find the matches regex::match -all would from str (index charIndex)
+ * on numThreads threads, adding each one's numCaptures captures to
+ * result unless it's NULL, and leaving the last one in match. Returns
+ * the number of matches, or -1 if the input is too short to be worth
+ * splitting.
+ */
+static int
+parallelAll(Regex *regex, const char *str, const char *end, int charIndex,
+            int beginning, int numThreads, Tcl_Obj *result, int numCaptures,
+            Tcl_Obj *curString, int indices, Slot *match)
+{
+    ParallelJob job;
+    Chunk *chunk;
+    const char *p, *q;
+    int i, k, posIndex;
+#ifdef TCL_THREADS
+    Tcl_ThreadId *threads;
+    int numStarted, code;
+#endif
+
+#ifdef TCL_THREADS
+    if (numThreads > (end - str) / PARALLEL_MIN_CHUNK) {
+        numThreads = (end - str) / PARALLEL_MIN_CHUNK;
+    }
+#else
+    numThreads = 1;
+#endif
+    if (numThreads < 2) return -1;
+
+    job.regex = regex;
+    job.end = end;
+    job.numSlots = numCaptures ? regex->numSlots : 2;
+    job.keepAll = result != NULL;
+    job.numChunks = numThreads;
+    job.chunks = ckalloc(sizeof(Chunk) * numThreads);
+    for (k = 0; k < numThreads; k++) {
+        chunk = &job.chunks[k];
+        q = str + (end - str) / numThreads * k;
+        while ((*q & 0xC0) == 0x80) q++;
+        chunk->start = q;
+        if (k > 0) job.chunks[k-1].limit = q;
+        chunk->limit = NULL;
+        chunk->charIndex = k ? 0 : charIndex;
+        chunk->beginning = k ? -1 : beginning;
+        chunk->numMatches = chunk->numKept = 0;
+        chunk->capacity = PARALLEL_KEEP;
+        chunk->matches = ckalloc(chunk->capacity * job.numSlots
+                                 * sizeof(Slot));
+        chunk->last = ckalloc(job.numSlots * sizeof(Slot));
+        chunk->peakSubs = 0;
+#ifdef REGEX_STATS
+        memset(&chunk->stats, 0, sizeof(Stats));
+#endif
+    }
+
+#ifdef TCL_THREADS
+    /* The calling thread takes chunks as well. */
+    job.nextChunk = 0;
+    job.mutex = NULL;
+    numStarted = 0;
+    threads = ckalloc(sizeof(Tcl_ThreadId) * numThreads);
+    for (i = 1; i < numThreads; i++) {
+        if (Tcl_CreateThread(&threads[numStarted], parallelWorker, &job,
+                             TCL_THREAD_STACK_DEFAULT,
+                             TCL_THREAD_JOINABLE) == TCL_OK) {
+            numStarted++;
+        }
+    }
+    parallelWork(&job);
+    for (i = 0; i < numStarted; i++) {
+        Tcl_JoinThread(threads[i], &code);
+    }
+    ckfree(threads);
+    Tcl_MutexFinalize(&job.mutex);
+#endif
+
+    job.offsets = ckalloc(sizeof(int) * numThreads);
+    job.offsets[0] = 0;
+    for (k = 1; k < numThreads; k++) {
+        job.offsets[k] = (k == 1 ? charIndex : job.offsets[k-1])
+            + job.chunks[k-1].numChars;
+    }
+    job.result = result;
+    job.numCaptures = numCaptures;
+    job.curString = curString;
+    job.indices = indices;
+    job.match = match;
+    job.numMatches = 0;
+
+    /* Put the chunks' matches together in order, see above. */
+    p = str;
+    posIndex = charIndex;
+    for (k = 0; k < numThreads && p < end; k++) {
+        chunk = &job.chunks[k];
+        if (chunk->limit && p >= chunk->limit) continue;
+        i = 0;
+        if (p > chunk->start && (i = catchUp(&job, k, &p, &posIndex)) < 0) {
+            continue;
+        }
+        if (i >= chunk->numMatches) continue;
+
+        /* In step with the worker from its match i on */
+        if (job.keepAll) {
+            for (; i < chunk->numKept; i++) {
+                addMatch(&job, k, KEPT_MATCH(&job, chunk, i));
+            }
+        } else {
+            job.numMatches += chunk->numMatches - i - 1;
+            addMatch(&job, k, chunk->last);
+        }
+        p = nextStart(match, &posIndex);
+    }
+
+    for (k = 0; k < numThreads; k++) {
+        chunk = &job.chunks[k];
+        if (chunk->peakSubs > regex->peakSubs) {
+            regex->peakSubs = chunk->peakSubs;
+        }
+#ifdef REGEX_STATS
+        regex->stats->searches += chunk->stats.searches;
+        regex->stats->chars += chunk->stats.chars;
+        regex->stats->threads += chunk->stats.threads;
+        regex->stats->follows += chunk->stats.follows;
+        regex->stats->subs += chunk->stats.subs;
+        STAT_MAX(regex->stats, peakThreads, chunk->stats.peakThreads);
+        STAT_MAX(regex->stats, peakSubs, chunk->stats.peakSubs);
+#endif
+        ckfree(chunk->matches);
+        ckfree(chunk->last);
+    }
+    ckfree(job.chunks);
+    ckfree(job.offsets);
+    return job.numMatches;
+}
+
+/* Closely modeled after Tcl_RegexpObjCmd, see comments there. */
+int
+regexMatchCmd(ClientData cd, Tcl_Interp *interp, int objc,
+              Tcl_Obj *const objv[])
+{
+    static const char *const options[] = {
+        "-all",   "-cursor",  "-indices", "-inline",
+        "-start", "-threads", "--",       NULL
+    };
+    enum options {
+        OPT_ALL,   OPT_CURSOR,  OPT_INDICES, OPT_INLINE,
+        OPT_START, OPT_THREADS, OPT_LAST
+    };
+    int i, all, cursor, indices, doinline, start, beginning,
+        charPos, index, length, numMatches, numThreads;
+    char *opt, *str, *end;
+    const char *p;
+    Tcl_Obj *startObj, *obj, *result, *newVal;
+    Regex *regex;
+    Context *ctx;
+    Slot *match;
+    Cursor *cur;
+
+    all = 0;
+    cursor = 0;
+    indices = 0;
+    doinline = 0;
+    numThreads = 1;
+    startObj = NULL;
+    for (i = 1; i < objc; i++) {
+        opt = Tcl_GetString(objv[i]);
+        if (opt[0] != '-') {
+            break;
+        }
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT,
+                                &index) != TCL_OK) {
+            goto optionError;
+        }
+        switch ((enum options)index) {
+        case OPT_ALL:
+            all = 1;
+            break;
+        case OPT_CURSOR:
+            cursor = 1;
+            break;
+        case OPT_INDICES:
+            indices = 1;
+            break;
+        case OPT_INLINE:
+            doinline = 1;
+            break;
+        case OPT_START: {
+            int dummy;
+            if (++i >= objc) {
+                goto endOfForLoop;
+            }
+            if (TclGetIntForIndex(interp, objv[i], 0, &dummy) != TCL_OK) {
+                goto optionError;
+            }
+            if (startObj) {
+                Tcl_DecrRefCount(startObj);
+            }
+            startObj = objv[i];
+            Tcl_IncrRefCount(startObj);
+            break;
+        }
+        case OPT_THREADS:
+            if (++i >= objc) {
+                goto endOfForLoop;
+            }
+            if (Tcl_GetIntFromObj(interp, objv[i], &numThreads) != TCL_OK) {
+                goto optionError;
+            }
+            if (numThreads < 1) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                    "thread count must be positive", -1));
+                goto optionError;
+            }
+            break;
+        case OPT_LAST:
+            i++;
+            goto endOfForLoop;
+        }
+    }
+    
+endOfForLoop:
+    if ((objc - i) < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv,
+                         "?-option ...? exp string ?matchVar? ?subMatchVar ...?");
+optionError:
+        if (startObj) {
+            Tcl_DecrRefCount(startObj);
+        }
+        return TCL_ERROR;
+    }
+    objc -= i;
+    objv += i;
+
+    obj = objv[1];
+    if (cursor) {
+        if (setCursorFromAny(interp, obj) == TCL_ERROR) {
+            return TCL_ERROR;
+        }
+        cur = obj->internalRep.otherValuePtr;
+        charPos = cur->charPos;
+        str = Tcl_GetStringFromObj(cur->string, &length);
+        end = str + length;
+        str += cur->bytePos;
+    } else if (startObj) {
+        TclGetIntForIndex(NULL, startObj, Tcl_GetCharLength(obj), &charPos);
+        Tcl_DecrRefCount(startObj);
+        str = Tcl_GetStringFromObjAt(obj, start, &length, &start);
+        end = str + length;
+        charPos = start; /* adjusted */
+    } else {
+        str = Tcl_GetStringFromObj(obj, &length);
+        end = str + length;
+        charPos = 0;
+    }
+    p = str;
+    beginning = charPos;
+    
+    if (!(regex = getRegexFromObj(interp, objv[0]))) {
+        return TCL_ERROR;
+    }
+
+    objc -= 2;
+    objv += 2;
+
+    if (doinline || objc > regex->numSlots/2) {
+        objc = regex->numSlots/2;
+    }
+
+    /* A literal that every match contains must occur somewhere. */
+    if (regex->requiredLength &&
+        !findLiteral(p, end, (char *)regex->prog + regex->requiredOffset,
+                     regex->requiredLength)) {
+        if (!doinline) {
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+        }
+        return TCL_OK;
+    }
+
+    /* Nothing to capture, so a yes/no answer from the DFA will do. */
+    if (objc == 0 && !all) {
+        int matched = dfaExecute(regex, p, end);
+        if (matched >= 0) {
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(matched));
+            return TCL_OK;
+        }
+    }
+
+    /*
+     * One context serves all the searches of -all, each going on from
+     * where the last match ended. Match variables are only set once
+     * the searches are done, as they only get the last match anyway
+     * and a trace could otherwise pull the regex out from under the
+     * context.
+     */
+    match = ckalloc(regex->numSlots*sizeof(Slot));
+    result = doinline ? Tcl_NewObj() : NULL;
+    if (all && numThreads > 1) {
+        numMatches = parallelAll(regex, p, end, charPos, beginning, numThreads,
+                                 result, objc, cursor ? cur->string : NULL,
+                                 indices, match);
+        if (numMatches >= 0) {
+            goto done;
+        }
+    }
+    ctx = newContext(regex, beginning);
+    if (objc == 0 && !doinline) {
+        /* -all only needs where each match is, without it only whether */
+        narrowContext(ctx, all ? 2 : 0);
+    }
+    numMatches = 0;
+    while (execute(ctx, regex, p, end, charPos, match)) {
+        numMatches++;
+        if (doinline) {
+            for (i = 0; i < objc; i++) {
+                Tcl_ListObjAppendElement(NULL, result,
+                    captureObj(&match[i*2], cursor ? cur->string : NULL,
+                               indices));
+            }
+        }
+        if (!all) {
+            break;
+        }
+        p = match[1].charPtr;
+        charPos = match[1].charIndex;
+        if (match[1].charPtr == match[0].charPtr) {
+            p = Tcl_UtfNext(p);
+            charPos++;
+        }
+        if (p >= end) {
+            break;
+        }
+    }
+    releaseContext(ctx);
+
+done:
+    if (doinline) {
+        Tcl_SetObjResult(interp, result);
+        ckfree(match);
+        return TCL_OK;
+    }
+    for (i = 0; numMatches && i < objc; i++) {
+        newVal = captureObj(&match[i*2], cursor ? cur->string : NULL, indices);
+        if (!Tcl_ObjSetVar2(interp, objv[i], NULL, newVal, TCL_LEAVE_ERR_MSG)) {
+            ckfree(match);
+            return TCL_ERROR;
+        }
+    }
+    ckfree(match);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(numMatches));
+    return TCL_OK;
+}
+
+/*
+ * regex::foreach ?-indices? ?-batch n? ?--? varName exp string script
+ *
+ * Runs script for each match of exp in string, found as by -all, with
+ * varName set to what -inline would give for that match. With -batch,
+ * varName gets a list of up to n of those instead, so the script runs
+ * once per n matches. The searches between two runs of the script
+ * share one context.
+ */
+int
+regexForeachCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                Tcl_Obj *const objv[])
+{
+    static const char *const options[] = {
+        "-batch", "-indices", "--", NULL
+    };
+    enum options {
+        OPT_BATCH, OPT_INDICES, OPT_LAST
+    };
+    int i, n, index, indices, batch, length, charPos, numCaptures, done;
+    int code = TCL_OK;
+    const char *str, *end, *p, *opt;
+    Tcl_Obj *varObj, *expObj, *strObj, *scriptObj, *list, *elem;
+    Regex *regex;
+    Context *ctx;
+    Slot *match = NULL;
+
+    indices = 0;
+    batch = 0;
+    for (i = 1; i < objc; i++) {
+        opt = Tcl_GetString(objv[i]);
+        if (opt[0] != '-') {
+            break;
+        }
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT,
+                                &index) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        switch ((enum options)index) {
+        case OPT_BATCH:
+            if (++i >= objc) {
+                goto endOfForLoop;
+            }
+            if (Tcl_GetIntFromObj(interp, objv[i], &batch) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (batch < 1) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                    "batch size must be positive", -1));
+                return TCL_ERROR;
+            }
+            break;
+        case OPT_INDICES:
+            indices = 1;
+            break;
+        case OPT_LAST:
+            i++;
+            goto endOfForLoop;
+        }
+    }
+
+endOfForLoop:
+    if (objc - i != 4) {
+        Tcl_WrongNumArgs(interp, 1, objv,
+                         "?-option ...? varName exp string script");
+        return TCL_ERROR;
+    }
+    varObj = objv[i];
+    expObj = objv[i+1];
+    strObj = objv[i+2];
+    scriptObj = objv[i+3];
+    Tcl_IncrRefCount(expObj);
+    Tcl_IncrRefCount(strObj);
+    Tcl_IncrRefCount(scriptObj);
+
+    str = Tcl_GetStringFromObj(strObj, &length);
+    end = str + length;
+    p = str;
+    charPos = 0;
+    done = 0;
+    while (!done) {
+        /*
+         * The script may have done anything to exp's internal rep, so
+         * get the regex, and a context for it, anew for each batch.
+         */
+        if (!(regex = getRegexFromObj(interp, expObj))) {
+            code = TCL_ERROR;
+            break;
+        }
+        if (!match) match = ckalloc(regex->numSlots*sizeof(Slot));
+        numCaptures = regex->numSlots/2;
+        ctx = newContext(regex, 0);
+        list = NULL;
+        for (n = 0; n < (batch ? batch : 1); n++) {
+            if (!execute(ctx, regex, p, end, charPos, match)) {
+                done = 1;
+                break;
+            }
+            elem = Tcl_NewListObj(0, NULL);
+            for (i = 0; i < numCaptures; i++) {
+                Tcl_ListObjAppendElement(NULL, elem,
+                    captureObj(&match[i*2], NULL, indices));
+            }
+            if (!batch) {
+                list = elem;
+            } else {
+                if (!list) list = Tcl_NewListObj(0, NULL);
+                Tcl_ListObjAppendElement(NULL, list, elem);
+            }
+
+            p = match[1].charPtr;
+            charPos = match[1].charIndex;
+            if (match[1].charPtr == match[0].charPtr) {
+                p = Tcl_UtfNext(p);
+                charPos++;
+            }
+            if (p >= end) {
+                done = 1;
+                break;
+            }
+        }
+        releaseContext(ctx);
+        if (!list) {
+            break;
+        }
+
+        if (!Tcl_ObjSetVar2(interp, varObj, NULL, list, TCL_LEAVE_ERR_MSG)) {
+            code = TCL_ERROR;
+            break;
+        }
+        code = Tcl_EvalObjEx(interp, scriptObj, 0);
+        if (code == TCL_CONTINUE) {
+            code = TCL_OK;
+        } else if (code == TCL_BREAK) {
+            code = TCL_OK;
+            break;
+        } else if (code == TCL_ERROR) {
+            Tcl_AppendObjToErrorInfo(interp, Tcl_ObjPrintf(
+                "\n    (\"regex::foreach\" body line %d)",
+                Tcl_GetErrorLine(interp)));
+            break;
+        } else if (code != TCL_OK) {
+            break;
+        }
+    }
+
+    if (match) ckfree(match);
+    Tcl_DecrRefCount(expObj);
+    Tcl_DecrRefCount(strObj);
+    Tcl_DecrRefCount(scriptObj);
+    if (code == TCL_OK) {
+        Tcl_ResetResult(interp);
+    }
+    return code;
+}
+
+/*
+ * regex::scan channel exp ?-chunksize n? script
+ *
+ * Reads channel to its end, n chars at a time, and calls the command
+ * prefix script for each match of exp, found as by -all, with two more
+ * arguments: the match as -inline -indices would give it, counting
+ * from where reading started, and as -inline would. A search that
+ * reaches the end of a chunk is suspended and goes on over the next
+ * one, so no input is searched twice. Only the input from where the
+ * search in progress could still have a match begin is kept, as the
+ * script gets its text.
+ */
+#define SCAN_CHUNK_SIZE 65536
+
+int
+regexScanCmd(ClientData cd, Tcl_Interp *interp, int objc,
+             Tcl_Obj *const objv[])
+{
+    static const char *const options[] = {"-chunksize", NULL};
+    Tcl_Channel chan;
+    Tcl_Obj *expObj, *scriptObj, *chunkObj, *cmd, *indexList, *textList;
+    Regex *regex;
+    Context *ctx = NULL;
+    Slot *match;
+    char *buf = NULL, *newBuf;
+    const char *bytes, *keep;
+    int i, n, index, mode, length, chunkSize, matched, kept;
+    int bufLength = 0, bufCapacity = 0, bufIndex = 0, pos = 0, posIndex = 0;
+    int eof = 0, needInput = 1, skip = 0, numMatches = 0, code = TCL_OK;
+
+    if (objc != 4 && objc != 6) {
+        Tcl_WrongNumArgs(interp, 1, objv, "channel exp ?-chunksize n? script");
+        return TCL_ERROR;
+    }
+    chunkSize = SCAN_CHUNK_SIZE;
+    if (objc == 6) {
+        if (Tcl_GetIndexFromObj(interp, objv[3], options, "option", TCL_EXACT,
+                                &index) != TCL_OK
+            || Tcl_GetIntFromObj(interp, objv[4], &chunkSize) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (chunkSize < 1) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                "chunk size must be positive", -1));
+            return TCL_ERROR;
+        }
+    }
+    if (!(chan = Tcl_GetChannel(interp, Tcl_GetString(objv[1]), &mode))) {
+        return TCL_ERROR;
+    }
+    if (!(mode & TCL_READABLE)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "channel \"%s\" wasn't opened for reading", Tcl_GetString(objv[1])));
+        return TCL_ERROR;
+    }
+
+    /*
+     * A search stays suspended over reads, which may run scripts (of a
+     * reflected channel), as the script may run anything: search with
+     * a copy of exp that nothing else can get at.
+     */
+    if (!getRegexFromObj(interp, objv[2])) {
+        return TCL_ERROR;
+    }
+    expObj = Tcl_DuplicateObj(objv[2]);
+    Tcl_IncrRefCount(expObj);
+    regex = getRegexFromObj(interp, expObj);
+    match = ckalloc(regex->numSlots*sizeof(Slot));
+    scriptObj = objv[objc-1];
+    Tcl_IncrRefCount(scriptObj);
+    chunkObj = Tcl_NewObj();
+    Tcl_IncrRefCount(chunkObj);
+
+    for (;;) {
+        if (needInput && !eof) {
+            n = Tcl_ReadChars(chan, chunkObj, chunkSize, 0);
+            if (n < 0) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("error reading \"%s\": %s",
+                    Tcl_GetString(objv[1]), Tcl_PosixError(interp)));
+                code = TCL_ERROR;
+                break;
+            }
+            if (n == 0 && !Tcl_Eof(chan)) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                    "channel \"%s\" must be blocking", Tcl_GetString(objv[1])));
+                code = TCL_ERROR;
+                break;
+            }
+            eof = Tcl_Eof(chan);
+            bytes = Tcl_GetStringFromObj(chunkObj, &length);
+            if (bufLength + length + 1 > bufCapacity) {
+                /*
+                 * Drop what's before the next search, or before what the
+                 * suspended one refers to, and grow if that leaves less
+                 * than half the room, so input is only moved so often.
+                 */
+                keep = buf + pos;
+                if (ctx) keep = suspendedStart(ctx, keep);
+                kept = bufLength - (keep - buf);
+                if (2*(kept + length + 1) > bufCapacity) {
+                    bufCapacity = 2*(kept + length + 1);
+                    newBuf = ckalloc(bufCapacity);
+                    if (kept) memcpy(newBuf, keep, kept);
+                } else {
+                    newBuf = buf;
+                    memmove(newBuf, keep, kept);
+                }
+                if (ctx) moveSuspended(ctx, keep, newBuf);
+                pos -= keep - buf;
+                bufLength = kept;
+                if (newBuf != buf) {
+                    if (buf) ckfree(buf);
+                    buf = newBuf;
+                }
+            }
+            memcpy(buf + bufLength, bytes, length);
+            bufLength += length;
+            bufIndex += n;
+            buf[bufLength] = '\0';
+            needInput = 0;
+        }
+
+        if (!ctx) {
+            /* As with -all, step over an empty match and stop at the end. */
+            if (skip) {
+                if (pos == bufLength) {
+                    if (eof) break;
+                    needInput = 1;
+                    continue;
+                }
+                pos = Tcl_UtfNext(buf + pos) - buf;
+                posIndex++;
+                skip = 0;
+            }
+            if (numMatches && pos == bufLength) {
+                if (eof) break;
+                needInput = 1;
+                continue;
+            }
+            ctx = newContext(regex, 0);
+        }
+        ctx->more = !eof;
+        matched = execute(ctx, regex, buf + pos, buf + bufLength, posIndex,
+                          match);
+        if (ctx->suspended) {
+            pos = bufLength;
+            posIndex = bufIndex;
+            needInput = 1;
+            continue;
+        }
+        releaseContext(ctx);
+        ctx = NULL;
+        if (!matched) {
+            break;
+        }
+
+        numMatches++;
+        indexList = Tcl_NewListObj(0, NULL);
+        textList = Tcl_NewListObj(0, NULL);
+        for (i = 0; i < regex->numSlots/2; i++) {
+            Tcl_ListObjAppendElement(NULL, indexList,
+                                     captureObj(&match[i*2], NULL, 1));
+            Tcl_ListObjAppendElement(NULL, textList,
+                                     captureObj(&match[i*2], NULL, 0));
+        }
+        pos = match[1].charPtr - buf;
+        posIndex = match[1].charIndex;
+        skip = match[1].charPtr == match[0].charPtr;
+
+        cmd = Tcl_DuplicateObj(scriptObj);
+        Tcl_IncrRefCount(cmd);
+        if (Tcl_ListObjAppendElement(interp, cmd, indexList) != TCL_OK
+            || Tcl_ListObjAppendElement(interp, cmd, textList) != TCL_OK) {
+            Tcl_DecrRefCount(indexList);
+            Tcl_DecrRefCount(textList);
+            code = TCL_ERROR;
+        } else {
+            code = Tcl_EvalObjEx(interp, cmd, 0);
+        }
+        Tcl_DecrRefCount(cmd);
+        if (code == TCL_CONTINUE) {
+            code = TCL_OK;
+        } else if (code == TCL_BREAK) {
+            code = TCL_OK;
+            break;
+        } else if (code == TCL_ERROR) {
+            Tcl_AppendObjToErrorInfo(interp, Tcl_NewStringObj(
+                "\n    (\"regex::scan\" script)", -1));
+            break;
+        } else if (code != TCL_OK) {
+            break;
+        }
+    }
+
+    if (ctx) releaseContext(ctx);
+    if (buf) ckfree(buf);
+    ckfree(match);
+    Tcl_DecrRefCount(chunkObj);
+    Tcl_DecrRefCount(expObj);
+    Tcl_DecrRefCount(scriptObj);
+    if (code == TCL_OK) {
+        Tcl_ResetResult(interp);
+    }
+    return code;
+}
+
+/*
+ * Whether regex matches in [str, end), as regex::match would tell
+ * without match vars. *ctxPtr and match are only needed when the DFA
+ * gives up; *ctxPtr is made then and left for the next call to reuse.
+ */
+static int
+matchesIn(Regex *regex, Context **ctxPtr, Slot *match, const char *str,
+          const char *end)
+{
+    int matched;
+
+    if (regex->requiredLength &&
+        !findLiteral(str, end, (char *)regex->prog + regex->requiredOffset,
+                     regex->requiredLength)) {
+        return 0;
+    }
+    if ((matched = dfaExecute(regex, str, end)) >= 0) {
+        return matched;
+    }
+    if (!*ctxPtr) {
+        *ctxPtr = newContext(regex, 0);
+        narrowContext(*ctxPtr, 0);
+    }
+    return execute(*ctxPtr, regex, str, end, 0, match);
+}
+
+/*
+ * Match exp against each element of list. With indices, the result
+ * has the indices of the elements whose match result is want, else
+ * the elements themselves; with want -1, it has each element's result.
+ */
+static int
+matchElements(Tcl_Interp *interp, Tcl_Obj *expObj, Tcl_Obj *listObj,
+              int want, int indices)
+{
+    Tcl_Obj **elems, *result;
+    Regex *regex;
+    Context *ctx = NULL;
+    Slot *match;
+    const char *str;
+    int i, n, length, matched;
+
+    /* Keep exp and list from shimmering each other away. */
+    if (listObj == expObj) {
+        listObj = Tcl_DuplicateObj(listObj);
+    }
+    Tcl_IncrRefCount(listObj);
+    if (!(regex = getRegexFromObj(interp, expObj))
+        || Tcl_ListObjGetElements(interp, listObj, &n, &elems) != TCL_OK) {
+        Tcl_DecrRefCount(listObj);
+        return TCL_ERROR;
+    }
+
+    match = ckalloc(regex->numSlots*sizeof(Slot));
+    result = Tcl_NewObj();
+    for (i = 0; i < n; i++) {
+        str = Tcl_GetStringFromObj(elems[i], &length);
+        matched = matchesIn(regex, &ctx, match, str, str + length);
+        if (want < 0) {
+            Tcl_ListObjAppendElement(NULL, result, Tcl_NewIntObj(matched));
+        } else if (matched == want) {
+            Tcl_ListObjAppendElement(NULL, result,
+                                     indices ? Tcl_NewIntObj(i) : elems[i]);
+        }
+    }
+    if (ctx) releaseContext(ctx);
+    ckfree(match);
+    Tcl_DecrRefCount(listObj);
+    Tcl_SetObjResult(interp, result);
+    return TCL_OK;
+}
+
+/*
+ * regex::filter ?-not? ?-indices? ?--? exp list
+ *
+ * The elements of list that exp matches (or with -not, doesn't), or
+ * with -indices, their indices, found in one pass with one context.
+ */
+int
+regexFilterCmd(ClientData cd, Tcl_Interp *interp, int objc,
+               Tcl_Obj *const objv[])
+{
+    static const char *const options[] = {
+        "-indices", "-not", "--", NULL
+    };
+    enum options {
+        OPT_INDICES, OPT_NOT, OPT_LAST
+    };
+    int i, index, indices, want;
+    const char *opt;
+
+    indices = 0;
+    want = 1;
+    for (i = 1; i < objc; i++) {
+        opt = Tcl_GetString(objv[i]);
+        if (opt[0] != '-') {
+            break;
+        }
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT,
+                                &index) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        switch ((enum options)index) {
+        case OPT_INDICES:
+            indices = 1;
+            break;
+        case OPT_NOT:
+            want = 0;
+            break;
+        case OPT_LAST:
+            i++;
+            goto endOfForLoop;
+        }
+    }
+
+endOfForLoop:
+    if (objc - i != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?-option ...? exp list");
+        return TCL_ERROR;
+    }
+    return matchElements(interp, objv[i], objv[i+1], want, indices);
+}
+
+/*
+ * regex::matchmany exp list
+ *
+ * A 1 or 0 for each element of list as to whether exp matches it, as
+ * regex::match would give.
+ */
+int
+regexMatchmanyCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                  Tcl_Obj *const objv[])
+{
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "exp list");
+        return TCL_ERROR;
+    }
+    return matchElements(interp, objv[1], objv[2], -1, 0);
+}
+
+/*
+ * Stepping the DFA along strings a piece at a time, for tree match in
+ * critbit.c: a piece that many keys start with is stepped over once,
+ * and the state after it may already settle all of them. The states
+ * handed out are the DFA's own, and a flush of its cache frees them;
+ * from then on (or if the DFA has given up on the regex) the walk is
+ * lost, and regexWalkFinish matches whole strings instead.
+ */
+struct RegexWalk {
+    Regex *regex;
+    unsigned int epoch;         /* of the DFA, when the walk started */
+    Context *ctx;               /* for regexWalkFinish, made when needed */
+    Slot *match;
+};
 
-        /* If all threads died on the previous turn, we're done */
-        if (curList->numThreads == 0)
-            break;
+/*
+ * Start a walk with the regex in expObj, which has to keep it until
+ * regexWalkEnd. *statePtr is set to the state at the start of a
+ * string.
+ */
+RegexWalk *
+regexWalkStart(Tcl_Interp *interp, Tcl_Obj *expObj, const void **statePtr)
+{
+    RegexWalk *walk;
+    Regex *regex;
+    Dfa *dfa;
 
-        str += Tcl_UtfToUniChar(str, &ch);
-        charIndex++;
-        for (i = 0; i < curList->numThreads; i++) {
-            pc = curList->list[i].pc;
-            sub = curList->list[i].sub;
-            op = code[pc];
-            switch (op >> 2) {
-            case INST_CHR:
-                pc += Tcl_UtfToUniChar(((char *)(code+pc+1)), &matchChar);
-                if (matchChar != ch) releaseSub(ctx, sub);
-                else if (follow(ctx, pc+1, sub, str, charIndex, str == end)) goto skip;
-                break;
-            case INST_ANY:
-                if (follow(ctx, pc+1, sub, str, charIndex, str == end)) goto skip;
-                break;
-            case INST_BRACKET:
-                invert = op & 1;
-                ascii = op & 2;
-                length = code[pc+1] << 8 | code[pc+2];
-                pc += 3;
-#define BINARY_SEARCH(chartype)                                         \
-                do {                                                    \
-                    int bs, be, pos;                                    \
-                    struct Pair {chartype lo, hi;} *ranges;             \
-                                                                        \
-                    bs = 0;                                             \
-                    be = length-1; /* length >= 1 */                    \
-                    ranges = (struct Pair *)(code+pc);                  \
-                    for (;;) {                                          \
-                        if (bs > be) {                                  \
-                            if (invert) goto found; else break;         \
-                        }                                               \
-                        pos = (bs + be) >> 1;                           \
-                        if (ch < ranges[pos].lo) be = pos-1;            \
-                        else if (ch > ranges[pos].hi) bs = pos+1;       \
-                        else if (invert) break;                         \
-                        else goto found;                                \
-                    }                                                   \
-                } while (0)
-
-                if (ascii) {
-                    size = 1;
-                    BINARY_SEARCH(char);
-                } else {
-                    size = 4;
-                    pc = (pc + 3) & ~3;
-                    BINARY_SEARCH(Tcl_UniChar);
-                }
-#undef BINARY_SEARCH
-                releaseSub(ctx, sub);
-                break;
-found:
-                if (follow(ctx, pc+2*length*size, sub, str, charIndex, str == end))
-                    goto skip;
-                break;
-            default:
-                Tcl_Panic("unknown op %d\n", op>>2);
+    if (!(regex = getRegexFromObj(interp, expObj))) {
+        return NULL;
+    }
+    walk = ckalloc(sizeof(RegexWalk));
+    walk->regex = regex;
+    walk->ctx = NULL;
+    walk->match = ckalloc(regex->numSlots*sizeof(Slot));
+
+    STAT_ADD(regex->stats, dfaSearches, 1);
+    if (!regex->dfa) regex->dfa = newDfa(regex);
+    dfa = regex->dfa;
+    dfa->flushes = 0;
+    *statePtr = NULL;
+    if (dfa->bails <= DFA_MAX_BAILS) {
+        if (!dfa->start) {
+            dfa->seeds[0] = DFA_KEY(dfa, dfa->entry, 0);
+            dfa->start = dfaState(dfa, regex->prog, 1, 1);
+        }
+        *statePtr = dfa->start;
+    }
+    walk->epoch = dfa->epoch;
+    return walk;
+}
+
+/*
+ * Step *statePtr over [str, end), which must end at a char boundary.
+ * Returns REGEX_WALK_MATCH if every string that goes on this way
+ * matches, REGEX_WALK_DEAD if none that goes on past end does,
+ * REGEX_WALK_LOST (see above), or else REGEX_WALK_MORE.
+ */
+int
+regexWalkStep(RegexWalk *walk, const void **statePtr, const char *str,
+              const char *end)
+{
+    Regex *regex = walk->regex;
+    Dfa *dfa = regex->dfa;
+    DState *s = (DState *)*statePtr, *next;
+    const char *prefix = (char *)regex->prog + regex->prefixOffset;
+    const char *q;
+    int prefixLength = regex->unanchored ? regex->prefixLength : 0;
+    Tcl_UniChar ch;
+    int cls;
+
+    if (!s || dfa->epoch != walk->epoch) {
+        return REGEX_WALK_LOST;
+    }
+    while (str < end) {
+        if (s->flags & DSTATE_MATCH) return REGEX_WALK_MATCH;
+        if (s->numPcs == 0 && !dfa->unanchored) return REGEX_WALK_DEAD;
+        if (s == dfa->idle && prefixLength) {
+            /*
+             * As in dfaExecute, but the prefix may also start too
+             * near end to be seen whole.
+             */
+            if (!(q = findLiteral(str, end, prefix, prefixLength))) {
+                q = end - (end - str < prefixLength ? end - str
+                           : prefixLength - 1);
+                while ((*q & 0xC0) == 0x80) q--;
             }
+            if ((str = q) == end) break;
         }
-skip:
-        for (i++; i < curList->numThreads; i++) {
-            releaseSub(ctx, curList->list[i].sub);
+        STAT_ADD(regex->stats, chars, 1);
+        cls = dfaClass(dfa, &str, &ch);
+        if (cls < 0 || !(next = s->next[cls])) {
+            next = dfaStep(dfa, regex->prog, s, ch, cls);
+            if (!next) {
+                dfa->bails++;
+                dfaFlush(dfa);
+            }
+            if (dfa->epoch != walk->epoch) {
+                return REGEX_WALK_LOST;
+            }
         }
+        s = next;
     }
+    *statePtr = s;
+    return (s->flags & DSTATE_MATCH) ? REGEX_WALK_MATCH : REGEX_WALK_MORE;
+}
 
-    sub = ctx->savedMatch;
-    if (ctx->extantSubs - !!sub) {
-        Tcl_Panic("Leaked %d subs", ctx->extantSubs);
+/*
+ * Whether the regex matches in [str, end), as regex::match would tell,
+ * where state is the walk's after [str, from).
+ */
+int
+regexWalkFinish(RegexWalk *walk, const void *state, const char *str,
+                const char *from, const char *end)
+{
+    Regex *regex = walk->regex;
+
+    if (regex->requiredLength &&
+        !findLiteral(str, end, (char *)regex->prog + regex->requiredOffset,
+                     regex->requiredLength)) {
+        return 0;
     }
-    /*ckfree(ctx);*/ /* contextSpace */
-    return sub;
+    switch (regexWalkStep(walk, &state, from, end)) {
+    case REGEX_WALK_MATCH:
+        return 1;
+    case REGEX_WALK_DEAD:
+        return 0;
+    case REGEX_WALK_MORE:
+        return (((const DState *)state)->flags & DSTATE_MATCH_AT_END) != 0;
+    }
+    return matchesIn(regex, &walk->ctx, walk->match, str, end);
 }
 
-#undef curList
-#undef nextList
+void
+regexWalkEnd(RegexWalk *walk)
+{
+    if (walk->ctx) releaseContext(walk->ctx);
+    ckfree(walk->match);
+    ckfree(walk);
+}
 
-/* Closely modeled after Tcl_RegexpObjCmd, see comments there. */
 int
-regexMatchCmd(ClientData cd, Tcl_Interp *interp, int objc,
+regexMultiCmd(ClientData cd, Tcl_Interp *interp, int objc,
+              Tcl_Obj *const objv[])
+{
+    static const char *const options[] = {"create", "match", NULL};
+    enum options {OPT_CREATE, OPT_MATCH};
+    int index, length;
+    char *str;
+    RegexSet *set;
+    Tcl_Obj *result;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "subcommand ?arg ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "subcommand", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch ((enum options)index) {
+    case OPT_CREATE:
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "expList");
+            return TCL_ERROR;
+        }
+        if (!getRegexSetFromObj(interp, objv[2])) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, objv[2]);
+        return TCL_OK;
+    case OPT_MATCH:
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "set string");
+            return TCL_ERROR;
+        }
+        if (!(set = getRegexSetFromObj(interp, objv[2]))) {
+            return TCL_ERROR;
+        }
+        str = Tcl_GetStringFromObj(objv[3], &length);
+        result = Tcl_NewObj();
+        executeSet(set, str, str + length, 0, 0, result);
+        Tcl_SetObjResult(interp, result);
+        return TCL_OK;
+    }
+
+    /* Not reached */
+    return TCL_OK;
+}
+
+/*
+ * regex::bytecode exp: the program the native compiler makes of exp,
+ * which must be the same as what regex::compile returns.
+ */
+int
+regexBytecodeCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                 Tcl_Obj *const objv[])
+{
+    unsigned char *code;
+    int length;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "exp");
+        return TCL_ERROR;
+    }
+    if (!(code = compileRegex(interp, objv[1], &length))) {
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewByteArrayObj(code, length));
+    ckfree(code);
+    return TCL_OK;
+}
+
+/*
+ * regex::cache open file
+ * regex::cache save
+ * regex::cache close
+ * regex::cache info
+ *
+ * The cache of compiled programs, see CacheHeader. open gives how
+ * many regexes file has (0 if it doesn't exist yet, or is for another
+ * compiler), save how many it wrote, and info a dict of the file,
+ * regexes, hits and misses, or an empty list if no cache is open.
+ */
+int
+regexCacheCmd(ClientData cd, Tcl_Interp *interp, int objc,
+              Tcl_Obj *const objv[])
+{
+    static const char *const options[] = {
+        "close", "info", "open", "save", NULL
+    };
+    enum options {OPT_CLOSE, OPT_INFO, OPT_OPEN, OPT_SAVE};
+    Tcl_Obj *result;
+    int index, n;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "subcommand ?arg ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "subcommand", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (objc != (index == OPT_OPEN ? 3 : 2)) {
+        Tcl_WrongNumArgs(interp, 2, objv, index == OPT_OPEN ? "file" : NULL);
+        return TCL_ERROR;
+    }
+
+    switch ((enum options)index) {
+    case OPT_OPEN:
+        if ((n = openCache(interp, Tcl_GetString(objv[2]))) < 0) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(n));
+        return TCL_OK;
+    case OPT_SAVE:
+        if ((n = saveCache(interp)) < 0) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(n));
+        return TCL_OK;
+    case OPT_CLOSE:
+        Tcl_MutexLock(&cacheMutex);
+        closeCache();
+        Tcl_MutexUnlock(&cacheMutex);
+        return TCL_OK;
+    case OPT_INFO:
+        result = Tcl_NewObj();
+        Tcl_MutexLock(&cacheMutex);
+        if (cache.path) {
+            Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("file", -1));
+            Tcl_ListObjAppendElement(NULL, result,
+                                     Tcl_NewStringObj(cache.path, -1));
+            Tcl_ListObjAppendElement(NULL, result,
+                                     Tcl_NewStringObj("regexes", -1));
+            Tcl_ListObjAppendElement(NULL, result,
+                                     Tcl_NewIntObj(cache.entries.numEntries));
+            Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("hits", -1));
+            Tcl_ListObjAppendElement(NULL, result, Tcl_NewWideIntObj(cache.hits));
+            Tcl_ListObjAppendElement(NULL, result,
+                                     Tcl_NewStringObj("misses", -1));
+            Tcl_ListObjAppendElement(NULL, result,
+                                     Tcl_NewWideIntObj(cache.misses));
+        }
+        Tcl_MutexUnlock(&cacheMutex);
+        Tcl_SetObjResult(interp, result);
+        return TCL_OK;
+    }
+
+    /* Not reached */
+    return TCL_OK;
+}
+
+/*
+ * regex::stats ?exp?
+ * regex::stats -reset
+ *
+ * What searches with exp have cost so far in this thread, as a dict
+ * (see Stats), or without exp, a dict of those by pattern for every
+ * regex compiled. -reset starts all counts afresh. A regex spelled
+ * -reset can be given as {(?:-reset)}. Only with REGEX_STATS compiled
+ * in.
+ */
+#ifdef REGEX_STATS
+static Tcl_Obj *
+statsObj(Stats *stats)
+{
+    Tcl_Obj *result = Tcl_NewObj();
+
+#define PUT(field)                                                      \
+    do {                                                                \
+        Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj(#field, -1)); \
+        Tcl_ListObjAppendElement(NULL, result,                          \
+                                 Tcl_NewWideIntObj(stats->field));      \
+    } while (0)
+    PUT(compiles);
+    PUT(compileTime);
+    PUT(searches);
+    PUT(dfaSearches);
+    PUT(chars);
+    PUT(threads);
+    PUT(follows);
+    PUT(subs);
+    PUT(peakThreads);
+    PUT(peakSubs);
+#undef PUT
+    return result;
+}
+#endif
+
+int
+regexStatsCmd(ClientData cd, Tcl_Interp *interp, int objc,
               Tcl_Obj *const objv[])
+{
+#ifdef REGEX_STATS
+    ThreadSpecificData *tsdPtr = getThreadData();
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+    Regex *regex;
+    Tcl_Obj *result;
+#endif
+
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?exp|-reset?");
+        return TCL_ERROR;
+    }
+#ifdef REGEX_STATS
+    if (objc == 2 && strcmp(Tcl_GetString(objv[1]), "-reset") == 0) {
+        for (entry = Tcl_FirstHashEntry(&tsdPtr->stats, &search); entry;
+             entry = Tcl_NextHashEntry(&search)) {
+            memset(Tcl_GetHashValue(entry), 0, sizeof(Stats));
+        }
+        return TCL_OK;
+    }
+    if (objc == 2) {
+        if (!(regex = getRegexFromObj(interp, objv[1]))) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, statsObj(regex->stats));
+        return TCL_OK;
+    }
+    result = Tcl_NewObj();
+    for (entry = Tcl_FirstHashEntry(&tsdPtr->stats, &search); entry;
+         entry = Tcl_NextHashEntry(&search)) {
+        Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj(
+            Tcl_GetHashKey(&tsdPtr->stats, entry), -1));
+        Tcl_ListObjAppendElement(NULL, result,
+                                 statsObj(Tcl_GetHashValue(entry)));
+    }
+    Tcl_SetObjResult(interp, result);
+    return TCL_OK;
+#else
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(
+        "regex statistics not compiled in (build with -DREGEX_STATS)", -1));
+    return TCL_ERROR;
+#endif
+}
+
+/*
+ * One piece of a parsed subSpec: either bytes to copy as they are, or
+ * (if group >= 0) the text of a capture group.
+ */
+typedef struct SubPiece {
+    const char *bytes;
+    int length;
+    int group;
+} SubPiece;
+
+/*
+ * Split subSpec into pieces once, so that substituting a match is
+ * only copying byte ranges. As in regsub, & and \0 stand for the
+ * match, \1 to \9 for the groups, and \& and \\ for & and \.
+ */
+static SubPiece *
+parseSubSpec(const char *spec, int length, int *numPiecesPtr)
+{
+    SubPiece *pieces;
+    const char *p, *end = spec + length, *lit = spec;
+    int n = 0, group;
+
+    /* At most a literal and a group per special char, plus the tail */
+    pieces = ckalloc(sizeof(SubPiece) * (2*length + 1));
+    for (p = spec; p < end; p++) {
+        if (*p == '&') {
+            group = 0;
+        } else if (*p == '\\' && p + 1 < end && p[1] >= '0' && p[1] <= '9') {
+            group = p[1] - '0';
+        } else if (*p == '\\' && p + 1 < end && (p[1] == '&' || p[1] == '\\')) {
+            group = -1;
+        } else {
+            continue;
+        }
+        if (p > lit) {
+            pieces[n].bytes = lit;
+            pieces[n].length = p - lit;
+            pieces[n++].group = -1;
+        }
+        if (group >= 0) {
+            pieces[n].bytes = NULL;
+            pieces[n].length = 0;
+            pieces[n++].group = group;
+        }
+        if (*p == '\\') p++;
+        /* An escaped char starts the next literal. */
+        lit = group < 0 ? p : p + 1;
+    }
+    if (end > lit) {
+        pieces[n].bytes = lit;
+        pieces[n].length = end - lit;
+        pieces[n++].group = -1;
+    }
+    *numPiecesPtr = n;
+    return pieces;
+}
+
+/*
+ * regex::sub ?-all? ?-start index? ?--? exp string subSpec ?varName?
+ *
+ * Modeled after Tcl_RegsubObjCmd. The result is assembled in one
+ * object by copying byte ranges of the input and of subSpec; nothing
+ * is converted to Unicode.
+ */
+int
+regexSubCmd(ClientData cd, Tcl_Interp *interp, int objc,
+            Tcl_Obj *const objv[])
 {
     static const char *const options[] = {
-        "-all",   "-cursor", "-indices", "-inline",
-        "-start", "--",      NULL
+        "-all", "-start", "--", NULL
     };
     enum options {
-        OPT_ALL,   OPT_CURSOR, OPT_INDICES, OPT_INLINE,
-        OPT_START, OPT_LAST
+        OPT_ALL, OPT_START, OPT_LAST
     };
-    int i, all, cursor, indices, doinline, start, beginning,
-        charPos, index, length;
-    char *opt, *str, *end;
-    const char *p;
-    Tcl_Obj *startObj, *obj, *result, *newVal, *range[2];
+    int i, all, index, length, charPos, beginning, numMatches, numPieces;
+    int group, start;
+    const char *str, *end, *p, *spec, *opt;
+    Tcl_Obj *startObj, *strObj, *result;
+    SubPiece *pieces;
     Regex *regex;
-    Sub *sub;
-    Cursor *cur;
+    Context *ctx;
+    Slot *match;
 
     all = 0;
-    cursor = 0;
-    indices = 0;
-    doinline = 0;
     startObj = NULL;
     for (i = 1; i < objc; i++) {
         opt = Tcl_GetString(objv[i]);
@@ -555,34 +5447,21 @@ regexMatchCmd(ClientData cd, Tcl_Interp *interp, int objc,
         }
         if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT,
                                 &index) != TCL_OK) {
-            goto optionError;
+            return TCL_ERROR;
         }
         switch ((enum options)index) {
         case OPT_ALL:
             all = 1;
             break;
-        case OPT_CURSOR:
-            cursor = 1;
-            break;
-        case OPT_INDICES:
-            indices = 1;
-            break;
-        case OPT_INLINE:
-            doinline = 1;
-            break;
         case OPT_START: {
             int dummy;
             if (++i >= objc) {
                 goto endOfForLoop;
             }
             if (TclGetIntForIndex(interp, objv[i], 0, &dummy) != TCL_OK) {
-                goto optionError;
-            }
-            if (startObj) {
-                Tcl_DecrRefCount(startObj);
+                return TCL_ERROR;
             }
             startObj = objv[i];
-            Tcl_IncrRefCount(startObj);
             break;
         }
         case OPT_LAST:
@@ -590,113 +5469,104 @@ regexMatchCmd(ClientData cd, Tcl_Interp *interp, int objc,
             goto endOfForLoop;
         }
     }
-    
+
 endOfForLoop:
-    if ((objc - i) < 2) {
+    if (objc - i < 3 || objc - i > 4) {
         Tcl_WrongNumArgs(interp, 1, objv,
-                         "?-option ...? exp string ?matchVar? ?subMatchVar ...?");
-optionError:
-        if (startObj) {
-            Tcl_DecrRefCount(startObj);
-        }
+                         "?-option ...? exp string subSpec ?varName?");
         return TCL_ERROR;
     }
     objc -= i;
     objv += i;
 
-    obj = objv[1];
-    if (cursor) {
-        if (setCursorFromAny(interp, obj) == TCL_ERROR) {
-            return TCL_ERROR;
-        }
-        cur = obj->internalRep.otherValuePtr;
-        charPos = cur->charPos;
-        str = Tcl_GetStringFromObj(cur->string, &length);
-        end = str + length;
-        str += cur->bytePos;
-    } else if (startObj) {
-        TclGetIntForIndex(NULL, startObj, Tcl_GetCharLength(obj), &charPos);
-        Tcl_DecrRefCount(startObj);
-        str = Tcl_GetStringFromObjAt(obj, start, &length, &start);
-        end = str + length;
-        charPos = start; /* adjusted */
-    } else {
-        str = Tcl_GetStringFromObj(obj, &length);
-        end = str + length;
-        charPos = 0;
-    }
-    p = str;
-    beginning = charPos;
-    
     if (!(regex = getRegexFromObj(interp, objv[0]))) {
         return TCL_ERROR;
     }
+    strObj = objv[1];
+    str = Tcl_GetStringFromObj(strObj, &length);
+    end = str + length;
+    charPos = 0;
+    result = NULL;
+    numMatches = 0;
+    if (startObj) {
+        int numChars = Tcl_GetCharLength(strObj);
 
-    objc -= 2;
-    objv += 2;
+        TclGetIntForIndex(NULL, startObj, numChars, &start);
+        if (start > numChars) {
+            /* Past the end, where not even an empty match is found */
+            goto done;
+        }
+        p = Tcl_GetStringFromObjAt(strObj, start, &length, &charPos);
+    } else {
+        p = str;
+    }
+    beginning = charPos;
 
-    if (doinline || objc > regex->numSlots/2) {
-        objc = regex->numSlots/2;
+    if (regex->requiredLength &&
+        !findLiteral(p, end, (char *)regex->prog + regex->requiredOffset,
+                     regex->requiredLength)) {
+        goto done;
     }
 
-    for (;;) {
-        sub = execute(regex, p, end, charPos, beginning);
-        if (!sub) {
-            if (all <= 1) {
-                if (!doinline) {
-                    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-                }
-                return TCL_OK;
-            }
-            break;
-        }
+    spec = Tcl_GetStringFromObj(objv[2], &length);
+    pieces = parseSubSpec(spec, length, &numPieces);
+    match = ckalloc(regex->numSlots*sizeof(Slot));
+    ctx = newContext(regex, beginning);
 
-        if (doinline && all <= 1) {
+    /*
+     * As in regsub, an empty match copies the char after it and the
+     * search goes on from there; one is also tried at the end.
+     */
+    while (p <= end && execute(ctx, regex, p, end, charPos, match)) {
+        if (!result) {
             result = Tcl_NewObj();
+            Tcl_AppendToObj(result, str, p - str);
         }
-        for (i = 0; i < objc; i++) {
-            Slot *s = &sub->slots[i*2];
-            if (cursor) {
-                char *base = cur->string->bytes;
-                range[0] = newCursorObj(cur->string, s[0].charPtr-base, s[0].charIndex);
-                range[1] = newCursorObj(cur->string, s[1].charPtr-base, s[1].charIndex);
-                newVal = Tcl_NewListObj(2, range);
-            } else if (indices) {
-                range[0] = Tcl_NewLongObj(s[0].charIndex);
-                range[1] = Tcl_NewLongObj(s[1].charIndex-1);
-                newVal = Tcl_NewListObj(2, range);
-            } else {
-                newVal = Tcl_NewStringObjWithCharLength(s[0].charPtr,
-                    s[1].charPtr-s[0].charPtr,
-                    s[1].charIndex-s[0].charIndex);
-            }
-            if (doinline) {
-                Tcl_ListObjAppendElement(NULL, result, newVal);
-            } else if (!Tcl_ObjSetVar2(interp, objv[i], NULL, newVal, TCL_LEAVE_ERR_MSG)) {
-                return TCL_ERROR;
+        Tcl_AppendToObj(result, p, match[0].charPtr - p);
+        for (i = 0; i < numPieces; i++) {
+            group = pieces[i].group;
+            if (group < 0) {
+                Tcl_AppendToObj(result, pieces[i].bytes, pieces[i].length);
+            } else if (2*group < regex->numSlots && match[2*group].charPtr) {
+                Tcl_AppendToObj(result, match[2*group].charPtr,
+                    match[2*group+1].charPtr - match[2*group].charPtr);
             }
         }
+        numMatches++;
 
-        if (all == 0) {
-            break;
-        }
-
-        p = sub->slots[1].charPtr;
-        charPos = sub->slots[1].charIndex;
-        if (sub->slots[1].charPtr == sub->slots[0].charPtr) {
+        p = match[1].charPtr;
+        charPos = match[1].charIndex;
+        if (match[1].charPtr == match[0].charPtr) {
+            if (p == end) {
+                p++;
+                break;
+            }
+            Tcl_AppendToObj(result, p, Tcl_UtfNext(p) - p);
             p = Tcl_UtfNext(p);
             charPos++;
         }
-        all++;
-        if (p >= end) {
+        if (!all) {
             break;
         }
     }
-    
-    if (doinline) {
-        Tcl_SetObjResult(interp, result);
+    releaseContext(ctx);
+    if (result && p < end) {
+        Tcl_AppendToObj(result, p, end - p);
+    }
+    ckfree(match);
+    ckfree(pieces);
+
+done:
+    if (!result) {
+        result = strObj;
+    }
+    if (objc == 4) {
+        if (!Tcl_ObjSetVar2(interp, objv[3], NULL, result, TCL_LEAVE_ERR_MSG)) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(numMatches));
     } else {
-        Tcl_SetObjResult(interp, Tcl_NewIntObj(all ? all-1 : 1));
+        Tcl_SetObjResult(interp, result);
     }
     return TCL_OK;
 }
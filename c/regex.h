@@ -0,0 +1,25 @@
+#ifndef REGEX_H
+#define REGEX_H
+
+#include <tcl.h>
+
+/*
+ * Stepping a regex's DFA along strings a piece at a time, as tree
+ * match does over the bytes the keys of a subtree share. See regex.c.
+ */
+typedef struct RegexWalk RegexWalk;
+
+enum {
+    REGEX_WALK_MORE,    /* depends on what follows */
+    REGEX_WALK_MATCH,   /* every string going on from here matches */
+    REGEX_WALK_DEAD,    /* none does */
+    REGEX_WALK_LOST     /* the state is gone */
+};
+
+RegexWalk *regexWalkStart(Tcl_Interp *, Tcl_Obj *, const void **);
+int regexWalkStep(RegexWalk *, const void **, const char *, const char *);
+int regexWalkFinish(RegexWalk *, const void *, const char *, const char *,
+                    const char *);
+void regexWalkEnd(RegexWalk *);
+
+#endif
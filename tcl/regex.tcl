@@ -1,22 +1,26 @@
 namespace eval regex {
   # Compilation-related variabels
   variable capture_count 0
+  variable in_loop 0
   variable next_label 0
   variable blocks {}
   variable forward {}
   variable pos {}
   variable reverse_pos {}
   variable buf {}
-  variable insts {chr goto split save any end start match bracket}
+  variable insts {chr goto split save any end start match bracket hint repeat again string}
 }
 
+# The C side has commands regex::foreach and regex::scan, which would
+# shadow the builtins here, so those are called as ::foreach and ::scan.
+
 proc regex::dbg {msg} {debug [uplevel 1 [list subst $msg]]}
 proc regex::dbg {msg} {}
 
 proc regex::fold {op ls} {
   if {[llength $ls] == 0} {return empty}
   set exp [lindex $ls 0]
-  foreach x [lrange $ls 1 end] {set exp [list $op $exp $x]}
+  ::foreach x [lrange $ls 1 end] {set exp [list $op $exp $x]}
   return $exp
 }
 
@@ -120,9 +124,40 @@ proc regex::parse_int {in_var} {
   set res ""
   while {[string is digit -strict [cursor index $in]]} {append res [cursor consume in 1]}
   if {$res eq ""} {parse::expected "integer" in}
+  # 0xffff stands for no upper bound in the repeat instruction
+  if {$res > 0xfffe} {parse::err "count too large" in}
   return $res
 }
 
+proc regex::has_repeat {ex} {
+  switch [lindex $ex 0] {
+    repeat {return 1}
+    sub - rep - rep1 {has_repeat [lindex $ex 1]}
+    cat - alt {expr {[has_repeat [lindex $ex 1]] || [has_repeat [lindex $ex 2]]}}
+    default {return 0}
+  }
+}
+
+# Length of every match of ex, -1 if they differ
+proc regex::width {ex} {
+  lassign $ex h a b
+  switch $h {
+    chr - any - bracket {return 1}
+    empty - start - end {return 0}
+    sub {width $a}
+    cat {
+      set x [width $a]
+      set y [width $b]
+      expr {$x < 0 || $y < 0 ? -1 : $x + $y}
+    }
+    alt {
+      set x [width $a]
+      expr {$x == [width $b] ? $x : -1}
+    }
+    default {return -1}
+  }
+}
+
 proc regex::parse_quantified {in_var} {
   upvar 1 $in_var in
 
@@ -135,25 +170,38 @@ proc regex::parse_quantified {in_var} {
       * {cursor incr in; set exp [list rep $exp [parse_greedy in]]}
       ? {cursor incr in; set exp [list alt $exp empty [parse_greedy in]]}
       "\{" {
-        # Simplify counted expressions by expansion
         lassign [parse::seq {
           ign {char "\{"} - regex::parse_int
           - {opt {cat {{char ","} {opt regex::parse_int}}}}
           ign {char "\}"} - regex::parse_greedy
         } in] lo hi greedy
-        set min [fold cat [lmap x [iota $lo] {id $exp}]]
         if {[llength $hi] == 0} {
-          set exp $min
+          set hi $lo
         } elseif {[llength [lindex $hi 0 1]] == 0} {
-          set exp [list cat $min [list rep $exp $greedy]]
+          set hi -1; # no upper bound
         } elseif {[set hi [lindex $hi 0 1 0]] < $lo} {
           parse::err "bad range \[$lo, $hi\]" in
+        }
+        if {max($lo, $hi) > 8 && [width $exp] > 0 && ![has_repeat $exp]} {
+          # Counted loop; the engine keeps a count per thread. Loops
+          # don't nest, so an outer count still gets expanded. So does
+          # a body of varying length, where the expansion's choice of
+          # the count up front gives other submatches.
+          set exp [list repeat $exp $lo $hi $greedy]
         } else {
-          set tail [list alt $exp empty $greedy]
-          for {set i $lo} {$i+1 < $hi} {incr i} {
-            set tail [list alt [list cat $tail $exp] empty $greedy]
+          # Simplify counted expressions by expansion
+          set min [fold cat [lmap x [iota $lo] {id $exp}]]
+          if {$hi == $lo} {
+            set exp $min
+          } elseif {$hi < 0} {
+            set exp [list cat $min [list rep $exp $greedy]]
+          } else {
+            set tail [list alt $exp empty $greedy]
+            for {set i $lo} {$i+1 < $hi} {incr i} {
+              set tail [list alt [list cat $tail $exp] empty $greedy]
+            }
+            set exp [list cat $min $tail]
           }
-          set exp [list cat $min $tail]
         }
       }
     }
@@ -170,9 +218,11 @@ proc regex::compile {str {print 0}} {
   variable next_label
   variable buf
   variable capture_count
+  variable in_loop
 
   # Parse regex
   set capture_count 0
+  set in_loop 0
   set in [list $str 0]
   set ast [parse::top {parse::seq {sel regex::parse_exp - eof} in}]
   dbg {parsed $ast}
@@ -182,10 +232,12 @@ proc regex::compile {str {print 0}} {
   while {[lindex $first 0] eq "cat"} {set first [lindex $first 1]}
   set anchored [expr {[lindex $first 0] eq "start"}] 
 
-  # Add implicit capture of entire match and implicit ".*?" at
-  # beginning of regex.
+  # Add implicit capture of entire match. The implicit ".*?" at the
+  # beginning of an unanchored regex is left to the engine (see the
+  # hint header), which can then skip to occurrences of the literal
+  # prefix.
   set ast [list sub $ast 0]
-  if {!$anchored}  {set ast [list cat {rep any 0} $ast]}
+  lassign [literals $ast] prefix required
 
   # Compile/linearize regex.
   set blocks {Lm match}
@@ -213,7 +265,7 @@ proc regex::compile {str {print 0}} {
     }
     if {[llength $queue] > 0} {
       tree set forward $from $to
-      foreach l $queue {tree set forward $l $to}
+      ::foreach l $queue {tree set forward $l $to}
     }
   }
 
@@ -231,7 +283,7 @@ proc regex::compile {str {print 0}} {
       # it starting from the expression).
       set last $exp
       set indices {}
-      while {[lindex $last 0] ni {match goto split}} {
+      while {[lindex $last 0] ni {match goto split again}} {
         lappend indices [expr {[llength $last]-1}]
         set last [lindex $last end]
       }
@@ -254,7 +306,7 @@ proc regex::compile {str {print 0}} {
     }
 
     # Fold the trace together using the calculated indices
-    foreach x [lreverse [kill trace]] {
+    ::foreach x [lreverse [kill trace]] {
       lassign $x parent indices
       lset parent $indices $exp
       set exp $parent
@@ -270,24 +322,80 @@ proc regex::compile {str {print 0}} {
   dbg {traces is $traces}
   set buf {}
   set pos {}
-  foreach b $traces {asm $b}; # pass 1
+  emit_hint [expr {!$anchored}] $prefix $required
+  ::foreach b $traces {asm $b}; # pass 1
   set reverse_pos {}
   if {$print} {
     # Prepare PC->label map for disassembly
     tree for {label offset} $pos {tree set reverse_pos $offset $label}
+    puts [format "%-4s%5d %s" "" 0 [list hint [expr {!$anchored}] $prefix $required]]
   }
   set buf {}
-  foreach b $traces {asm $b $print}; # pass 2
+  emit_hint [expr {!$anchored}] $prefix $required
+  ::foreach b $traces {asm $b $print}; # pass 2
   return $buf
 }
 
+# Flatten the top-level sequence of a regex
+proc regex::sequence {ex} {
+  switch [lindex $ex 0] {
+    cat {concat [sequence [lindex $ex 1]] [sequence [lindex $ex 2]]}
+    sub {sequence [lindex $ex 1]}
+    default {list $ex}
+  }
+}
+
+# Find the literal every match starts with and the longest literal
+# every match contains after that, for the engine to search for
+# before running the regex. Returns the two, empty if there are none.
+proc regex::literals {ex} {
+  set runs {}
+  set run ""
+  ::foreach x [sequence $ex] {
+    if {[lindex $x 0] eq "chr" && [lindex $x 1] ne "\0"} {
+      append run [lindex $x 1]
+    } else {
+      lappend runs [kill run]
+    }
+  }
+  lappend runs $run
+  set prefix [string range [lindex $runs 0] 0 255]
+  set required ""
+  ::foreach r [lrange $runs 1 end] {
+    if {[string length $r] > [string length $required]} {set required $r}
+  }
+  list $prefix [string range $required 0 255]
+}
+
+# Whether chr c can go in a string instruction, which the engine
+# compares bytewise against the input: not NUL, which Tcl keeps as two
+# bytes, nor half of a surrogate pair.
+proc regex::stringable {c} {
+  set n [::scan $c %c]
+  expr {$n != 0 && ($n < 0xd800 || $n > 0xdfff)}
+}
+
 # CPS-transform regex
 proc regex::comp {ex k} {
   variable blocks
+  variable in_loop
   lassign $ex h a b
   switch $h {
     empty {return $k}
-    chr - any - bracket - start - end {lappend ex $k}
+    chr {
+      # Merge a run of chars into one string instruction of at most
+      # 255 bytes. Not in a counted loop, where the engine's per thread
+      # count is taken by the loop.
+      if {!$in_loop && [lindex $k 0] in {chr str} && [stringable $a]
+          && [stringable [string index [lindex $k 1] 0]]} {
+        set s $a[lindex $k 1]
+        if {[string length [encoding convertto utf-8 $s]] <= 255} {
+          return [list str $s [lindex $k end]]
+        }
+      }
+      lappend ex $k
+    }
+    any - bracket - start - end {lappend ex $k}
     sub {list save [expr {$b*2}] [comp $a [list save [expr {$b*2+1}] $k]]}
     cat {comp $a [comp $b $k]}
     alt {
@@ -306,6 +414,15 @@ proc regex::comp {ex k} {
       gen_label L g
       set ret [list label $L [comp $a [split $g $k $b]]]
     }
+    repeat {
+      # L: repeat lo hi greedy exit; body; again L
+      gen_label L g
+      set exit [labelof $k]
+      incr in_loop
+      set body [comp $a [list again $L]]
+      incr in_loop -1
+      list label $L [list repeat $b [lindex $ex 3] [lindex $ex 4] $exit $body]
+    }
     default {error "unhandled $h"}
   }
 }
@@ -341,24 +458,37 @@ proc regex::asm {ex {print 0}} {
     puts -nonewline [format "%-4s%5d " \
                          [tree getor $reverse_pos [string length $buf] ""] [string length $buf]]
     puts [lrange $ex 0 \
-              [expr {[llength $ex]-1-([lindex $ex 0] ni {goto split match})}]]
+              [expr {[llength $ex]-1-([lindex $ex 0] ni {goto split match again})}]]
   }
     
   switch $op {
     any - start - end - match {emit_op $op}
     chr {emit_op chr; emit [encoding convertto utf-8 [lindex $ex 1]]}
+    str {
+      set b [encoding convertto utf-8 [lindex $ex 1]]
+      emit_op string
+      emit [binary format c [string length $b]]
+      emit $b
+    }
     save {emit_op save; emit [binary format S [lindex $ex 1]]}
     goto {emit_op goto; emit_addr [lindex $ex 1]}
     split {emit_op split; emit_addr [lindex $ex 1]; emit_addr [lindex $ex 2]}
     label {tree set pos [lindex $ex 1] [string length $buf]}
     bracket {asm_bracket [lindex $ex 1] [lindex $ex 2]}
+    repeat {
+      lassign $ex - lo hi greedy exit
+      emit_op repeat [expr {!$greedy}]
+      emit [binary format SS $lo [expr {$hi < 0 ? 0xffff : $hi}]]
+      emit_addr $exit
+    }
+    again {emit_op again; emit_addr [lindex $ex 1]}
     default {error "unhandled op $op"}
   }
-  if {$op ni {match goto split}} {asm [lindex $ex end] $print}
+  if {$op ni {match goto split again}} {asm [lindex $ex end] $print}
 }
 
 proc regex::asm_bracket {invert chars} {
-  set ascii 2; # bit flag for op
+  variable buf
 
   set in [list $chars 0]
   set ls [parse::top {parse::rep1 {seq {
@@ -367,13 +497,11 @@ proc regex::asm_bracket {invert chars} {
 
   # Combine chars and ranges into only ranges.
   set ranges {}
-  foreach x $ls {
-    set lo [scan [lindex $x 0] %c]
-    if {$lo > 127} {set ascii 0}
+  ::foreach x $ls {
+    set lo [::scan [lindex $x 0] %c]
     set hi $lo
     if {[llength $x] == 2} {
-      set hi [scan [lindex $x 1] %c]
-      if {$hi > 127} {set ascii 0}
+      set hi [::scan [lindex $x 1] %c]
       assert {$hi >= $lo}
     }
     lappend ranges $lo $hi
@@ -384,25 +512,32 @@ proc regex::asm_bracket {invert chars} {
   set ranges [lsort -integer -stride 2 [kill ranges]]
   set merged [list [lindex $ranges 0]]; # low value of first range
   set limit [lindex $ranges 1]; # high value of first range
-  foreach {lo hi} [lrange $ranges 2 end] {
+  ::foreach {lo hi} [lrange $ranges 2 end] {
     if {$lo > $limit} {lappend merged $limit $lo}
-    set limit $hi
+    if {$hi > $limit} {set limit $hi}
   }
   lappend merged $limit
   dbg {merged ranges is $merged}
 
-  emit_op bracket [expr {$ascii | $invert}]
-  emit [binary format S [expr {[llength $merged]/2}]]
-  if {$ascii} {
-    set f c
-  } else {
-    set f nu
-    
+  # Chars below 256 go in a bitmap; only what lies above is left as
+  # ranges, clipped to start at 256.
+  set bits [lrepeat 256 0]
+  set wide {}
+  ::foreach {lo hi} $merged {
+    for {set c $lo} {$c <= $hi && $c < 256} {incr c} {lset bits $c 1}
+    if {$hi >= 256} {lappend wide [expr {max($lo, 256)}] $hi}
+  }
+
+  emit_op bracket [expr {([llength $wide] ? 0 : 2) | $invert}]
+  emit [binary format b256 [join $bits ""]]
+  if {[llength $wide]} {
+    emit [binary format S [expr {[llength $wide]/2}]]
+
     # Align code point array to 32-bit boundary.
     set mod [expr {[string length $buf] & 3}]
     if {$mod != 0} {emit [string repeat \0 [expr {4-$mod}]]}
+    emit [binary format nu[llength $wide] $wide]
   }
-  emit [binary format $f[llength $merged] $merged]
 }
 
 proc regex::emit {code} {
@@ -417,6 +552,17 @@ proc regex::emit_op {o {flags 0}} {
   emit [binary format c [expr {$n<<2 | $flags}]]
 }
 
+# Header telling the engine whether to act as if the regex began with
+# ".*?" and which literals to look for (see literals).
+proc regex::emit_hint {unanchored prefix required} {
+  emit_op hint $unanchored
+  ::foreach lit [list $prefix $required] {
+    set b [encoding convertto utf-8 $lit]
+    emit [binary format S [string length $b]]
+    emit $b
+  }
+}
+
 proc regex::emit_addr {label} {
   variable forward
   variable pos
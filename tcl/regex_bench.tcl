@@ -0,0 +1,283 @@
+# Benchmark of regex::match against the builtin regexp.
+#
+#   tclsh tcl/regex_bench.tcl ?-load {file ?prefix?}? ?-sizes {1K 64K 1M}?
+#       ?-inputs {ascii bmp astral}? ?-cases pattern? ?-time ms?
+#       ?-save file? ?-baseline file? ?-tolerance fraction?
+#
+# Runs each case of the corpus below over generated text of each kind
+# and size, and prints throughput in MB/s for regex::match, and for
+# regexp both on a string it sees for the first time ("cold", which
+# includes converting the string to Unicode) and on one it has already
+# converted ("warm"). Sizes take a K, M or G suffix; up to 100M is
+# reasonable. Every run gets a fresh copy of the input, made outside
+# the timing.
+#
+# mallocs per search are shown when Tcl is built with TCL_MEM_DEBUG
+# (the memory command), and subs per search when the extension is
+# built with REGEX_STATS (regex::stats); "-" otherwise.
+#
+# As a regression gate: -save writes the regex::match throughput of
+# every case, and -baseline compares against such a file, flagging a
+# case more than -tolerance (default 0.1) slower. The script exits
+# with status 1 if any case regressed, or if the two engines disagree
+# on a result.
+
+namespace eval regex_bench {
+  variable options {
+    -load {}
+    -sizes {1K 64K 1M}
+    -inputs {ascii bmp astral}
+    -cases *
+    -time 200
+    -save {}
+    -baseline {}
+    -tolerance 0.1
+  }
+
+  # name mode pattern. Mode is what is compared between the engines:
+  # match (whether there is one), all (how many) or inline (-all
+  # -inline, so the captures are made). Classes are spelled out, as
+  # \w and friends are ASCII only in regex::match.
+  variable corpus {
+    literal-rare     all    {zyzzyva}
+    literal-common   all    {the}
+    literal-bmp      all    "\u0436\u0438\u0437\u043d\u044c"
+    class-digits     all    {[0-9]+}
+    class-word       all    {[A-Za-z0-9_]+}
+    class-nonascii   all    {[^\x00-\x7f]+}
+    alternation      all    {alpha|beta|gamma|delta|epsilon}
+    alt-prefix       all    {inter(?:nal|val|view|face)}
+    nested           all    {(?:[a-z]+ ){3}[0-9]+}
+    nested-star      all    {(?:(?:a|b)+c)*d}
+    email            all    {[a-z]+@[a-z]+\.(?:com|org)}
+    captures         inline {([a-z]+)=([0-9]+)}
+    exists-late      match  {a.*zyzzyva}
+    exists-none      match  {q[0-9]{3}x}
+  }
+
+  variable ascii_words {
+    the of and to in is that for it as with was on be by at this
+    alpha beta gamma delta epsilon internal interval interview interface
+    value key=1024 x=7 count=42 bob@example.com ann@tcl.org 2023 17 3.14
+    lorem ipsum dolor sit amet aab abc abcd ababcd
+  }
+}
+
+# Words of the given kind: ASCII only, or a mix with characters from
+# the BMP, or with characters beyond it (which Tcl 8.6 keeps as
+# surrogate pairs, so made from UTF-8 to get them either way).
+proc regex_bench::words {kind} {
+  variable ascii_words
+  set words $ascii_words
+  switch $kind {
+    ascii {}
+    bmp {
+      lappend words \
+          "\u0436\u0438\u0437\u043d\u044c" "\u043c\u0438\u0440" \
+          "\u03b1\u03b2\u03b3" "\u03bb\u03cc\u03b3\u03bf\u03c2" \
+          "\u6587\u5b57\u5217" "\u6b63\u898f\u8868\u73fe" \
+          "na\u00efve" "caf\u00e9" "\u00fcber=9"
+      set words [concat $words [lrange $words end-8 end]]
+    }
+    astral {
+      lappend words {*}[lmap hex {
+        f09f9880 f09f8e89f09f8e89 f09d849e f0a0aeb7 f09f9a80 61f09f988062
+      } {encoding convertfrom utf-8 [binary decode hex $hex]}]
+    }
+    default {error "unknown input kind \"$kind\""}
+  }
+  return $words
+}
+
+# About size bytes of text of kind: lines of random words, the same
+# for every run. The last word is the one literal-rare looks for.
+proc regex_bench::input {kind size} {
+  variable blocks
+  if {![info exists blocks($kind)]} {
+    expr {srand(1)}
+    set words [words $kind]
+    set n [llength $words]
+    set blocks($kind) {}
+    for {set i 0} {$i < 64} {incr i} {
+      set block {}
+      set line {}
+      while {[string bytelength $block] < 1024} {
+        lappend line [lindex $words [expr {int(rand()*$n)}]]
+        if {[llength $line] == 12} {
+          append block [join $line] \n
+          set line {}
+        }
+      }
+      lappend blocks($kind) $block
+    }
+  }
+  set blockSize [string bytelength [lindex $blocks($kind) 0]]
+  if {$size < 64 * $blockSize} {
+    set n [expr {max(1, ($size + $blockSize/2) / $blockSize)}]
+    set text [join [lrange $blocks($kind) 0 $n-1] ""]
+  } else {
+    set all [join $blocks($kind) ""]
+    set n [expr {max(1, ($size + [string bytelength $all]/2)
+                 / [string bytelength $all])}]
+    set text [string repeat $all $n]
+  }
+  append text zyzzyva\n
+  return $text
+}
+
+proc regex_bench::parse_size {size} {
+  if {![regexp {^([0-9]+)([KMG]?)$} $size -> n unit]} {
+    error "bad size \"$size\""
+  }
+  return [expr {$n * [dict get {"" 1 K 1024 M 1048576 G 1073741824} $unit]}]
+}
+
+proc regex_bench::format_size {bytes} {
+  ::foreach {unit div} {G 1073741824 M 1048576 K 1024} {
+    if {$bytes >= $div} {return [format %.3g$unit [expr {double($bytes)/$div}]]}
+  }
+  return $bytes
+}
+
+# What a search gives, in a form both engines agree on.
+proc regex_bench::search {engine mode pattern string} {
+  switch $mode {
+    match  {return [$engine $pattern $string]}
+    all    {return [$engine -all $pattern $string]}
+    inline {return [llength [$engine -all -inline $pattern $string]]}
+  }
+}
+
+proc regex_bench::mallocs {} {
+  if {[catch {memory info} info]} {return {}}
+  regexp {total mallocs\s+([0-9]+)} $info -> n
+  return $n
+}
+
+proc regex_bench::subs {pattern} {
+  if {[catch {regex::stats $pattern} stats]} {return {}}
+  return [dict get $stats subs]
+}
+
+# Runs engine over fresh copies of bytes (the input as UTF-8) until
+# the time budget is spent, at least once. Small inputs are searched
+# in batches of copies, so a run is long enough for the clock. Unless
+# cold, each copy is searched once beforehand, so regexp has the
+# Unicode already. Returns the fastest search in microseconds, the
+# result, and mallocs and subs per search ({} if not known).
+proc regex_bench::measure {engine mode pattern bytes cold} {
+  variable options
+  set budget [expr {[dict get $options -time] * 1000}]
+  set batch [expr {max(1, min(1000, 1048576 / [string length $bytes]))}]
+  set best {}
+  set spent 0
+  set runs 0
+  set mallocs 0
+  set subs 0
+  while {$runs == 0 || $spent < $budget} {
+    set copies {}
+    for {set i 0} {$i < $batch} {incr i} {
+      lappend copies [encoding convertfrom utf-8 $bytes]
+    }
+    if {!$cold} {
+      ::foreach string $copies {search $engine $mode $pattern $string}
+    }
+    set m [mallocs]
+    set s [subs $pattern]
+    set start [clock microseconds]
+    ::foreach string $copies {
+      set result [search $engine $mode $pattern $string]
+    }
+    set t [expr {[clock microseconds] - $start}]
+    if {$m ne {}} {set mallocs [expr {$mallocs + [mallocs] - $m}]}
+    if {$s ne {}} {set subs [expr {$subs + [subs $pattern] - $s}]}
+    unset copies string
+    if {$best eq {} || $t < $best} {set best $t}
+    incr spent [expr {max($t, 1)}]
+    incr runs
+  }
+  set n [expr {$runs * $batch}]
+  if {$m ne {}} {set mallocs [expr {$mallocs / $n}]} else {set mallocs {}}
+  if {$s ne {}} {set subs [expr {$subs / $n}]} else {set subs {}}
+  return [list [expr {max($best, 1) / double($batch)}] $result $mallocs $subs]
+}
+
+proc regex_bench::mbps {bytes micros} {
+  return [format %.1f [expr {$bytes / 1048576.0 / ($micros / 1e6)}]]
+}
+
+proc regex_bench::run {argv} {
+  variable options
+  variable corpus
+  if {[llength $argv] % 2} {error "options must come in pairs"}
+  ::foreach {opt value} $argv {
+    if {![dict exists $options $opt]} {
+      error "bad option \"$opt\": must be [join [dict keys $options] {, }]"
+    }
+    dict set options $opt $value
+  }
+  if {[dict get $options -load] ne {}} {
+    uplevel #0 [list load {*}[dict get $options -load]]
+  }
+  if {[info commands ::regex::match] eq {}} {
+    error "regex::match is not loaded (see -load)"
+  }
+  set baseline {}
+  if {[dict get $options -baseline] ne {}} {
+    set chan [open [dict get $options -baseline]]
+    set baseline [read $chan]
+    close $chan
+  }
+  set tolerance [dict get $options -tolerance]
+
+  set results {}
+  set failed 0
+  puts [format "%-16s %-6s %6s %9s %9s %9s %7s %8s %8s  %s" \
+            case input size regex cold warm speedup mallocs subs note]
+  ::foreach kind [dict get $options -inputs] {
+    ::foreach size [dict get $options -sizes] {
+      set bytes [encoding convertto utf-8 [input $kind [parse_size $size]]]
+      set length [string length $bytes]
+      ::foreach {name mode pattern} $corpus {
+        if {![string match [dict get $options -cases] $name]} continue
+        lassign [measure regex::match $mode $pattern $bytes 1] \
+            t result mallocs subs
+        lassign [measure regexp $mode $pattern $bytes 1] cold expected
+        lassign [measure regexp $mode $pattern $bytes 0] warm
+
+        set case $name/$kind/$size
+        set speed [mbps $length $t]
+        dict set results $case $speed
+        set note {}
+        if {$result != $expected} {
+          set note "MISMATCH: $result, regexp $expected"
+          set failed 1
+        } elseif {[dict exists $baseline $case]} {
+          set old [dict get $baseline $case]
+          if {$speed < $old * (1 - $tolerance)} {
+            set note "REGRESSION: was $old"
+            set failed 1
+          }
+        }
+        puts [format "%-16s %-6s %6s %9s %9s %9s %6.2fx %8s %8s  %s" \
+                  $name $kind [format_size $length] $speed \
+                  [mbps $length $cold] [mbps $length $warm] \
+                  [expr {double($cold) / $t}] \
+                  [expr {$mallocs eq {} ? "-" : $mallocs}] \
+                  [expr {$subs eq {} ? "-" : $subs}] $note]
+        flush stdout
+      }
+    }
+  }
+
+  if {[dict get $options -save] ne {}} {
+    set chan [open [dict get $options -save] w]
+    dict for {case speed} $results {puts $chan [list $case $speed]}
+    close $chan
+  }
+  return $failed
+}
+
+if {[info exists argv0] && [file tail $argv0] eq [file tail [info script]]} {
+  exit [regex_bench::run $argv]
+}